@@ -0,0 +1,115 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+// Objects are carved out of large zero-filled chunks and are never freed
+// individually. Everything allocated during a compilation goes away at once
+// in arena_release(). Each thread has an arena of its own.
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next;
+    max_align_t data[];
+};
+
+typedef struct Cleanup Cleanup;
+struct Cleanup {
+    Cleanup *next;
+    void (*fn)(void *);
+    void *arg;
+};
+
+static _Thread_local Chunk *chunks;
+static _Thread_local Cleanup *cleanups;
+static _Thread_local char *cur;
+static _Thread_local char *end;
+
+_Thread_local size_t bytes_allocated;
+
+// Resizes p, an array that is grown with realloc, to cap elements
+void *grow_array(void *p, int cap, size_t size) {
+    p = realloc(p, cap * size);
+    if (p == NULL) {
+        error("Out of memory");
+    }
+
+    bytes_allocated += cap * size;
+    return p;
+}
+
+static Chunk *new_chunk(size_t size) {
+    Chunk *chunk = calloc(1, sizeof(Chunk) + size);
+    if (chunk == NULL) {
+        error("Out of memory");
+    }
+
+    return chunk;
+}
+
+void *arena_alloc(size_t size) {
+    size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    bytes_allocated += size;
+
+    if (size <= (size_t)(end - cur)) {
+        char *p = cur;
+        cur += size;
+        return p;
+    }
+
+    // Large objects get a chunk of their own so that the rest of the
+    // current chunk is not wasted.
+    if (size > CHUNK_SIZE / 4) {
+        Chunk *chunk = new_chunk(size);
+        if (chunks == NULL) {
+            chunks = chunk;
+        } else {
+            chunk->next = chunks->next;
+            chunks->next = chunk;
+        }
+        return chunk->data;
+    }
+
+    Chunk *chunk = new_chunk(CHUNK_SIZE);
+    chunk->next = chunks;
+    chunks = chunk;
+    cur = (char *)chunk->data + size;
+    end = (char *)chunk->data + CHUNK_SIZE;
+    return chunk->data;
+}
+
+char *arena_strndup(char *p, size_t len) {
+    char *buf = arena_alloc(len + 1);
+    memcpy(buf, p, len);
+    return buf;
+}
+
+void arena_on_release(void (*fn)(void *), void *arg) {
+    Cleanup *c = arena_new(Cleanup);
+    c->fn = fn;
+    c->arg = arg;
+    c->next = cleanups;
+    cleanups = c;
+    return;
+}
+
+void arena_release(void) {
+    for (Cleanup *c = cleanups; c != NULL; c = c->next) {
+        c->fn(c->arg);
+    }
+
+    Chunk *chunk = chunks;
+    while (chunk != NULL) {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    chunks = NULL;
+    cleanups = NULL;
+    cur = NULL;
+    end = NULL;
+    return;
+}
@@ -0,0 +1,591 @@
+#include <elf.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "main.h"
+
+// The code generator builds the instructions of a function into a Code
+// list. The list is then either printed as assembly text or encoded into
+// machine code for the ELF writer.
+
+void code_reset(Code *c) {
+    c->len = 0;
+    c->num_labels = 0;
+    c->label_base = 0;
+    c->num_fixups = 0;
+    c->num_label_refs = 0;
+    return;
+}
+
+void code_free(Code *c) {
+    free(c->insts);
+    free(c->labels);
+    free(c->fixups);
+    free(c->label_refs);
+    *c = (Code) {0};
+    return;
+}
+
+Inst *code_add(Code *c, InstKind kind) {
+    if (c->len == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 256;
+        c->insts = grow_array(c->insts, c->cap, sizeof(*c->insts));
+    }
+
+    Inst *inst = &c->insts[c->len++];
+    *inst = (Inst) {0};
+    inst->kind = kind;
+    return inst;
+}
+
+int code_label(Code *c, char *prefix, char *name, int num) {
+    if (c->num_labels == c->labels_cap) {
+        c->labels_cap = c->labels_cap ? c->labels_cap * 2 : 64;
+        c->labels = grow_array(c->labels, c->labels_cap, sizeof(*c->labels));
+    }
+
+    c->labels[c->num_labels] = (Label) { prefix, name, num };
+    return c->num_labels++;
+}
+
+void code_fixup(Code *c, int offset, int type, char *sym) {
+    if (c->num_fixups == c->fixups_cap) {
+        c->fixups_cap = c->fixups_cap ? c->fixups_cap * 2 : 64;
+        c->fixups = grow_array(c->fixups, c->fixups_cap, sizeof(*c->fixups));
+    }
+
+    c->fixups[c->num_fixups++] = (Fixup) { offset, type, sym };
+    return;
+}
+
+// A 64-bit constant is loaded by a movz or movn followed by movk for each
+// remaining 16-bit piece. Whichever of movz and movn leaves fewer pieces
+// to patch is used.
+typedef enum {
+    MOVZ,
+    MOVN,
+    MOVK,
+} MovKind;
+
+typedef struct {
+    MovKind kind;
+    int shift;
+    int imm;
+} MovPiece;
+
+static int split_mov_imm(long long val, MovPiece *pieces) {
+    uint64_t v = val;
+    int nonzero = 0;
+    int nonones = 0;
+
+    for (int i = 0; i < 64; i += 16) {
+        int c = (v >> i) & 0xffff;
+        nonzero += c != 0;
+        nonones += c != 0xffff;
+    }
+
+    bool inverted = nonones < nonzero;
+    int fill = inverted ? 0xffff : 0;
+    int n = 0;
+
+    for (int i = 0; i < 64; i += 16) {
+        int c = (v >> i) & 0xffff;
+        if (c == fill) {
+            continue;
+        }
+
+        if (n == 0) {
+            pieces[n++] = (MovPiece) { inverted ? MOVN : MOVZ, i, inverted ? ~c & 0xffff : c };
+        } else {
+            pieces[n++] = (MovPiece) { MOVK, i, c };
+        }
+    }
+
+    if (n == 0) {
+        pieces[n++] = (MovPiece) { inverted ? MOVN : MOVZ, 0, 0 };
+    }
+
+    return n;
+}
+
+//
+// Assembly text
+//
+
+static char *cond_name[] = {
+    [COND_EQ] = "eq",
+    [COND_NE] = "ne",
+    [COND_GE] = "ge",
+    [COND_LT] = "lt",
+    [COND_GT] = "gt",
+    [COND_LE] = "le",
+};
+
+static void print_reg(Buffer *b, char prefix, int reg) {
+    if (reg == REG_SP) {
+        buf_lit(b, "sp");
+    } else {
+        buf_reg(b, prefix, reg);
+    }
+
+    return;
+}
+
+static void add_label_ref(Code *c, int offset, int num) {
+    if (c->num_label_refs == c->label_refs_cap) {
+        c->label_refs_cap = c->label_refs_cap ? c->label_refs_cap * 2 : 64;
+        c->label_refs = grow_array(c->label_refs, c->label_refs_cap, sizeof(*c->label_refs));
+    }
+
+    c->label_refs[c->num_label_refs++] = (LabelRef) { offset, num };
+    return;
+}
+
+static void print_label(Buffer *b, Code *c, int label) {
+    Label *l = &c->labels[label];
+    buf_str(b, l->prefix);
+    if (l->name != NULL) {
+        buf_str(b, l->name);
+    } else {
+        add_label_ref(c, b->len, l->num);
+        buf_int(b, c->label_base + l->num);
+    }
+
+    return;
+}
+
+// Prints "op rd, rn, rm"
+static void print_rrr(Buffer *b, char *op, Inst *inst) {
+    buf_str(b, op);
+    print_reg(b, 'x', inst->rd);
+    buf_lit(b, ", ");
+    print_reg(b, 'x', inst->rn);
+    buf_lit(b, ", ");
+    print_reg(b, 'x', inst->rm);
+    buf_lit(b, "\n");
+    return;
+}
+
+// Prints "op rd, rn, rm, shift #imm", leaving out a shift of zero
+static void print_shifted(Buffer *b, char *op, char *shift, Inst *inst) {
+    buf_str(b, op);
+    print_reg(b, 'x', inst->rd);
+    buf_lit(b, ", ");
+    print_reg(b, 'x', inst->rn);
+    buf_lit(b, ", ");
+    print_reg(b, 'x', inst->rm);
+    if (inst->imm != 0) {
+        buf_str(b, shift);
+        buf_int(b, inst->imm);
+    }
+    buf_lit(b, "\n");
+    return;
+}
+
+// Prints "op rd, rn, #imm"
+static void print_rri(Buffer *b, char *op, Inst *inst) {
+    buf_str(b, op);
+    print_reg(b, 'x', inst->rd);
+    buf_lit(b, ", ");
+    print_reg(b, 'x', inst->rn);
+    buf_lit(b, ", #");
+    buf_int(b, inst->imm);
+    buf_lit(b, "\n");
+    return;
+}
+
+// Prints "op rd, [rn, #imm]"
+static void print_mem(Buffer *b, char *op, char prefix, Inst *inst) {
+    buf_str(b, op);
+    print_reg(b, prefix, inst->rd);
+    buf_lit(b, ", [");
+    print_reg(b, 'x', inst->rn);
+    if (inst->imm != 0) {
+        buf_lit(b, ", #");
+        buf_int(b, inst->imm);
+    }
+    buf_lit(b, "]\n");
+    return;
+}
+
+static void print_mov_imm(Buffer *b, Inst *inst) {
+    MovPiece pieces[4];
+    int n = split_mov_imm(inst->imm, pieces);
+
+    if (n == 1) {
+        buf_lit(b, "\tmov ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", #");
+        buf_int(b, inst->imm);
+        buf_lit(b, "\n");
+        return;
+    }
+
+    static char *ops[] = { "\tmovz ", "\tmovn ", "\tmovk " };
+    for (int i = 0; i < n; ++i) {
+        buf_str(b, ops[pieces[i].kind]);
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", #");
+        buf_int(b, pieces[i].imm);
+        if (pieces[i].shift != 0) {
+            buf_lit(b, ", lsl #");
+            buf_int(b, pieces[i].shift);
+        }
+        buf_lit(b, "\n");
+    }
+
+    return;
+}
+
+static void print_inst(Buffer *b, Code *c, Inst *inst) {
+    switch (inst->kind) {
+    case I_ADD:
+        print_shifted(b, "\tadd ", ", lsl #", inst);
+        return;
+    case I_SUB:
+        print_shifted(b, "\tsub ", ", lsl #", inst);
+        return;
+    case I_ADD_LSR:
+        print_shifted(b, "\tadd ", ", lsr #", inst);
+        return;
+    case I_MUL:
+        print_rrr(b, "\tmul ", inst);
+        return;
+    case I_SMULH:
+        print_rrr(b, "\tsmulh ", inst);
+        return;
+    case I_SDIV:
+        print_rrr(b, "\tsdiv ", inst);
+        return;
+    case I_NEG:
+        buf_lit(b, "\tneg ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        print_reg(b, 'x', inst->rm);
+        if (inst->imm != 0) {
+            buf_lit(b, ", lsl #");
+            buf_int(b, inst->imm);
+        }
+        buf_lit(b, "\n");
+        return;
+    case I_LSL:
+        print_rri(b, "\tlsl ", inst);
+        return;
+    case I_LSR:
+        print_rri(b, "\tlsr ", inst);
+        return;
+    case I_ASR:
+        print_rri(b, "\tasr ", inst);
+        return;
+    case I_ADD_IMM:
+        print_rri(b, "\tadd ", inst);
+        return;
+    case I_SUB_IMM:
+        print_rri(b, "\tsub ", inst);
+        return;
+    case I_MOV:
+        buf_lit(b, "\tmov ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        print_reg(b, 'x', inst->rn);
+        buf_lit(b, "\n");
+        return;
+    case I_MOV_IMM:
+        print_mov_imm(b, inst);
+        return;
+    case I_CMP:
+        buf_lit(b, "\tcmp ");
+        print_reg(b, 'x', inst->rn);
+        buf_lit(b, ", ");
+        print_reg(b, 'x', inst->rm);
+        buf_lit(b, "\n");
+        return;
+    case I_CMP_IMM:
+        buf_lit(b, "\tcmp ");
+        print_reg(b, 'x', inst->rn);
+        buf_lit(b, ", #");
+        buf_int(b, inst->imm);
+        buf_lit(b, "\n");
+        return;
+    case I_CSET:
+        buf_lit(b, "\tcset ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        buf_str(b, cond_name[inst->imm]);
+        buf_lit(b, "\n");
+        return;
+    case I_LDR:
+        print_mem(b, "\tldr ", 'x', inst);
+        return;
+    case I_LDRB:
+        print_mem(b, "\tldrb ", 'w', inst);
+        return;
+    case I_STR:
+        print_mem(b, "\tstr ", 'x', inst);
+        return;
+    case I_STRB:
+        print_mem(b, "\tstrb ", 'w', inst);
+        return;
+    case I_STP_PRE:
+        buf_lit(b, "\tstp ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        print_reg(b, 'x', inst->rm);
+        buf_lit(b, ", [");
+        print_reg(b, 'x', inst->rn);
+        buf_lit(b, ", #");
+        buf_int(b, inst->imm);
+        buf_lit(b, "]!\n");
+        return;
+    case I_LDP_POST:
+        buf_lit(b, "\tldp ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        print_reg(b, 'x', inst->rm);
+        buf_lit(b, ", [");
+        print_reg(b, 'x', inst->rn);
+        buf_lit(b, "], #");
+        buf_int(b, inst->imm);
+        buf_lit(b, "\n");
+        return;
+    case I_ADR:
+        buf_lit(b, "\tadr ");
+        print_reg(b, 'x', inst->rd);
+        buf_lit(b, ", ");
+        buf_str(b, inst->sym);
+        buf_lit(b, "\n");
+        return;
+    case I_BL:
+        buf_lit(b, "\tbl ");
+        buf_str(b, inst->sym);
+        buf_lit(b, "\n");
+        return;
+    case I_B:
+        buf_lit(b, "\tb ");
+        print_label(b, c, inst->label);
+        buf_lit(b, "\n");
+        return;
+    case I_BCOND:
+        buf_lit(b, "\tb");
+        buf_str(b, cond_name[inst->imm]);
+        buf_lit(b, " ");
+        print_label(b, c, inst->label);
+        buf_lit(b, "\n");
+        return;
+    case I_RET:
+        buf_lit(b, "\tret\n");
+        return;
+    case I_LABEL:
+        print_label(b, c, inst->label);
+        buf_lit(b, ":\n");
+        return;
+    }
+
+    return;
+}
+
+void print_code(Code *c, Buffer *b) {
+    for (int i = 0; i < c->len; ++i) {
+        print_inst(b, c, &c->insts[i]);
+    }
+
+    return;
+}
+
+//
+// Machine code
+//
+
+static void put(Buffer *b, uint32_t insn) {
+    buf_write(b, (char *)&insn, 4);
+    return;
+}
+
+// add, sub or cmp with a 12-bit immediate, optionally shifted left by 12
+static uint32_t add_sub_imm(uint32_t op, int rd, int rn, long long imm) {
+    if (imm >= 0 && imm < 4096) {
+        return op | imm << 10 | rn << 5 | rd;
+    }
+
+    if (imm >= 0 && (imm & 0xfff) == 0 && imm >> 12 < 4096) {
+        return op | 1 << 22 | (imm >> 12) << 10 | rn << 5 | rd;
+    }
+
+    error("Immediate out of range: %lld", imm);
+}
+
+// Loads and stores of size bytes use a scaled unsigned offset if they can,
+// and an unscaled signed 9-bit one otherwise.
+static uint32_t load_store(uint32_t scaled, uint32_t unscaled, int size, Inst *inst) {
+    long long imm = inst->imm;
+
+    if (imm >= 0 && imm % size == 0 && imm / size < 4096) {
+        return scaled | (imm / size) << 10 | inst->rn << 5 | inst->rd;
+    }
+
+    if (imm >= -256 && imm < 256) {
+        return unscaled | (imm & 0x1ff) << 12 | inst->rn << 5 | inst->rd;
+    }
+
+    error("Offset out of range: %lld", imm);
+}
+
+static uint32_t branch(uint32_t op, int bits, int shift, int offset) {
+    int disp = offset / 4;
+    if (disp < -(1 << (bits - 1)) || disp >= 1 << (bits - 1)) {
+        error("Branch out of range");
+    }
+
+    return op | (disp & ((1u << bits) - 1)) << shift;
+}
+
+static int inst_size(Inst *inst) {
+    if (inst->kind == I_LABEL) {
+        return 0;
+    }
+
+    if (inst->kind == I_MOV_IMM) {
+        MovPiece pieces[4];
+        return split_mov_imm(inst->imm, pieces) * 4;
+    }
+
+    return 4;
+}
+
+static void encode_inst(Code *c, Buffer *b, Inst *inst, int pc, int *labels) {
+    int rd = inst->rd;
+    int rn = inst->rn;
+    int rm = inst->rm;
+    uint32_t imm6 = inst->imm & 63;
+
+    switch (inst->kind) {
+    case I_ADD:
+        put(b, 0x8B000000 | rm << 16 | imm6 << 10 | rn << 5 | rd);
+        return;
+    case I_SUB:
+        put(b, 0xCB000000 | rm << 16 | imm6 << 10 | rn << 5 | rd);
+        return;
+    case I_ADD_LSR:
+        put(b, 0x8B400000 | rm << 16 | imm6 << 10 | rn << 5 | rd);
+        return;
+    case I_MUL:
+        put(b, 0x9B007C00 | rm << 16 | rn << 5 | rd);
+        return;
+    case I_SMULH:
+        put(b, 0x9B407C00 | rm << 16 | rn << 5 | rd);
+        return;
+    case I_SDIV:
+        put(b, 0x9AC00C00 | rm << 16 | rn << 5 | rd);
+        return;
+    case I_NEG:
+        put(b, 0xCB0003E0 | rm << 16 | imm6 << 10 | rd);
+        return;
+    // The shifts are aliases of bitfield moves
+    case I_LSL:
+        put(b, 0xD3400000 | (-imm6 & 63) << 16 | (63 - imm6) << 10 | rn << 5 | rd);
+        return;
+    case I_LSR:
+        put(b, 0xD340FC00 | imm6 << 16 | rn << 5 | rd);
+        return;
+    case I_ASR:
+        put(b, 0x9340FC00 | imm6 << 16 | rn << 5 | rd);
+        return;
+    case I_ADD_IMM:
+        put(b, add_sub_imm(0x91000000, rd, rn, inst->imm));
+        return;
+    case I_SUB_IMM:
+        put(b, add_sub_imm(0xD1000000, rd, rn, inst->imm));
+        return;
+    case I_MOV:
+        // mov to or from sp is an alias of add, and otherwise of orr
+        if (rd == REG_SP || rn == REG_SP) {
+            put(b, 0x91000000 | rn << 5 | rd);
+        } else {
+            put(b, 0xAA0003E0 | rn << 16 | rd);
+        }
+        return;
+    case I_MOV_IMM: {
+        static uint32_t ops[] = { 0xD2800000, 0x92800000, 0xF2800000 };
+        MovPiece pieces[4];
+        int n = split_mov_imm(inst->imm, pieces);
+        for (int i = 0; i < n; ++i) {
+            put(b, ops[pieces[i].kind] | (pieces[i].shift / 16) << 21 | pieces[i].imm << 5 | rd);
+        }
+        return;
+    }
+    case I_CMP:
+        put(b, 0xEB00001F | rm << 16 | rn << 5);
+        return;
+    case I_CMP_IMM:
+        put(b, add_sub_imm(0xF1000000, 31, rn, inst->imm));
+        return;
+    case I_CSET:
+        put(b, 0x9A9F07E0 | (inst->imm ^ 1) << 12 | rd);
+        return;
+    case I_LDR:
+        put(b, load_store(0xF9400000, 0xF8400000, 8, inst));
+        return;
+    case I_LDRB:
+        put(b, load_store(0x39400000, 0x38400000, 1, inst));
+        return;
+    case I_STR:
+        put(b, load_store(0xF9000000, 0xF8000000, 8, inst));
+        return;
+    case I_STRB:
+        put(b, load_store(0x39000000, 0x38000000, 1, inst));
+        return;
+    case I_STP_PRE:
+        put(b, 0xA9800000 | (inst->imm / 8 & 0x7f) << 15 | rm << 10 | rn << 5 | rd);
+        return;
+    case I_LDP_POST:
+        put(b, 0xA8C00000 | (inst->imm / 8 & 0x7f) << 15 | rm << 10 | rn << 5 | rd);
+        return;
+    case I_ADR:
+        code_fixup(c, pc, R_AARCH64_ADR_PREL_LO21, inst->sym);
+        put(b, 0x10000000 | rd);
+        return;
+    case I_BL:
+        code_fixup(c, pc, R_AARCH64_CALL26, inst->sym);
+        put(b, 0x94000000);
+        return;
+    case I_B:
+        put(b, branch(0x14000000, 26, 0, labels[inst->label] - pc));
+        return;
+    case I_BCOND:
+        put(b, branch(0x54000000 | inst->imm, 19, 5, labels[inst->label] - pc));
+        return;
+    case I_RET:
+        put(b, 0xD65F03C0);
+        return;
+    case I_LABEL:
+        return;
+    }
+
+    return;
+}
+
+// Appends the machine code for c to b. Branches to local labels are
+// resolved here; references to symbols are recorded in c->fixups, with
+// offsets relative to the start of the code.
+void encode_code(Code *c, Buffer *b) {
+    int *labels = malloc(sizeof(int) * (c->num_labels + 1));
+    if (labels == NULL) {
+        error("Out of memory");
+    }
+
+    int pc = 0;
+    for (int i = 0; i < c->len; ++i) {
+        if (c->insts[i].kind == I_LABEL) {
+            labels[c->insts[i].label] = pc;
+        }
+        pc += inst_size(&c->insts[i]);
+    }
+
+    pc = 0;
+    for (int i = 0; i < c->len; ++i) {
+        encode_inst(c, b, &c->insts[i], pc, labels);
+        pc += inst_size(&c->insts[i]);
+    }
+
+    free(labels);
+    return;
+}
@@ -0,0 +1,62 @@
+// Code generator throughput benchmark.
+//
+// Usage: bench/codegen <file> [iterations]
+//
+// Parses <file> once, then generates assembly for it repeatedly into a
+// temporary file and reports the best throughput in emitted MB/s.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "main.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    Obj *prog = parse(tokenize_file(path));
+
+    char tmp[] = "/tmp/codegen-XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        error("Cannot create a temporary file");
+    }
+    unlink(tmp);
+
+    double best = 0;
+    long bytes = 0;
+    for (int i = 0; i < iterations; ++i) {
+        if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+            error("Cannot reset the temporary file");
+        }
+
+        double start = now();
+        codegen(prog, fd, false);
+        double elapsed = now() - start;
+
+        struct stat st;
+        fstat(fd, &st);
+        bytes = st.st_size;
+
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("codegen %8.1f ms  %10.1f MB/s  (%ld bytes)\n", best * 1e3,
+           bytes / best / 1e6, bytes);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,91 @@
+// Compiler throughput benchmark.
+//
+// Usage: bench/compile <file> [iterations]
+//
+// Tokenizes, parses and generates assembly for <file> repeatedly, and
+// reports the best time of each phase, the throughput of the best times
+// together in lines and tokens per second, and the peak RSS. The output is
+// thrown away. Errors in the input are counted and not printed; a file with
+// errors is not passed to the code generator.
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "main.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void keep_best(double *best, double t, int i) {
+    if (i == 0 || t < *best) {
+        *best = t;
+    }
+
+    return;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+
+    int fd = open("/dev/null", O_WRONLY);
+    error_output = fopen("/dev/null", "w");
+    if (fd < 0 || error_output == NULL) {
+        error("Cannot open /dev/null");
+    }
+    max_errors = 0;
+
+    double tokenize = 0;
+    double parse_time = 0;
+    double gen = 0;
+    long lines = 0;
+    long toks = 0;
+    int errors = 0;
+
+    for (int i = 0; i < iterations; ++i) {
+        double t0 = now();
+        Token tk = tokenize_file(path);
+        double t1 = now();
+        Obj *prog = parse(tk);
+        double t2 = now();
+
+        errors = error_count();
+        if (errors == 0) {
+            codegen(prog, fd, false);
+        }
+        double t3 = now();
+
+        lines = tokens->num_lines;
+        toks = tokens->len;
+        arena_release();
+
+        keep_best(&tokenize, t1 - t0, i);
+        keep_best(&parse_time, t2 - t1, i);
+        keep_best(&gen, t3 - t2, i);
+    }
+
+    double total = tokenize + parse_time + gen;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("tokenize %8.1f ms  parse %8.1f ms  codegen %8.1f ms  total %8.1f ms  "
+           "%9.0f lines/s  %10.0f tokens/s  peak %7.1f MB",
+           tokenize * 1e3, parse_time * 1e3, gen * 1e3, total * 1e3,
+           lines / total, toks / total, ru.ru_maxrss / 1024.0);
+    if (errors > 0) {
+        printf("  (%d errors)", errors);
+    }
+    printf("\n");
+    return EXIT_SUCCESS;
+}
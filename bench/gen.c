@@ -0,0 +1,162 @@
+// Synthetic source generator for the benchmarks.
+//
+// Usage: bench/gen [-f functions] [-d depth] [-l locals] [-s strings]
+//                  [-g globals] [-e errors] [-r seed]
+//
+// Writes a program in the subset of C the compiler accepts to stdout. It
+// has the given number of functions, each with the given number of locals
+// and string literals and with expressions that are full trees of the
+// given depth, and the given number of global variables, which the
+// functions use. With -e, that many functions refer to an undeclared
+// variable, for measuring diagnostics. The output depends only on the
+// options, so that runs can be compared.
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static int num_functions = 1000;
+static int depth = 4;
+static int num_locals = 8;
+static int num_strings = 1;
+static int num_globals = 100;
+static int num_errors = 0;
+static uint64_t state = 1;
+
+// Locals declared so far in the current function
+static int visible_locals;
+
+static int rnd(int n) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 33) % n;
+}
+
+// Prints a variable the current function can use
+static void var(void) {
+    int n = 2 + visible_locals + num_globals;
+    int i = rnd(n);
+    if (i < 2) {
+        printf("%c", "ab"[i]);
+    } else if (i < 2 + visible_locals) {
+        printf("v%d", i - 2);
+    } else {
+        printf("g%d", i - 2 - visible_locals);
+    }
+
+    return;
+}
+
+// Prints an expression that is a full tree of binary operators of depth
+// d, so that each level doubles its size
+static void expr(int d) {
+    if (d == 0) {
+        switch (rnd(8)) {
+        case 0:
+            printf("-");
+            var();
+            return;
+        case 1:
+            printf("sizeof(");
+            var();
+            printf(")");
+            return;
+        case 2:
+        case 3:
+        case 4:
+            var();
+            return;
+        default:
+            printf("%d", rnd(1000));
+            return;
+        }
+    }
+
+    static char *ops[] = { "+", "-", "*", "/", "<", "<=", "==", "!=" };
+    printf("(");
+    expr(d - 1);
+    printf(" %s ", ops[rnd(8)]);
+    expr(d - 1);
+    printf(")");
+    return;
+}
+
+static void string(void) {
+    printf("\"");
+    int len = 8 + rnd(32);
+    for (int i = 0; i < len; ++i) {
+        printf("%c", 'a' + rnd(26));
+    }
+    printf("\"");
+    return;
+}
+
+static void function(int n) {
+    printf("int f%d(int a, int b) {\n", n);
+    printf("    int i;\n");
+    for (visible_locals = 0; visible_locals < num_locals; ++visible_locals) {
+        printf("    int v%d = ", visible_locals);
+        expr(depth);
+        printf(";\n");
+    }
+
+    for (int i = 0; i < num_strings; ++i) {
+        printf("    a = a + ");
+        string();
+        printf("[%d];\n", rnd(8));
+    }
+
+    if (n < num_errors) {
+        printf("    a = undeclared%d;\n", n);
+    }
+
+    printf("    for (i = 0; i < %d; i = i + 1) {\n", 1 + rnd(10));
+    printf("        if (");
+    expr(depth);
+    printf(") a = a + ");
+    expr(depth);
+    printf("; else b = b - 1;\n");
+    printf("    }\n");
+
+    if (n > 0) {
+        printf("    b = f%d(", rnd(n));
+        expr(depth);
+        printf(", b);\n");
+    }
+
+    printf("    return ");
+    expr(depth);
+    printf(";\n}\n\n");
+    return;
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "f:d:l:s:g:e:r:")) != -1) {
+        switch (c) {
+        case 'f': num_functions = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 'l': num_locals = atoi(optarg); break;
+        case 's': num_strings = atoi(optarg); break;
+        case 'g': num_globals = atoi(optarg); break;
+        case 'e': num_errors = atoi(optarg); break;
+        case 'r': state = strtoull(optarg, NULL, 10); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f functions] [-d depth] [-l locals] [-s strings] "
+                    "[-g globals] [-e errors] [-r seed]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (int i = 0; i < num_globals; ++i) {
+        printf("int g%d;\n", i);
+    }
+    printf("\n");
+
+    for (int i = 0; i < num_functions; ++i) {
+        function(i);
+    }
+
+    printf("int main() { return f%d(1, 2); }\n", num_functions - 1);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,26 @@
+#!/usr/bin/env bash
+#
+# Symbol lookup benchmark: a translation unit with $N globals and a main()
+# that references every one of them.
+#
+# Usage: bench/globals.sh [compiler...]   (default: ./main)
+
+n=${N:-50000}
+compilers=${@:-./main}
+
+tmp=`mktemp -d /tmp/XXXXXX`
+trap 'rm -rf $tmp' EXIT
+
+awk -v n=$n 'BEGIN {
+    for (i = 0; i < n; i++) printf "int g%d;\n", i;
+    print "int main() {";
+    for (i = 0; i < n; i++) printf "    g%d = g%d + %d;\n", i, n - 1 - i, i % 7;
+    print "    return g0;";
+    print "}";
+}' > $tmp/globals.c
+
+TIMEFORMAT='%3R s'
+for cc in $compilers; do
+    echo -n "$cc ($n globals): "
+    { time $cc -o $tmp/out.s $tmp/globals.c; } 2>&1
+done
@@ -0,0 +1,61 @@
+// Lexer throughput benchmark.
+//
+// Usage: bench/lex <file> [iterations]
+//
+// Tokenizes <file> repeatedly with each set of scanning kernels the CPU
+// supports and reports the best throughput in MB/s.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "main.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        error("Cannot stat %s", path);
+    }
+
+    char *names[] = { "scalar", "sse2", "avx2", "neon" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(*names)); ++i) {
+        if (!scan_use(names[i])) {
+            continue;
+        }
+
+        double best = 0;
+        long count = 0;
+        for (int j = 0; j < iterations; ++j) {
+            double start = now();
+            tokenize_file(path);
+            double elapsed = now() - start;
+
+            // Don't count the EOF token
+            count = tokens->len - 1;
+            arena_release();
+
+            if (j == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-8s %10.1f MB/s %12.0f tokens/s  (%ld tokens)\n", names[i],
+               st.st_size / best / 1e6, count / best, count);
+    }
+
+    return EXIT_SUCCESS;
+}
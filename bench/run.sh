@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+#
+# Compiler throughput benchmark suite, run by `make bench`. Generates
+# inputs with bench/gen that stress one dimension each, and times them with
+# bench/compile. Every dimension is then measured again at four times the
+# size; if that takes more than $MAX_RATIO times as long, the growth is
+# reported as superlinear and the script fails.
+#
+# Usage: bench/run.sh   (ITERATIONS=n and MAX_RATIO=r override the defaults)
+
+iterations=${ITERATIONS:-5}
+max_ratio=${MAX_RATIO:-6}
+
+tmp=`mktemp -d /tmp/XXXXXX`
+trap 'rm -rf $tmp' EXIT
+
+# name, then the options to bench/gen for the base size and for four times it
+workloads=(
+    "functions  -f 1000                   -f 4000"
+    "depth      -f 100 -d 6               -f 100 -d 8"
+    "locals     -f 100 -l 50              -f 100 -l 200"
+    "strings    -f 100 -s 50              -f 100 -s 200"
+    "globals    -f 100 -g 5000            -f 100 -g 20000"
+    "errors     -f 1000 -e 1000           -f 4000 -e 4000"
+)
+
+# Prints the total time from a line of bench/compile output
+total() {
+    sed 's/.* total *\([0-9.]*\) ms.*/\1/'
+}
+
+failed=0
+for w in "${workloads[@]}"; do
+    name=`echo $w | cut -d' ' -f1`
+    opts=`echo $w | sed 's/^[a-z]* *//'`
+    small=`echo "$opts" | awk '{ for (i = 1; i <= NF / 2; i++) printf "%s ", $i }'`
+    large=`echo "$opts" | awk '{ for (i = NF / 2 + 1; i <= NF; i++) printf "%s ", $i }'`
+
+    bench/gen $small > $tmp/small.c
+    bench/gen $large > $tmp/large.c
+    s=`bench/compile $tmp/small.c $iterations` &&
+    l=`bench/compile $tmp/large.c $iterations`
+    if [ $? -ne 0 ]; then
+        echo "$name: compilation failed"
+        failed=1
+        continue
+    fi
+
+    printf '%-10s 1x  %s\n' $name "$s"
+    printf '%-10s 4x  %s\n' $name "$l"
+
+    ratio=`awk -v s=$(echo "$s" | total) -v l=$(echo "$l" | total) 'BEGIN { printf "%.1f", l / s }'`
+    if awk -v r=$ratio -v m=$max_ratio 'BEGIN { exit !(r > m) }'; then
+        echo "$name: 4x input took ${ratio}x as long (superlinear)"
+        failed=1
+    fi
+done
+
+exit $failed
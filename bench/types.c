@@ -0,0 +1,52 @@
+// Type annotation benchmark.
+//
+// Usage: bench/types <file> [iterations]
+//
+// Parses <file> repeatedly and reports the best parse time together with
+// the number of AST nodes and of nodes visited by add_type.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "main.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <file> [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    double best = 0;
+    long num_nodes = 0;
+    long visits = 0;
+    for (int i = 0; i < iterations; ++i) {
+        Token tk = tokenize_file(path);
+        type_visits = 0;
+
+        double start = now();
+        parse(tk);
+        double elapsed = now() - start;
+
+        // Don't count the null node
+        num_nodes = nodes->len - 1;
+        visits = type_visits;
+        arena_release();
+
+        if (i == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("parse %8.1f ms  %ld nodes  %ld type visits (%.2f per node)\n",
+           best * 1e3, num_nodes, visits, (double)visits / num_nodes);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,407 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "main.h"
+
+// On-disk cache of generated code, one entry per function. An entry is the
+// function's output, stored under a hash of what the output depends on:
+// the tokens of the definition, the types of the variables it uses, where
+// its locals live, the names of the globals it refers to, and whether
+// assembly or an object file is being written.
+//
+// Output is stored without anything that depends on where the function
+// lands in the file. Machine code is kept with its fixups, as it goes to
+// the ELF writer. Assembly text is kept with the numbers of its numbered
+// labels cut out, and they are filled back in from the label_base of the
+// function being written.
+//
+// Entries are written to a temporary file and renamed into place, so
+// processes and threads sharing a cache never see a partly written entry.
+// Entries that cannot be read or written are treated as misses; the cache
+// never fails a compilation.
+
+// Change this whenever the code generator or the entry format changes
+#define CACHE_VERSION "6"
+#define CACHE_MAGIC 0x68636301
+
+char *cache_dir;
+
+static atomic_long hits;
+static atomic_long misses;
+static atomic_long bytes_read;
+static atomic_long bytes_written;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t is_obj;
+    uint32_t num_labels;
+    uint32_t num_refs;
+    uint32_t data_len;
+    uint32_t strs_len;
+} EntryHeader;
+
+// A fixup, whose symbol is an offset into the string table, or a numbered
+// label to insert into the text
+typedef struct {
+    int32_t offset;
+    int32_t val;
+    int32_t sym;
+} CachedRef;
+
+void cache_init(char *dir) {
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        error("Cannot create cache directory: %s: %s", dir, strerror(errno));
+    }
+
+    cache_dir = dir;
+    return;
+}
+
+//
+// Keys
+//
+
+// Keys are 128 bits, from two 64-bit lanes that take input 8 bytes at a
+// time with different multipliers and rotations.
+static void hash_word(CacheKey *h, uint64_t w) {
+    h->lo = (h->lo ^ w) * 0x9e3779b97f4a7c15;
+    h->lo = h->lo << 31 | h->lo >> 33;
+    h->hi = (h->hi ^ w) * 0xc2b2ae3d27d4eb4f;
+    h->hi = h->hi << 27 | h->hi >> 37;
+    return;
+}
+
+static void hash_bytes(CacheKey *h, void *p, size_t len) {
+    unsigned char *s = p;
+    for (; len >= 8; s += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, s, 8);
+        hash_word(h, w);
+    }
+
+    // The length goes into the last word, so that inputs differing only in
+    // trailing zero bytes hash differently
+    uint64_t w = (uint64_t)len << 56;
+    memcpy(&w, s, len);
+    hash_word(h, w);
+    return;
+}
+
+static void hash_int(CacheKey *h, long long val) {
+    hash_word(h, val);
+    return;
+}
+
+static void hash_str(CacheKey *h, char *s) {
+    hash_bytes(h, s, strlen(s) + 1);
+    return;
+}
+
+static void hash_type(CacheKey *h, Type *ty) {
+    if (ty == NULL) {
+        hash_int(h, -1);
+        return;
+    }
+
+    hash_int(h, ty->kind);
+    hash_int(h, ty->size);
+    switch (ty->kind) {
+    case TY_PTR:
+        hash_type(h, ty->base);
+        return;
+    case TY_ARRAY:
+        hash_int(h, ty->array_len);
+        hash_type(h, ty->base);
+        return;
+    case TY_FUNC:
+        hash_type(h, ty->return_ty);
+        hash_int(h, ty->num_params);
+        for (int i = 0; i < ty->num_params; ++i) {
+            hash_type(h, ty->params[i]);
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+static void hash_var(CacheKey *h, Obj *var) {
+    hash_type(h, var->ty);
+    if (var->is_local) {
+        hash_int(h, var->offset);
+    } else {
+        hash_str(h, var->name);
+    }
+
+    return;
+}
+
+// The tokens of a function fix the shape of its tree and which of its
+// locals each name refers to, and the types of its nodes follow from those
+// of its variables. What is left is the layout of the locals, which is
+// hashed from the list of them, and what is found here: the globals it
+// uses, and the constants the parser worked out from types, such as the
+// values of sizeof.
+static void hash_body(CacheKey *h, Node node) {
+    if (node == 0) {
+        return;
+    }
+
+    switch (node_kind(node)) {
+    case ND_NUM:
+        hash_int(h, node_val(node));
+        return;
+    case ND_VAR:
+        if (!node_var(node)->is_local) {
+            hash_var(h, node_var(node));
+        }
+        return;
+    case ND_NEG:
+    case ND_ADDR:
+    case ND_DEREF:
+    case ND_RETURN:
+    case ND_EXPR_STMT:
+        hash_body(h, node_lhs(node));
+        return;
+    case ND_IF:
+        hash_body(h, node_cond(node));
+        hash_body(h, node_then(node));
+        hash_body(h, node_els(node));
+        return;
+    case ND_FOR:
+        hash_body(h, node_cond(node));
+        hash_body(h, node_then(node));
+        hash_body(h, node_init(node));
+        hash_body(h, node_inc(node));
+        return;
+    case ND_FUNC_CALL:
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        for (int i = 0; i < node_count(node); ++i) {
+            hash_body(h, node_children(node)[i]);
+        }
+        return;
+    default:
+        hash_body(h, node_lhs(node));
+        hash_body(h, node_rhs(node));
+        return;
+    }
+}
+
+void cache_key(Obj *fn, bool emit_obj, CacheKey *key) {
+    *key = (CacheKey) { 0x62b821756295c58d, 0x6c62272e07bb0142 };
+    hash_str(key, CACHE_VERSION);
+    hash_int(key, emit_obj);
+
+    for (Token tk = fn->begin; tk < fn->end; ++tk) {
+        hash_int(key, tk_kind(tk));
+        hash_bytes(key, tk_loc(tk), tk_len(tk));
+    }
+
+    hash_type(key, fn->ty);
+    hash_int(key, fn->stack_size);
+    for (Obj *v = fn->locals; v != NULL; v = v->next) {
+        hash_var(key, v);
+    }
+
+    hash_body(key, fn->body);
+    return;
+}
+
+static char *entry_path(CacheKey *key) {
+    // Not in the arena, as this runs on the thread pool
+    char *path = malloc(strlen(cache_dir) + 34);
+    if (path == NULL) {
+        error("Out of memory");
+    }
+
+    sprintf(path, "%s/%016llx%016llx", cache_dir,
+            (unsigned long long)key->hi, (unsigned long long)key->lo);
+    return path;
+}
+
+//
+// Entries
+//
+
+static char *read_entry(CacheKey *key, size_t *len) {
+    char *path = entry_path(key);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(EntryHeader)) {
+        buf = malloc(st.st_size);
+        if (buf != NULL && !read_full(fd, buf, st.st_size)) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = st.st_size;
+    }
+
+    close(fd);
+    return buf;
+}
+
+// Checks that an entry is complete and refers only to what it contains
+static bool check_entry(char *buf, size_t len) {
+    EntryHeader *hdr = (EntryHeader *)buf;
+    if (len < sizeof(*hdr) || hdr->magic != CACHE_MAGIC ||
+        len != sizeof(*hdr) + sizeof(CachedRef) * (size_t)hdr->num_refs +
+               hdr->data_len + hdr->strs_len) {
+        return false;
+    }
+
+    CachedRef *refs = (CachedRef *)(hdr + 1);
+    char *strs = (char *)(refs + hdr->num_refs) + hdr->data_len;
+    if (hdr->strs_len > 0 && strs[hdr->strs_len - 1] != '\0') {
+        return false;
+    }
+
+    int32_t prev = 0;
+    for (uint32_t i = 0; i < hdr->num_refs; ++i) {
+        if (refs[i].offset < prev || (uint32_t)refs[i].offset > hdr->data_len) {
+            return false;
+        }
+        if (hdr->is_obj && (refs[i].sym < 0 || (uint32_t)refs[i].sym >= hdr->strs_len)) {
+            return false;
+        }
+        prev = refs[i].offset;
+    }
+
+    return true;
+}
+
+// Returns the entry for key, or NULL on a miss. The caller frees it once
+// it has been rendered.
+char *cache_load(CacheKey *key, int *num_labels) {
+    size_t len = 0;
+    char *buf = read_entry(key, &len);
+    if (buf == NULL || !check_entry(buf, len)) {
+        free(buf);
+        atomic_fetch_add(&misses, 1);
+        return NULL;
+    }
+
+    *num_labels = ((EntryHeader *)buf)->num_labels;
+    atomic_fetch_add(&hits, 1);
+    atomic_fetch_add(&bytes_read, len);
+    return buf;
+}
+
+// Appends the output stored in an entry to out. Numbered labels are offset
+// by code->label_base, and fixups are added to code. Their symbols point
+// into the entry.
+void cache_render(char *entry, Code *code, Buffer *out) {
+    EntryHeader *hdr = (EntryHeader *)entry;
+    CachedRef *refs = (CachedRef *)(hdr + 1);
+    char *data = (char *)(refs + hdr->num_refs);
+    char *strs = data + hdr->data_len;
+
+    if (hdr->is_obj) {
+        buf_write(out, data, hdr->data_len);
+        for (uint32_t i = 0; i < hdr->num_refs; ++i) {
+            code_fixup(code, refs[i].offset, refs[i].val, strs + refs[i].sym);
+        }
+        return;
+    }
+
+    int pos = 0;
+    for (uint32_t i = 0; i < hdr->num_refs; ++i) {
+        buf_write(out, data + pos, refs[i].offset - pos);
+        buf_int(out, code->label_base + refs[i].val);
+        pos = refs[i].offset;
+    }
+
+    buf_write(out, data + pos, hdr->data_len - pos);
+    return;
+}
+
+static void add_ref(Buffer *refs, int offset, int val, int sym) {
+    CachedRef ref = { offset, val, sym };
+    buf_write(refs, (char *)&ref, sizeof(ref));
+    return;
+}
+
+// Stores the output of a function, which is in out
+void cache_store(CacheKey *key, bool emit_obj, Code *code, int num_labels, Buffer *out) {
+    Buffer refs;
+    Buffer data;
+    Buffer strs;
+    buf_init(&refs, -1);
+    buf_init(&data, -1);
+    buf_init(&strs, -1);
+
+    if (emit_obj) {
+        buf_write(&data, out->data, out->len);
+        for (int i = 0; i < code->num_fixups; ++i) {
+            Fixup *f = &code->fixups[i];
+            add_ref(&refs, f->offset, f->type, strs.len);
+            buf_write(&strs, f->sym, strlen(f->sym) + 1);
+        }
+    } else {
+        size_t pos = 0;
+        for (int i = 0; i < code->num_label_refs; ++i) {
+            LabelRef *r = &code->label_refs[i];
+            buf_write(&data, out->data + pos, r->offset - pos);
+            add_ref(&refs, data.len, r->num, -1);
+
+            pos = r->offset;
+            while (pos < out->len && '0' <= out->data[pos] && out->data[pos] <= '9') {
+                pos++;
+            }
+        }
+        buf_write(&data, out->data + pos, out->len - pos);
+    }
+
+    EntryHeader hdr = {
+        CACHE_MAGIC, emit_obj, num_labels,
+        refs.len / sizeof(CachedRef), data.len, strs.len,
+    };
+
+    char *path = entry_path(key);
+    char *tmp = malloc(strlen(cache_dir) + 16);
+    if (tmp == NULL) {
+        error("Out of memory");
+    }
+    sprintf(tmp, "%s/.tmp.XXXXXX", cache_dir);
+
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        bool ok = write_full(fd, &hdr, sizeof(hdr)) &&
+                  write_full(fd, refs.data, refs.len) &&
+                  write_full(fd, data.data, data.len) &&
+                  write_full(fd, strs.data, strs.len);
+        ok = close(fd) == 0 && ok;
+        if (ok && rename(tmp, path) == 0) {
+            atomic_fetch_add(&bytes_written, sizeof(hdr) + refs.len + data.len + strs.len);
+        } else {
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(path);
+    buf_free(&refs);
+    buf_free(&data);
+    buf_free(&strs);
+    return;
+}
+
+void cache_report(void) {
+    fprintf(stderr, "cache: %ld hits, %ld misses, %ld bytes read, %ld bytes written\n",
+            atomic_load(&hits), atomic_load(&misses),
+            atomic_load(&bytes_read), atomic_load(&bytes_written));
+    return;
+}
@@ -1,272 +1,780 @@
 #include <assert.h>
-#include <stdarg.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "main.h"
 
-static FILE *output_file = NULL;
-static int depth = 0;
-static char *argreg32[] = {"w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7"};
-static char *argreg64[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
-static Obj *current_fn = NULL;
+// Functions are generated independently of each other, in batches on a
+// thread pool. Each one gets a context with its own instruction list and
+// output buffer, and the buffers are written out in source order.
+//
+// Numbered labels must be unique across the file. A function numbers its
+// labels from zero while it is generated, and the offset for each
+// function is the count of labels in the functions before it, so the
+// output does not depend on how the work was scheduled.
+typedef struct {
+    Obj *fn;
+    IrFunc ir;
+    Code code;
+    Buffer out;
+    int return_label;
+    int num_labels;
 
-static void println(char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(output_file, fmt, ap);
-    fprintf(output_file, "\n");
-    va_end(ap);
+    // Location of each value, and the instructions that define it and use
+    // it last
+    int *loc;
+    int *def;
+    int *last;
+    int values_cap;
+
+    // Last instruction that needs each stack slot
+    int *slots;
+    int num_slots;
+    int slots_cap;
+
+    // Label of each block, or -1 if nothing branches to it
+    int *labels;
+    int labels_cap;
+
+    // The function's key in the cache, and its entry if there was one
+    CacheKey key;
+    char *cached;
+} FnGen;
+
+// Functions generated at once. A batch is kept in memory until it has
+// been written out.
+#define BATCH_SIZE 256
+
+// Assembly text for functions with more instructions than this is not
+// buffered but printed straight to the output when the function's turn
+// comes, as the text would take much more memory than the instructions.
+#define MAX_BUFFERED_INSTS (1 << 16)
+
+// The file being compiled. Tasks on the pool adopt its state from the
+// batch before they generate any code.
+typedef struct {
+    FnGen *fns;
+    TokenStream *tokens;
+    NodePool *nodes;
+    char **atoms;
+    FILE *error_output;
+    bool emit_obj;
+} Batch;
+
+static _Thread_local Buffer out;
+static _Thread_local bool emit_obj;
+
+// Directives are written to the output piecewise: fixed text with emit(),
+// operands with emit_int() and emit_str(). Instructions are collected in
+// the function's code and written out a function at a time.
+#define emit(s) buf_lit(&out, s)
+
+static void emit_int(long long val) {
+    buf_int(&out, val);
     return;
 }
 
-static int count(void) {
-    static int i = 0;
-    return i++;
+static void emit_str(char *s) {
+    buf_str(&out, s);
+    return;
 }
 
-static void push(char *reg) {
-    if ((depth++ & 1) == 0) {
-        println("\tsub sp, sp, #16");
-        println("\tstr %s, [sp, #8]", reg);
-    } else {
-        println("\tstr %s, [sp]", reg);
+static void emit_rrr(FnGen *g, InstKind kind, int rd, int rn, int rm) {
+    Inst *inst = code_add(&g->code, kind);
+    inst->rd = rd;
+    inst->rn = rn;
+    inst->rm = rm;
+    return;
+}
+
+static void emit_rri(FnGen *g, InstKind kind, int rd, int rn, long long imm) {
+    Inst *inst = code_add(&g->code, kind);
+    inst->rd = rd;
+    inst->rn = rn;
+    inst->imm = imm;
+    return;
+}
+
+static void emit_shifted(FnGen *g, InstKind kind, int rd, int rn, int rm, int shift) {
+    Inst *inst = code_add(&g->code, kind);
+    inst->rd = rd;
+    inst->rn = rn;
+    inst->rm = rm;
+    inst->imm = shift;
+    return;
+}
+
+static void emit_sym(FnGen *g, InstKind kind, int rd, char *sym) {
+    Inst *inst = code_add(&g->code, kind);
+    inst->rd = rd;
+    inst->sym = sym;
+    return;
+}
+
+static void emit_jump(FnGen *g, InstKind kind, int label) {
+    code_add(&g->code, kind)->label = label;
+    return;
+}
+
+static void emit_bcond(FnGen *g, CondCode cond, int label) {
+    Inst *inst = code_add(&g->code, I_BCOND);
+    inst->imm = cond;
+    inst->label = label;
+    return;
+}
+
+static void emit_label(FnGen *g, int label) {
+    code_add(&g->code, I_LABEL)->label = label;
+    return;
+}
+
+static int count(FnGen *g) {
+    return g->num_labels++;
+}
+
+static int align_to(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+//
+// Register allocation
+//
+
+// Values are allocated to registers x9-x15 by linear scan over the
+// instructions in layout order. A value that is live across a call, or
+// that does not get a register, is kept in a stack slot at the bottom of
+// the frame instead, and is loaded into a scratch register where it is
+// used. The value in a slot is stored from a scratch register where it is
+// defined.
+//
+// The address of a local variable close to the frame pointer is not put
+// anywhere if it is only used to load or store the variable; the access is
+// made relative to the frame pointer instead. Likewise, constants that
+// instruction selection folds into shifts and multiplies, and multiplies
+// that are folded into an add or subtract, get no location. Parameters stay
+// in the registers they are passed in if they are not used after a call.
+#define REG_TEMP 9
+#define NUM_TEMPS 7
+#define REG_SCRATCH0 16
+#define REG_SCRATCH1 17
+
+// Locations at and above LOC_SLOT are stack slots
+#define LOC_NONE -1
+#define LOC_SLOT 32
+
+static void grow_values(FnGen *g, int n) {
+    if (n > g->values_cap) {
+        g->values_cap = n * 2;
+        g->loc = grow_array(g->loc, g->values_cap, sizeof(*g->loc));
+        g->def = grow_array(g->def, g->values_cap, sizeof(*g->def));
+        g->last = grow_array(g->last, g->values_cap, sizeof(*g->last));
     }
 
     return;
 }
 
-static void pop(char *reg) {
-    if ((--depth & 1) == 0) {
-        println("\tldr %s, [sp, #8]", reg);
-        println("\tadd sp, sp, #16");
-    } else {
-        println("\tldr %s, [sp]", reg);
+static bool reduces_const(FnGen *g, IrInst *inst);
+static bool folds_into_shift(FnGen *g, int v, int *x);
+
+// Finds where each value is defined and last used. A value that is live
+// into a loop is kept live until the jump back to the start of the loop.
+static void find_live_ranges(FnGen *g) {
+    IrFunc *f = &g->ir;
+    int *block_of = malloc(sizeof(int) * (f->len + 1));
+    int *globals = malloc(sizeof(int) * (f->num_values + 1));
+    bool *is_global = calloc(f->num_values + 1, sizeof(bool));
+    int *num_uses = calloc(f->num_values + 1, sizeof(int));
+    if (block_of == NULL || globals == NULL || is_global == NULL || num_uses == NULL) {
+        error("Out of memory");
+    }
+
+    for (int i = 0; i < f->num_order; ++i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        for (int j = bb->begin; j < bb->end; ++j) {
+            block_of[j] = f->order[i];
+        }
     }
 
+    // Values used in other blocks than their own are the only ones that
+    // can be live into a loop
+    int num_globals = 0;
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        if (inst->dst != 0) {
+            g->def[inst->dst] = i;
+            g->last[inst->dst] = i;
+            bool near = inst->op == IR_LOCAL && inst->var->offset <= 256;
+            g->loc[inst->dst] = near || inst->op == IR_IMM ? LOC_NONE : 0;
+        }
+
+        int *ops[8];
+        int n = ir_operands(f, inst, ops);
+        for (int j = 0; j < n; ++j) {
+            int v = *ops[j];
+            bool is_addr = j == 0 && (inst->op == IR_LOAD || inst->op == IR_STORE);
+            bool is_folded = j == 1 && reduces_const(g, inst);
+            if (!is_addr && !is_folded && g->loc[v] == LOC_NONE) {
+                g->loc[v] = 0;
+            }
+            if (block_of[g->def[v]] != block_of[i] && !is_global[v]) {
+                is_global[v] = true;
+                globals[num_globals++] = v;
+            }
+            g->last[v] = i;
+            num_uses[v]++;
+        }
+    }
+
+    // A multiply by a power of two that is only used by an add or subtract
+    // in the same block becomes a shifted operand of it. The value being
+    // shifted then has to live until the add.
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        if (inst->op != IR_ADD && inst->op != IR_SUB) {
+            continue;
+        }
+
+        for (int j = inst->op == IR_ADD ? 0 : 1; j < 2; ++j) {
+            int v = j == 0 ? inst->a : inst->b;
+            int x;
+            if (num_uses[v] == 1 && block_of[g->def[v]] == block_of[i] && folds_into_shift(g, v, &x)) {
+                g->loc[v] = LOC_NONE;
+                if (g->last[x] < i) {
+                    g->last[x] = i;
+                }
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        int num_succs = inst->op == IR_BR ? 2 : inst->op == IR_JMP;
+        for (int j = 0; j < num_succs; ++j) {
+            int head = f->blocks[inst->succ[j]].begin;
+            if (head > i) {
+                continue;
+            }
+
+            for (int k = 0; k < num_globals; ++k) {
+                int v = globals[k];
+                if (g->def[v] < head && g->last[v] >= head && g->last[v] < i) {
+                    g->last[v] = i;
+                }
+            }
+        }
+    }
+
+    free(block_of);
+    free(globals);
+    free(is_global);
+    free(num_uses);
     return;
 }
 
-static void store(char *dst, char *src, Type *ty) {
-    if (ty->kind == TY_ARRAY) {
-        return;
+// Returns a stack slot that is free from instruction def on, and reserves
+// it until instruction last. Slots are handed out in order of definition,
+// and a slot is reused only once every value put in it has died.
+static int alloc_slot(FnGen *g, int def, int last) {
+    for (int i = 0; i < g->num_slots; ++i) {
+        if (g->slots[i] < def) {
+            g->slots[i] = last;
+            return LOC_SLOT + i;
+        }
     }
 
-    switch (ty->size) {
-    case 1:
-        println("\tstrb w%s, [%s]", &dst[1], src);
-        return;
-    case 8:
-        println("\tstr x%s, [%s]", &dst[1], src);
-        return;
-    default:
-        assert(false);
-        return;
+    if (g->num_slots == g->slots_cap) {
+        g->slots_cap = g->slots_cap ? g->slots_cap * 2 : 16;
+        g->slots = grow_array(g->slots, g->slots_cap, sizeof(*g->slots));
     }
+
+    g->slots[g->num_slots] = last;
+    return LOC_SLOT + g->num_slots++;
 }
 
-static void load(char *dst, char *src, Type *ty) {
-    if (ty->kind == TY_ARRAY) {
-        return;
+static void allocate(FnGen *g) {
+    IrFunc *f = &g->ir;
+    grow_values(g, f->num_values + 1);
+    find_live_ranges(g);
+    g->num_slots = 0;
+
+    // Value in each register, or 0
+    int in_reg[NUM_TEMPS] = {0};
+    int calls = 0;
+
+    // Number of calls before each instruction, to tell which values live
+    // across one
+    int *calls_before = malloc(sizeof(int) * (f->len + 1));
+    if (calls_before == NULL) {
+        error("Out of memory");
+    }
+    for (int i = 0; i < f->len; ++i) {
+        calls_before[i] = calls;
+        calls += f->insts[i].op == IR_CALL;
     }
+    calls_before[f->len] = calls;
 
-    switch (ty->size) {
-    case 1:
-        println("\tldrb w%s, [%s]", &dst[1], src);
-        return;
-    case 8:
-        println("\tldr x%s, [%s]", &dst[1], src);
-        return;
-    default:
-        assert(false);
-        return;
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        int v = inst->dst;
+        if (v == 0 || g->loc[v] == LOC_NONE) {
+            continue;
+        }
+
+        // Calls overwrite the argument registers
+        if (inst->op == IR_PARAM && calls_before[g->last[v] + 1] == 0) {
+            g->loc[v] = inst->imm;
+            continue;
+        }
+
+        int last = g->last[v];
+        if (calls_before[last] - calls_before[i + 1] > 0) {
+            g->loc[v] = alloc_slot(g, i, last);
+            continue;
+        }
+
+        // A register is free once its value has been used for the last
+        // time, which may be by this instruction
+        int reg = -1;
+        int furthest = 0;
+        for (int r = 0; r < NUM_TEMPS; ++r) {
+            int u = in_reg[r];
+            if (u == 0 || g->last[u] <= i) {
+                reg = r;
+                break;
+            }
+            if (g->last[u] > g->last[in_reg[furthest]]) {
+                furthest = r;
+            }
+        }
+
+        // Otherwise the value that lives longest goes to a slot
+        if (reg < 0) {
+            int u = in_reg[furthest];
+            if (g->last[u] <= last) {
+                g->loc[v] = alloc_slot(g, i, last);
+                continue;
+            }
+            g->loc[u] = alloc_slot(g, g->def[u], g->last[u]);
+            reg = furthest;
+        }
+
+        in_reg[reg] = v;
+        g->loc[v] = REG_TEMP + reg;
     }
+
+    free(calls_before);
+    return;
 }
 
-static int align_to(int n, int align) {
-    return (n + align - 1) / align * align;
+//
+// Instruction selection
+//
+
+static int slot_offset(int loc) {
+    return (loc - LOC_SLOT) * 8;
 }
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+// Returns the register holding value v, loading it into scratch if it is
+// in a slot
+static int use(FnGen *g, int v, int scratch) {
+    int loc = g->loc[v];
+    if (loc < LOC_SLOT) {
+        return loc;
+    }
 
-static void gen_addr(Node *node) {
-    if (node == NULL) {
-        error("Invalid lvalue");
+    emit_rri(g, I_LDR, scratch, REG_SP, slot_offset(loc));
+    return scratch;
+}
+
+// Returns the register to compute value v into. Once it is computed,
+// def() stores it if it goes in a slot.
+static int dest(FnGen *g, int v) {
+    return g->loc[v] < LOC_SLOT ? g->loc[v] : REG_SCRATCH0;
+}
+
+static void def(FnGen *g, int v, int reg) {
+    if (g->loc[v] >= LOC_SLOT) {
+        emit_rri(g, I_STR, reg, REG_SP, slot_offset(g->loc[v]));
+    }
+
+    return;
+}
+
+// Returns the base register for an access to the address in value v, and
+// sets *offset to the offset from it
+static int addr_base(FnGen *g, int v, int *offset) {
+    if (g->loc[v] == LOC_NONE) {
+        *offset = -g->ir.insts[g->def[v]].var->offset;
+        return REG_FP;
+    }
+
+    *offset = 0;
+    return use(g, v, REG_SCRATCH0);
+}
+
+static int block_label(FnGen *g, int b) {
+    if (g->labels[b] < 0) {
+        g->labels[b] = code_label(&g->code, ".L.bb.", NULL, count(g));
+    }
+
+    return g->labels[b];
+}
+
+static bool is_const(FnGen *g, int v, long long *val) {
+    IrInst *inst = &g->ir.insts[g->def[v]];
+    if (inst->op != IR_IMM) {
+        return false;
     }
 
-    switch (node->kind) {
-    case ND_VAR:
-        if (node->var->is_local) {
-            println("\tsub x0, x29, #%d", node->var->offset);
+    *val = inst->imm;
+    return true;
+}
+
+static unsigned long long abs_value(long long val) {
+    return val < 0 ? -(unsigned long long)val : (unsigned long long)val;
+}
+
+static bool is_power_of_two(unsigned long long val) {
+    return val != 0 && (val & (val - 1)) == 0;
+}
+
+// Splits |c| into (2^j + sign) << k, where sign is 1, -1, or 0 for a plain
+// power of two. Returns false if it cannot be split.
+static bool split_mul(long long c, int *j, int *k, int *sign) {
+    unsigned long long u = abs_value(c);
+    if (u == 0) {
+        return false;
+    }
+
+    *k = __builtin_ctzll(u);
+    u >>= *k;
+    if (u == 1) {
+        *j = 0;
+        *sign = 0;
+    } else if (is_power_of_two(u - 1)) {
+        *j = __builtin_ctzll(u - 1);
+        *sign = 1;
+    } else if (is_power_of_two(u + 1)) {
+        *j = __builtin_ctzll(u + 1);
+        *sign = -1;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+// Returns true if the constant operand b of inst is folded into the
+// instructions selected for it, rather than being put in a register.
+// Multiplies by constants that split into shifts become at most two
+// shift-and-add instructions, and signed divides by constants other than
+// 0, 1 and -1 become a multiply by a reciprocal.
+static bool reduces_const(FnGen *g, IrInst *inst) {
+    long long c;
+    int j, k, sign;
+    if (inst->op == IR_MUL && is_const(g, inst->b, &c)) {
+        return split_mul(c, &j, &k, &sign);
+    }
+    if (inst->op == IR_DIV && is_const(g, inst->b, &c)) {
+        return abs_value(c) > 1 && c != LLONG_MIN;
+    }
+
+    return false;
+}
+
+// Returns true if v is a multiply of x by a positive power of two, which
+// an add or subtract can do by shifting its operand
+static bool folds_into_shift(FnGen *g, int v, int *x) {
+    IrInst *inst = &g->ir.insts[g->def[v]];
+    long long c;
+    if (inst->op != IR_MUL || !is_const(g, inst->b, &c) || c < 2 || !is_power_of_two(c)) {
+        return false;
+    }
+
+    *x = inst->a;
+    return true;
+}
+
+static void gen_mul_const(FnGen *g, int rd, int rn, long long c) {
+    int j, k, sign;
+    split_mul(c, &j, &k, &sign);
+    bool neg = c < 0;
+
+    if (sign == 0) {
+        if (neg) {
+            emit_shifted(g, I_NEG, rd, 0, rn, k);
+        } else if (k > 0) {
+            emit_rri(g, I_LSL, rd, rn, k);
         } else {
-            println("\tadr x0, %s", node->var->name);
+            emit_rrr(g, I_MOV, rd, rn, 0);
         }
         return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        return;
-    default:
-        error_tk(node->tk, "Not an lvalue");
     }
-}
 
-static void gen_expr(Node *node) {
-    if (node == NULL) {
-        error_tk(node->tk, "Invalid expression");
+    // x * (2^j + 1) = x + (x << j) and x * (2^j - 1) = -(x - (x << j)).
+    // The negation and the shift by k are done together.
+    emit_shifted(g, sign > 0 ? I_ADD : I_SUB, rd, rn, rn, j);
+    neg ^= sign < 0;
+    if (neg) {
+        emit_shifted(g, I_NEG, rd, 0, rd, k);
+    } else if (k > 0) {
+        emit_rri(g, I_LSL, rd, rd, k);
     }
 
-    switch (node->kind) {
-    case ND_NEG:
-        gen_expr(node->lhs);
-        println("\tneg x0, x0");
-        return;
-    case ND_NUM:
-        println("\tmov x0, #%lld", node->val);
-        return;
-    case ND_VAR:
-        gen_addr(node);
-        load("x0", "x0", node->ty);
-        return;
-    case ND_DEREF:
-        gen_expr(node->lhs);
-        load("x0", "x0", node->ty);
-        return;
-    case ND_ADDR:
-        gen_addr(node->lhs);
-        return;
-    case ND_ASSIGN:
-        gen_addr(node->lhs);
-        push("x0");
-        gen_expr(node->rhs);
-        pop("x1");
-        store("x0", "x1", node->ty);
-        return;
-    case ND_STMT_EXPR:
-        for (Node *n = node->body; n != NULL; n = n->next) {
-            gen_stmt(n);
+    return;
+}
+
+// Finds m and s such that n / d = (n * m >> (64 + s)) for every 64-bit n,
+// plus one if the result is negative, as in Hacker's Delight 10-1. d must
+// not be 0, 1, -1 or a power of two.
+static void div_magic(long long d, long long *m, int *s) {
+    const unsigned long long two63 = 1ULL << 63;
+    unsigned long long ad = abs_value(d);
+    unsigned long long t = two63 + ((unsigned long long)d >> 63);
+    unsigned long long anc = t - 1 - t % ad;
+    unsigned long long q1 = two63 / anc;
+    unsigned long long r1 = two63 - q1 * anc;
+    unsigned long long q2 = two63 / ad;
+    unsigned long long r2 = two63 - q2 * ad;
+    unsigned long long delta;
+    int p = 63;
+
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *m = (long long)(d < 0 ? -(q2 + 1) : q2 + 1);
+    *s = p - 64;
+    return;
+}
+
+// Division truncates toward zero, so the quotients computed with
+// arithmetic shifts, which round down, are corrected for negative values.
+// The divisor is in neither rn nor rd, so x17 is free to hold temporaries.
+static void gen_div_const(FnGen *g, int rd, int rn, long long d) {
+    int t = REG_SCRATCH1;
+    unsigned long long ad = abs_value(d);
+
+    if (is_power_of_two(ad)) {
+        // Add 2^k - 1 to negative dividends before shifting right by k
+        int k = __builtin_ctzll(ad);
+        emit_rri(g, I_ASR, t, rn, 63);
+        emit_shifted(g, I_ADD_LSR, t, rn, t, 64 - k);
+        if (d < 0) {
+            emit_rri(g, I_ASR, t, t, k);
+            emit_rrr(g, I_NEG, rd, 0, t);
+        } else {
+            emit_rri(g, I_ASR, rd, t, k);
         }
         return;
-    case ND_FUNC_CALL: {
-        int nargs = 0;
-        Node *arg = node->args;
-        while (arg != NULL) {
-            gen_expr(arg);
-            push("x0");
-            arg = arg->next;
-            nargs += 1;
-        }
-        assert(nargs <= 8);
-        for (int i = nargs - 1; i >= 0; --i) {
-            pop(argreg64[i]);
-        }
-        println("\tbl %s", node->funcname);
+    }
+
+    long long m;
+    int s;
+    div_magic(d, &m, &s);
+    emit_rri(g, I_MOV_IMM, t, 0, m);
+    emit_rrr(g, I_SMULH, t, rn, t);
+    if (d > 0 && m < 0) {
+        emit_rrr(g, I_ADD, t, t, rn);
+    } else if (d < 0 && m > 0) {
+        emit_rrr(g, I_SUB, t, t, rn);
+    }
+    if (s > 0) {
+        emit_rri(g, I_ASR, t, t, s);
+    }
+    emit_shifted(g, I_ADD_LSR, rd, t, t, 63);
+    return;
+}
+
+static void gen_binary(FnGen *g, IrInst *inst) {
+    // Folded into the add or subtract that uses it
+    if (g->loc[inst->dst] == LOC_NONE) {
         return;
     }
-    default:
-        break;
+
+    int a = inst->a;
+    int b = inst->b;
+    int shift = 0;
+    if (inst->op == IR_ADD && g->loc[a] == LOC_NONE) {
+        a = inst->b;
+        b = inst->a;
+    }
+    if ((inst->op == IR_ADD || inst->op == IR_SUB) && g->loc[b] == LOC_NONE) {
+        IrInst *mul = &g->ir.insts[g->def[b]];
+        shift = __builtin_ctzll(g->ir.insts[g->def[mul->b]].imm);
+        b = mul->a;
     }
 
-    gen_expr(node->lhs);
-    push("x0");
-    gen_expr(node->rhs);
-    pop("x1");
+    int rn = use(g, a, REG_SCRATCH0);
+    int rd = dest(g, inst->dst);
 
-    switch (node->kind) {
-    case ND_ADD:
-        println("\tadd x0, x1, x0");
-        return;
-    case ND_SUB:
-        println("\tsub x0, x1, x0");
-        return;
-    case ND_MUL:
-        println("\tmul x0, x1, x0");
-        return;
-    case ND_DIV:
-        println("\tsdiv x0, x1, x0");
-        return;
-    case ND_EQ:
-        println("\tcmp x1, x0");
-        println("\tcset x0, eq");
-        return;
-    case ND_NE:
-        println("\tcmp x1, x0");
-        println("\tcset x0, ne");
-        return;
-    case ND_LT:
-        println("\tcmp x1, x0");
-        println("\tcset x0, lt");
-        return;
-    case ND_LE:
-        println("\tcmp x1, x0");
-        println("\tcset x0, le");
-        return;
-    case ND_GT:
-        println("\tcmp x1, x0");
-        println("\tcset x0, gt");
-        return;
-    case ND_GE:
-        println("\tcmp x1, x0");
-        println("\tcset x0, ge");
+    if (reduces_const(g, inst)) {
+        long long c = g->ir.insts[g->def[inst->b]].imm;
+        if (inst->op == IR_MUL) {
+            gen_mul_const(g, rd, rn, c);
+        } else {
+            gen_div_const(g, rd, rn, c);
+        }
+        def(g, inst->dst, rd);
         return;
-    default:
-        error_tk(node->tk, "Invalid expression");
     }
+
+    int rm = use(g, b, REG_SCRATCH1);
+
+    switch (inst->op) {
+    case IR_ADD:
+        emit_shifted(g, I_ADD, rd, rn, rm, shift);
+        break;
+    case IR_SUB:
+        emit_shifted(g, I_SUB, rd, rn, rm, shift);
+        break;
+    case IR_MUL:
+        emit_rrr(g, I_MUL, rd, rn, rm);
+        break;
+    case IR_DIV:
+        emit_rrr(g, I_SDIV, rd, rn, rm);
+        break;
+    default: {
+        static CondCode conds[] = {
+            [IR_EQ] = COND_EQ, [IR_NE] = COND_NE, [IR_LT] = COND_LT,
+            [IR_LE] = COND_LE, [IR_GT] = COND_GT, [IR_GE] = COND_GE,
+        };
+        emit_rrr(g, I_CMP, 0, rn, rm);
+        emit_rri(g, I_CSET, rd, 0, conds[inst->op]);
+        break;
+    }
+    }
+
+    def(g, inst->dst, rd);
+    return;
 }
 
-static void gen_stmt(Node *node) {
-    if (node == NULL) {
-        error_tk(node->tk, "Invalid statement");
+static void gen_call(FnGen *g, IrInst *inst) {
+    IrFunc *f = &g->ir;
+    for (int i = 0; i < inst->b; ++i) {
+        int v = f->args[inst->a + i];
+        if (g->loc[v] >= LOC_SLOT) {
+            emit_rri(g, I_LDR, i, REG_SP, slot_offset(g->loc[v]));
+        } else {
+            emit_rrr(g, I_MOV, i, g->loc[v], 0);
+        }
+    }
+
+    emit_sym(g, I_BL, 0, inst->sym);
+
+    if (g->last[inst->dst] > g->def[inst->dst]) {
+        int rd = dest(g, inst->dst);
+        emit_rrr(g, I_MOV, rd, 0, 0);
+        def(g, inst->dst, rd);
     }
 
-    switch (node->kind) {
-    case ND_IF: {
-        int c = count();
-        gen_expr(node->cond);
-        println("\tcmp x0, #0");
-        println("\tbeq .L.else.%d", c);
-        gen_stmt(node->then);
-        println("\tb .L.end.%d", c);
-        println(".L.else.%d:", c);
-        if (node->els != NULL) {
-            gen_stmt(node->els);
+    return;
+}
+
+// Generates an instruction. next is the block laid out after the current
+// one, or -1 if it is the last.
+static void gen_inst(FnGen *g, IrInst *inst, int next) {
+    switch (inst->op) {
+    case IR_IMM: {
+        if (g->loc[inst->dst] == LOC_NONE) {
+            return;
         }
-        println(".L.end.%d:", c);
+        int rd = dest(g, inst->dst);
+        emit_rri(g, I_MOV_IMM, rd, 0, inst->imm);
+        def(g, inst->dst, rd);
         return;
     }
-    case ND_FOR: {
-        int c = count();
-        if (node->init != NULL) {
-            gen_stmt(node->init);
-        }
-        println(".L.begin.%d:", c);
-        if (node->cond != NULL) {
-            gen_expr(node->cond);
-            println("\tcmp x0, #0");
-            println("\tbeq .L.end.%d", c);
+    case IR_PARAM:
+        if (g->loc[inst->dst] >= LOC_SLOT) {
+            def(g, inst->dst, inst->imm);
+        } else if (g->loc[inst->dst] != inst->imm) {
+            emit_rrr(g, I_MOV, g->loc[inst->dst], inst->imm, 0);
         }
-        gen_stmt(node->then);
-        if (node->inc != NULL) {
-            gen_expr(node->inc);
+        return;
+    case IR_LOCAL: {
+        if (g->loc[inst->dst] == LOC_NONE) {
+            return;
         }
-        println("\tb .L.begin.%d", c);
-        println(".L.end.%d:", c);
+        int rd = dest(g, inst->dst);
+        emit_rri(g, I_SUB_IMM, rd, REG_FP, inst->var->offset);
+        def(g, inst->dst, rd);
+        return;
+    }
+    case IR_GLOBAL: {
+        int rd = dest(g, inst->dst);
+        emit_sym(g, I_ADR, rd, inst->var->name);
+        def(g, inst->dst, rd);
+        return;
+    }
+    case IR_LOAD: {
+        int offset;
+        int base = addr_base(g, inst->a, &offset);
+        int rd = dest(g, inst->dst);
+        emit_rri(g, inst->size == 1 ? I_LDRB : I_LDR, rd, base, offset);
+        def(g, inst->dst, rd);
+        return;
+    }
+    case IR_STORE: {
+        int offset;
+        int base = addr_base(g, inst->a, &offset);
+        int rs = use(g, inst->b, REG_SCRATCH1);
+        emit_rri(g, inst->size == 1 ? I_STRB : I_STR, rs, base, offset);
         return;
     }
-    case ND_BLOCK:
-        for (Node *n = node->body; n != NULL; n = n->next) {
-            gen_stmt(n);
+    case IR_NEG: {
+        int rm = use(g, inst->a, REG_SCRATCH0);
+        int rd = dest(g, inst->dst);
+        emit_rrr(g, I_NEG, rd, 0, rm);
+        def(g, inst->dst, rd);
+        return;
+    }
+    case IR_CALL:
+        gen_call(g, inst);
+        return;
+    case IR_JMP:
+        if (inst->succ[0] != next) {
+            emit_jump(g, I_B, block_label(g, inst->succ[0]));
         }
         return;
-    case ND_RETURN:
-        gen_expr(node->lhs);
-        println("\tb .L.return.%s", current_fn->name);
+    case IR_BR:
+        emit_rri(g, I_CMP_IMM, 0, use(g, inst->a, REG_SCRATCH0), 0);
+        emit_bcond(g, COND_EQ, block_label(g, inst->succ[1]));
+        if (inst->succ[0] != next) {
+            emit_jump(g, I_B, block_label(g, inst->succ[0]));
+        }
         return;
-    case ND_EXPR_STMT:
-        gen_expr(node->lhs);
+    case IR_RET:
+        if (inst->a != 0) {
+            int v = inst->a;
+            if (g->loc[v] >= LOC_SLOT) {
+                emit_rri(g, I_LDR, 0, REG_SP, slot_offset(g->loc[v]));
+            } else {
+                emit_rrr(g, I_MOV, 0, g->loc[v], 0);
+            }
+        }
+        if (next >= 0) {
+            emit_jump(g, I_B, g->return_label);
+        }
         return;
     default:
-        error_tk(node->tk, "Invalid statement");
+        gen_binary(g, inst);
+        return;
     }
 }
 
@@ -287,70 +795,333 @@ static void assign_lvar_offsets(Obj *prog) {
     return;
 }
 
+// String literals are read-only, other variables with an initializer
+// are data and the rest are zero-filled.
+static SectionKind data_section(Obj *var) {
+    if (var->is_literal) {
+        return SEC_RODATA;
+    }
+
+    return var->init_data != NULL ? SEC_DATA : SEC_BSS;
+}
+
+static void gen_data_obj(Obj *var) {
+    SectionKind sec = data_section(var);
+    elf_define(var->name, sec, false, var->ty->size);
+    elf_bytes(sec, var->init_data, var->ty->size);
+    return;
+}
+
+static void gen_data_asm(Obj *var) {
+    switch (data_section(var)) {
+    case SEC_RODATA:
+        emit("\t.section .rodata\n");
+        break;
+    case SEC_DATA:
+        emit("\t.data\n");
+        break;
+    default:
+        emit("\t.bss\n");
+        break;
+    }
+
+    if (!var->is_literal) {
+        emit("\t.global ");
+        emit_str(var->name);
+        emit("\n");
+    }
+    emit_str(var->name);
+    emit(":\n");
+
+    if (var->init_data != NULL) {
+        for (int i = 0; i < var->ty->size; ++i) {
+            emit("\t.byte ");
+            emit_int(var->init_data[i]);
+            emit("\n");
+        }
+    } else {
+        emit("\t.zero ");
+        emit_int(var->ty->size);
+        emit("\n");
+    }
+
+    return;
+}
+
 static void gen_data(Obj *prog) {
     for (Obj *v = prog; v != NULL; v = v->next) {
         if (v->is_function) {
             continue;
         }
 
-        println("\t.data");
-        println("\t.global %s", v->name);
-        println("%s:", v->name);
-
-        if (v->init_data != NULL) {
-            for (int i = 0; i < v->ty->size; ++i) {
-                println("\t.byte %d", v->init_data[i]);
-            }
+        if (emit_obj) {
+            gen_data_obj(v);
         } else {
-            println("\t.zero %d", v->ty->size);
+            gen_data_asm(v);
         }
     }
 
     return;
 }
 
-static void gen_text(Obj *prog) {
-    println("\t.text");
+static void gen_function(FnGen *g) {
+    Obj *fn = g->fn;
+    IrFunc *f = &g->ir;
+    ir_build(f, fn);
+    if (verify_ir) {
+        ir_verify(f, fn);
+    }
+    ir_fold(f);
+    if (verify_ir) {
+        ir_verify(f, fn);
+    }
+    allocate(g);
 
-    for (Obj *fn = prog; fn != NULL; fn = fn->next) {
-        if (!fn->is_function) {
-            continue;
+    code_reset(&g->code);
+    g->num_labels = 0;
+    g->return_label = code_label(&g->code, ".L.return.", fn->name, 0);
+
+    if (f->num_blocks > g->labels_cap) {
+        g->labels_cap = f->num_blocks * 2;
+        g->labels = grow_array(g->labels, g->labels_cap, sizeof(*g->labels));
+    }
+    for (int i = 0; i < f->num_blocks; ++i) {
+        g->labels[i] = -1;
+    }
+
+    // Branches go forward to blocks that are not labeled yet and back to
+    // ones that are, so the targets are labeled first
+    for (int i = 0; i < f->num_order; ++i) {
+        IrInst *term = &f->insts[f->blocks[f->order[i]].end - 1];
+        int next = i + 1 < f->num_order ? f->order[i + 1] : -1;
+        if (term->op == IR_BR) {
+            block_label(g, term->succ[1]);
+        }
+        if ((term->op == IR_BR || term->op == IR_JMP) && term->succ[0] != next) {
+            block_label(g, term->succ[0]);
         }
+    }
 
-        current_fn = fn;
-        println("\t.global %s", fn->name);
-        println("%s:", fn->name);
+    emit_rrr(g, I_STP_PRE, REG_FP, REG_SP, REG_LR);
+    g->code.insts[g->code.len - 1].imm = -16;
+    emit_rrr(g, I_MOV, REG_FP, REG_SP, 0);
+    emit_rri(g, I_SUB_IMM, REG_SP, REG_SP, align_to(fn->stack_size + g->num_slots * 8, 16));
+
+    for (int i = 0; i < f->num_order; ++i) {
+        int b = f->order[i];
+        int next = i + 1 < f->num_order ? f->order[i + 1] : -1;
+        if (g->labels[b] >= 0) {
+            emit_label(g, g->labels[b]);
+        }
+        for (int j = f->blocks[b].begin; j < f->blocks[b].end; ++j) {
+            gen_inst(g, &f->insts[j], next);
+        }
+    }
 
-        println("\tstp x29, x30, [sp, #-16]!");
-        println("\tmov x29, sp");
-        println("\tsub sp, sp, #%d", fn->stack_size);
+    emit_label(g, g->return_label);
+    emit_rrr(g, I_MOV, REG_SP, REG_FP, 0);
+    emit_rrr(g, I_LDP_POST, REG_FP, REG_SP, REG_LR);
+    g->code.insts[g->code.len - 1].imm = 16;
+    code_add(&g->code, I_RET);
 
-        int i = 0;
-        for (Obj *v = fn->params; v != NULL; v = v->next) {
-            if (v->ty->size == 1) {
-                println("\tstrb %s, [x29, #-%d]", argreg32[i++], v->offset);
-            } else {
-                println("\tstr %s, [x29, #-%d]", argreg64[i++], v->offset);
+    peephole(&g->code);
+    return;
+}
+
+static void print_function(FnGen *g, Buffer *b) {
+    buf_lit(b, "\t.global ");
+    buf_str(b, g->fn->name);
+    buf_lit(b, "\n");
+    buf_str(b, g->fn->name);
+    buf_lit(b, ":\n");
+    print_code(&g->code, b);
+    return;
+}
+
+// Renders the code of a function into its output buffer, as machine code
+// or as assembly text, and stores the result in the cache
+static void emit_function(FnGen *g) {
+    if (g->cached != NULL) {
+        cache_render(g->cached, &g->code, &g->out);
+        return;
+    }
+
+    if (emit_obj) {
+        encode_code(&g->code, &g->out);
+    } else if (g->code.len <= MAX_BUFFERED_INSTS) {
+        print_function(g, &g->out);
+    } else {
+        return;
+    }
+
+    if (cache_dir != NULL && !dump_ir) {
+        cache_store(&g->key, emit_obj, &g->code, g->num_labels, &g->out);
+    }
+
+    return;
+}
+
+static void adopt(Batch *b) {
+    tokens = b->tokens;
+    nodes = b->nodes;
+    share_atom_table(b->atoms);
+    error_output = b->error_output;
+    emit_obj = b->emit_obj;
+    return;
+}
+
+// Generates a function, unless its output is in the cache
+static void gen_task(void *arg, int i) {
+    Batch *b = arg;
+    FnGen *g = &b->fns[i];
+    adopt(b);
+
+    free(g->cached);
+    g->cached = NULL;
+
+    // The IR is only there to dump if the function is generated
+    if (cache_dir != NULL && !dump_ir) {
+        cache_key(g->fn, emit_obj, &g->key);
+        g->cached = cache_load(&g->key, &g->num_labels);
+        if (g->cached != NULL) {
+            code_reset(&g->code);
+            return;
+        }
+    }
+
+    gen_function(g);
+    return;
+}
+
+static void emit_task(void *arg, int i) {
+    Batch *b = arg;
+    adopt(b);
+    emit_function(&b->fns[i]);
+    return;
+}
+
+// Appends the output of a function to the file, after the functions
+// before it
+static void write_function(FnGen *g, int fd) {
+    if (emit_obj) {
+        int start = elf_size(SEC_TEXT);
+        elf_define(g->fn->name, SEC_TEXT, true, g->out.len);
+        elf_bytes(SEC_TEXT, g->out.data, g->out.len);
+        for (int i = 0; i < g->code.num_fixups; ++i) {
+            Fixup *f = &g->code.fixups[i];
+            elf_reloc(f->type, f->sym, start + f->offset);
+        }
+    } else if (g->code.len > MAX_BUFFERED_INSTS) {
+        print_function(g, &out);
+        buf_flush(&out);
+    } else {
+        g->out.fd = fd;
+        buf_flush(&g->out);
+        g->out.fd = -1;
+    }
+
+    g->out.len = 0;
+    return;
+}
+
+// Instruction lists and buffers are reused from batch to batch
+static void gen_text(Obj *prog, FnGen *batch, int fd) {
+    if (!emit_obj) {
+        emit("\t.text\n");
+        buf_flush(&out);
+    }
+
+    Batch b = { batch, tokens, nodes, atom_table(), error_output, emit_obj };
+
+    int label_base = 0;
+    Obj *fn = prog;
+    for (;;) {
+        int n = 0;
+        for (; fn != NULL && n < BATCH_SIZE; fn = fn->next) {
+            if (fn->is_function) {
+                batch[n++].fn = fn;
             }
         }
 
-        gen_stmt(fn->body);
-        assert(depth == 0);
+        if (n == 0) {
+            break;
+        }
+
+        phase_start(PHASE_CODEGEN);
+        run_parallel(n, gen_task, &b);
+        for (int i = 0; i < n && dump_ir; ++i) {
+            ir_dump(&batch[i].ir, batch[i].fn, error_output ? error_output : stderr);
+        }
+        for (int i = 0; i < n; ++i) {
+            batch[i].code.label_base = label_base;
+            label_base += batch[i].num_labels;
+        }
+
+        run_parallel(n, emit_task, &b);
+
+        phase_start(PHASE_OUTPUT);
+        for (int i = 0; i < n; ++i) {
+            write_function(&batch[i], fd);
+        }
+    }
+
+    return;
+}
 
-        println(".L.return.%s:", fn->name);
-        println("\tmov sp, x29");
-        println("\tldp x29, x30, [sp], #16");
-        println("\tret");
+// Frees the memory codegen allocates outside the arena. It is also run when
+// the arena is released, in case codegen was cut short by an error.
+static void free_buffers(void *arg) {
+    FnGen *batch = arg;
+    for (int i = 0; i < BATCH_SIZE; ++i) {
+        FnGen *g = &batch[i];
+        ir_free(&g->ir);
+        free(g->loc);
+        free(g->def);
+        free(g->last);
+        free(g->slots);
+        free(g->labels);
+        g->loc = g->def = g->last = g->slots = g->labels = NULL;
+        g->values_cap = g->slots_cap = g->labels_cap = 0;
+        code_free(&batch[i].code);
+        buf_free(&batch[i].out);
+        free(batch[i].cached);
+        batch[i].cached = NULL;
     }
 
+    buf_free(&out);
     return;
 }
 
-void codegen(Obj *prog, FILE *out) {
-    output_file = out;
+// Writes assembly text for prog to fd, or a relocatable object file if
+// emit_obj is set.
+void codegen(Obj *prog, int fd, bool obj) {
+    emit_obj = obj;
+    if (emit_obj) {
+        elf_init();
+    } else {
+        buf_init(&out, fd);
+    }
+
+    FnGen *batch = arena_alloc(sizeof(FnGen) * BATCH_SIZE);
+    for (int i = 0; i < BATCH_SIZE; ++i) {
+        buf_init(&batch[i].out, -1);
+    }
+    arena_on_release(free_buffers, batch);
 
+    phase_start(PHASE_OFFSETS);
     assign_lvar_offsets(prog);
+
+    phase_start(PHASE_CODEGEN);
     gen_data(prog);
-    gen_text(prog);
+    gen_text(prog, batch, fd);
+
+    phase_start(PHASE_OUTPUT);
+    if (emit_obj) {
+        elf_write(fd);
+    } else {
+        buf_flush(&out);
+    }
+
+    free_buffers(batch);
     return;
 }
@@ -0,0 +1,343 @@
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+// ELF64 relocatable object writer for AArch64. Section contents are
+// accumulated in memory while code is generated and the whole file is
+// written out at the end.
+//
+// Symbols starting with ".L" are local to the object and do not appear in
+// the symbol table; relocations against them refer to their section
+// instead. All other symbols are global.
+//
+// The object being built belongs to the thread, so files can be compiled
+// in parallel.
+
+typedef struct {
+    char *name;
+    bool is_defined;
+    bool is_func;
+    SectionKind sec;
+    int value;
+    int size;
+
+    // Index in the output symbol table
+    int index;
+} Symbol;
+
+typedef struct {
+    int offset;
+    int type;
+    int sym;
+} Reloc;
+
+// The output section header table. The first four sections are the
+// SectionKinds and their section symbols have the same indices.
+enum {
+    SHN_TEXT = 1,
+    SHN_DATA,
+    SHN_BSS,
+    SHN_RODATA,
+    SHN_SYMTAB,
+    SHN_STRTAB,
+    SHN_RELA_TEXT,
+    SHN_SHSTRTAB,
+    NUM_SECTIONS,
+};
+
+static _Thread_local Buffer sections[SEC_RODATA + 1];
+static _Thread_local int bss_size;
+
+static _Thread_local Symbol *syms;
+static _Thread_local int num_syms;
+static _Thread_local int syms_cap;
+static _Thread_local HashMap sym_map;
+
+static _Thread_local Reloc *relocs;
+static _Thread_local int num_relocs;
+static _Thread_local int relocs_cap;
+
+// Frees the object being built. Run when the arena is released, so that
+// nothing is left behind if compilation is cut short by an error.
+static void elf_free(void *arg) {
+    (void)arg;
+    for (int i = 0; i <= SEC_RODATA; ++i) {
+        buf_free(&sections[i]);
+    }
+
+    free(syms);
+    free(relocs);
+    syms = NULL;
+    relocs = NULL;
+    syms_cap = 0;
+    relocs_cap = 0;
+    return;
+}
+
+void elf_init(void) {
+    for (int i = 0; i <= SEC_RODATA; ++i) {
+        if (i != SEC_BSS) {
+            buf_init(&sections[i], -1);
+        }
+    }
+
+    bss_size = 0;
+    num_syms = 0;
+    num_relocs = 0;
+    sym_map = (HashMap) {0};
+    arena_on_release(elf_free, NULL);
+    return;
+}
+
+// Symbols keep a copy of their name, as fixups loaded from the cache point
+// into entries that are freed before the object is written
+static int find_symbol(char *name) {
+    int *idx = hashmap_get(&sym_map, name);
+    if (idx != NULL) {
+        return *idx;
+    }
+
+    name = arena_strndup(name, strlen(name));
+    if (num_syms == syms_cap) {
+        syms_cap = syms_cap ? syms_cap * 2 : 64;
+        syms = grow_array(syms, syms_cap, sizeof(*syms));
+    }
+
+    syms[num_syms] = (Symbol) { .name = name };
+    idx = arena_new(int);
+    *idx = num_syms++;
+    hashmap_put(&sym_map, name, idx);
+    return *idx;
+}
+
+int elf_size(SectionKind sec) {
+    return sec == SEC_BSS ? bss_size : (int)sections[sec].len;
+}
+
+// Defines a symbol at the current end of sec
+void elf_define(char *name, SectionKind sec, bool is_func, int size) {
+    int idx = find_symbol(name);
+    Symbol *sym = &syms[idx];
+    sym->is_defined = true;
+    sym->is_func = is_func;
+    sym->sec = sec;
+    sym->value = elf_size(sec);
+    sym->size = size;
+    return;
+}
+
+// Appends len bytes to sec, or len zero bytes if p is NULL
+void elf_bytes(SectionKind sec, void *p, int len) {
+    if (sec == SEC_BSS) {
+        bss_size += len;
+        return;
+    }
+
+    Buffer *b = &sections[sec];
+    if (p != NULL) {
+        buf_write(b, p, len);
+        return;
+    }
+
+    if (b->cap - b->len < (size_t)len) {
+        buf_reserve(b, len);
+    }
+    memset(b->data + b->len, 0, len);
+    b->len += len;
+    return;
+}
+
+// Adds a relocation against sym at offset in the text section
+void elf_reloc(int type, char *sym, int offset) {
+    if (num_relocs == relocs_cap) {
+        relocs_cap = relocs_cap ? relocs_cap * 2 : 64;
+        relocs = grow_array(relocs, relocs_cap, sizeof(*relocs));
+    }
+
+    int idx = find_symbol(sym);
+    relocs[num_relocs++] = (Reloc) { offset, type, idx };
+    return;
+}
+
+static bool is_local(Symbol *sym) {
+    return strncmp(sym->name, ".L", 2) == 0;
+}
+
+static int section_index(SectionKind sec) {
+    return SHN_TEXT + sec;
+}
+
+static int add_string(Buffer *b, char *s) {
+    int offset = b->len;
+    buf_write(b, s, strlen(s) + 1);
+    return offset;
+}
+
+static void pad(Buffer *b, size_t len) {
+    static char zero[16];
+    buf_write(b, zero, len);
+    return;
+}
+
+static size_t align_to(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+void elf_write(int fd) {
+    Buffer strtab;
+    buf_init(&strtab, -1);
+    add_string(&strtab, "");
+
+    // Null symbol, one symbol per section, then global symbols
+    int num_out = 1 + 4;
+    for (int i = 0; i < num_syms; ++i) {
+        Symbol *sym = &syms[i];
+        if (is_local(sym)) {
+            if (!sym->is_defined) {
+                error("Undefined local symbol: %s", sym->name);
+            }
+            sym->index = section_index(sym->sec);
+        } else {
+            sym->index = num_out++;
+        }
+    }
+
+    Elf64_Sym *symtab = arena_alloc(sizeof(Elf64_Sym) * num_out);
+
+    for (int i = 0; i <= SEC_RODATA; ++i) {
+        Elf64_Sym *esym = &symtab[1 + i];
+        esym->st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        esym->st_shndx = section_index(i);
+    }
+
+    for (int i = 0; i < num_syms; ++i) {
+        Symbol *sym = &syms[i];
+        if (is_local(sym)) {
+            continue;
+        }
+
+        Elf64_Sym *esym = &symtab[sym->index];
+        esym->st_name = add_string(&strtab, sym->name);
+        if (sym->is_defined) {
+            int type = sym->is_func ? STT_FUNC : STT_OBJECT;
+            esym->st_info = ELF64_ST_INFO(STB_GLOBAL, type);
+            esym->st_shndx = section_index(sym->sec);
+            esym->st_value = sym->value;
+            esym->st_size = sym->size;
+        } else {
+            esym->st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+            esym->st_shndx = SHN_UNDEF;
+        }
+    }
+
+    Elf64_Rela *rela = arena_alloc(sizeof(Elf64_Rela) * (num_relocs + 1));
+
+    for (int i = 0; i < num_relocs; ++i) {
+        Symbol *sym = &syms[relocs[i].sym];
+        rela[i].r_offset = relocs[i].offset;
+        rela[i].r_info = ELF64_R_INFO(sym->index, relocs[i].type);
+        rela[i].r_addend = is_local(sym) ? sym->value : 0;
+    }
+
+    Buffer shstrtab;
+    buf_init(&shstrtab, -1);
+    Elf64_Shdr shdrs[NUM_SECTIONS] = {0};
+
+    struct {
+        int index;
+        char *name;
+        int type;
+        int flags;
+        int align;
+    } layout[] = {
+        { SHN_TEXT,      ".text",      SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 4 },
+        { SHN_DATA,      ".data",      SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,     8 },
+        { SHN_BSS,       ".bss",       SHT_NOBITS,   SHF_ALLOC | SHF_WRITE,     8 },
+        { SHN_RODATA,    ".rodata",    SHT_PROGBITS, SHF_ALLOC,                 1 },
+        { SHN_SYMTAB,    ".symtab",    SHT_SYMTAB,   0,                         8 },
+        { SHN_STRTAB,    ".strtab",    SHT_STRTAB,   0,                         1 },
+        { SHN_RELA_TEXT, ".rela.text", SHT_RELA,     SHF_INFO_LINK,             8 },
+        { SHN_SHSTRTAB,  ".shstrtab",  SHT_STRTAB,   0,                         1 },
+    };
+
+    add_string(&shstrtab, "");
+    for (int i = 0; i < NUM_SECTIONS - 1; ++i) {
+        Elf64_Shdr *sh = &shdrs[layout[i].index];
+        sh->sh_name = add_string(&shstrtab, layout[i].name);
+        sh->sh_type = layout[i].type;
+        sh->sh_flags = layout[i].flags;
+        sh->sh_addralign = layout[i].align;
+    }
+
+    shdrs[SHN_SYMTAB].sh_link = SHN_STRTAB;
+    shdrs[SHN_SYMTAB].sh_info = 1 + 4;
+    shdrs[SHN_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    shdrs[SHN_RELA_TEXT].sh_link = SHN_SYMTAB;
+    shdrs[SHN_RELA_TEXT].sh_info = SHN_TEXT;
+    shdrs[SHN_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+
+    struct {
+        int index;
+        void *data;
+        size_t len;
+    } contents[] = {
+        { SHN_TEXT,      sections[SEC_TEXT].data,   sections[SEC_TEXT].len },
+        { SHN_DATA,      sections[SEC_DATA].data,   sections[SEC_DATA].len },
+        { SHN_RODATA,    sections[SEC_RODATA].data, sections[SEC_RODATA].len },
+        { SHN_SYMTAB,    symtab,                    sizeof(Elf64_Sym) * num_out },
+        { SHN_STRTAB,    strtab.data,               strtab.len },
+        { SHN_RELA_TEXT, rela,                      sizeof(Elf64_Rela) * num_relocs },
+        { SHN_SHSTRTAB,  shstrtab.data,             shstrtab.len },
+    };
+
+    int num_contents = sizeof(contents) / sizeof(*contents);
+    size_t offset = sizeof(Elf64_Ehdr);
+    for (int i = 0; i < num_contents; ++i) {
+        Elf64_Shdr *sh = &shdrs[contents[i].index];
+        offset = align_to(offset, sh->sh_addralign);
+        sh->sh_offset = offset;
+        sh->sh_size = contents[i].len;
+        offset += contents[i].len;
+    }
+
+    shdrs[SHN_BSS].sh_offset = align_to(offset, 8);
+    shdrs[SHN_BSS].sh_size = bss_size;
+
+    Elf64_Ehdr ehdr = {0};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_AARCH64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = align_to(offset, 8);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = NUM_SECTIONS;
+    ehdr.e_shstrndx = SHN_SHSTRTAB;
+
+    Buffer out;
+    buf_init(&out, fd);
+    buf_write(&out, (char *)&ehdr, sizeof(ehdr));
+
+    offset = sizeof(Elf64_Ehdr);
+    for (int i = 0; i < num_contents; ++i) {
+        Elf64_Shdr *sh = &shdrs[contents[i].index];
+        pad(&out, sh->sh_offset - offset);
+        buf_write(&out, contents[i].data, contents[i].len);
+        offset = sh->sh_offset + contents[i].len;
+    }
+
+    pad(&out, ehdr.e_shoff - offset);
+    buf_write(&out, (char *)shdrs, sizeof(shdrs));
+
+    buf_flush(&out);
+    buf_free(&out);
+
+    buf_free(&strtab);
+    buf_free(&shstrtab);
+    return;
+}
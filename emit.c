@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+
+// Output buffers for generated code. Text is appended to a large buffer
+// that goes out in few big write calls, and numbers are formatted by hand
+// rather than through printf. A buffer without a file descriptor grows
+// instead of being flushed, and starts out small since there may be many
+// of them.
+#define BUFFER_SIZE (1 << 20)
+#define GROWABLE_BUFFER_SIZE (1 << 12)
+
+// Reads exactly len bytes from fd. Returns false on an error or at the end
+// of the file.
+bool read_full(int fd, void *p, size_t len) {
+    char *q = p;
+    while (len > 0) {
+        ssize_t n = read(fd, q, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        q += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// Writes all len bytes to fd. Returns false on an error.
+bool write_full(int fd, void *p, size_t len) {
+    char *q = p;
+    while (len > 0) {
+        ssize_t n = write(fd, q, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        q += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+void buf_init(Buffer *b, int fd) {
+    size_t cap = fd < 0 ? GROWABLE_BUFFER_SIZE : BUFFER_SIZE;
+    b->data = malloc(cap);
+    if (b->data == NULL) {
+        error("Out of memory");
+    }
+
+    bytes_allocated += cap;
+    b->len = 0;
+    b->cap = cap;
+    b->fd = fd;
+    return;
+}
+
+void buf_flush(Buffer *b) {
+    if (!write_full(b->fd, b->data, b->len)) {
+        error("Cannot write output: %s", strerror(errno));
+    }
+
+    b->len = 0;
+    return;
+}
+
+void buf_free(Buffer *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+    return;
+}
+
+void buf_reserve(Buffer *b, size_t len) {
+    if (b->fd >= 0) {
+        buf_flush(b);
+        if (len <= b->cap) {
+            return;
+        }
+    }
+
+    while (b->cap - b->len < len) {
+        b->cap *= 2;
+    }
+
+    b->data = realloc(b->data, b->cap);
+    if (b->data == NULL) {
+        error("Out of memory");
+    }
+
+    bytes_allocated += b->cap;
+    return;
+}
+
+void buf_str(Buffer *b, char *s) {
+    buf_write(b, s, strlen(s));
+    return;
+}
+
+void buf_int(Buffer *b, long long val) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+
+    // Work with the magnitude as unsigned so that LLONG_MIN is fine
+    unsigned long long u = val < 0 ? -(unsigned long long)val : (unsigned long long)val;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (val < 0) {
+        *--p = '-';
+    }
+
+    buf_write(b, p, tmp + sizeof(tmp) - p);
+    return;
+}
+
+void buf_reg(Buffer *b, char prefix, int reg) {
+    if (b->cap - b->len < 3) {
+        buf_reserve(b, 3);
+    }
+
+    char *p = b->data + b->len;
+    *p++ = prefix;
+    if (reg >= 10) {
+        *p++ = '0' + reg / 10;
+    }
+    *p++ = '0' + reg % 10;
+    b->len = p - b->data;
+    return;
+}
@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+
+// Open-addressing hash table with linear probing. Keys are not copied and
+// entries cannot be removed; a table is dropped as a whole together with
+// the arena it lives in.
+//
+// A table is keyed either by strings or by pointers (such as interned
+// identifiers), never by a mix of both.
+#define INIT_SIZE 16
+#define HIGH_WATERMARK 70
+
+static uint64_t fnv_hash(char *s, int len) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)s[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static uint64_t ptr_hash(void *p) {
+    uint64_t hash = (uintptr_t)p;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// A negative keylen means that keys are compared by identity only.
+static bool match(HashEntry *ent, void *key, int keylen, uint64_t hash) {
+    if (ent->hash != hash) {
+        return false;
+    }
+
+    if (ent->key == key) {
+        return true;
+    }
+
+    return keylen >= 0 && ent->keylen == keylen && memcmp(ent->key, key, keylen) == 0;
+}
+
+static void rehash(HashMap *map) {
+    int cap = map->capacity * 2;
+    HashEntry *buckets = arena_alloc(sizeof(HashEntry) * cap);
+
+    for (int i = 0; i < map->capacity; ++i) {
+        HashEntry *ent = &map->buckets[i];
+        if (ent->key == NULL) {
+            continue;
+        }
+
+        for (int j = 0; ; ++j) {
+            HashEntry *ent2 = &buckets[(ent->hash + j) & (cap - 1)];
+            if (ent2->key == NULL) {
+                *ent2 = *ent;
+                break;
+            }
+        }
+    }
+
+    map->buckets = buckets;
+    map->capacity = cap;
+    return;
+}
+
+static void *get(HashMap *map, void *key, int keylen, uint64_t hash) {
+    if (map->buckets == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; ; ++i) {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (ent->key == NULL) {
+            return NULL;
+        }
+
+        if (match(ent, key, keylen, hash)) {
+            return ent->val;
+        }
+    }
+}
+
+static void put(HashMap *map, void *key, int keylen, uint64_t hash, void *val) {
+    if (map->buckets == NULL) {
+        map->buckets = arena_alloc(sizeof(HashEntry) * INIT_SIZE);
+        map->capacity = INIT_SIZE;
+    } else if ((map->used + 1) * 100 / map->capacity >= HIGH_WATERMARK) {
+        rehash(map);
+    }
+
+    for (int i = 0; ; ++i) {
+        HashEntry *ent = &map->buckets[(hash + i) & (map->capacity - 1)];
+        if (ent->key == NULL) {
+            ent->key = key;
+            ent->keylen = keylen;
+            ent->hash = hash;
+            ent->val = val;
+            map->used += 1;
+            return;
+        }
+
+        if (match(ent, key, keylen, hash)) {
+            ent->val = val;
+            return;
+        }
+    }
+}
+
+void *hashmap_get(HashMap *map, char *key) {
+    return hashmap_get2(map, key, strlen(key));
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen) {
+    return get(map, key, keylen, fnv_hash(key, keylen));
+}
+
+void *hashmap_get_ptr(HashMap *map, void *key) {
+    return get(map, key, -1, ptr_hash(key));
+}
+
+void hashmap_put(HashMap *map, char *key, void *val) {
+    hashmap_put2(map, key, strlen(key), val);
+    return;
+}
+
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val) {
+    put(map, key, keylen, fnv_hash(key, keylen), val);
+    return;
+}
+
+void hashmap_put_ptr(HashMap *map, void *key, void *val) {
+    put(map, key, -1, ptr_hash(key), val);
+    return;
+}
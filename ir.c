@@ -0,0 +1,1251 @@
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "main.h"
+
+// Each function is lowered from its AST to IR before code is generated for
+// it. Blocks are filled one at a time: a block is started, instructions are
+// appended to it, and a terminator ends it. Blocks that are jumped to
+// before they are filled are created first and started later, so the
+// layout of the blocks follows the structure of the source.
+
+bool dump_ir;
+bool verify_ir;
+
+void ir_free(IrFunc *f) {
+    free(f->insts);
+    free(f->blocks);
+    free(f->order);
+    free(f->args);
+    *f = (IrFunc) {0};
+    return;
+}
+
+static int new_block(IrFunc *f) {
+    if (f->num_blocks == f->blocks_cap) {
+        f->blocks_cap = f->blocks_cap ? f->blocks_cap * 2 : 64;
+        f->blocks = grow_array(f->blocks, f->blocks_cap, sizeof(*f->blocks));
+        f->order = grow_array(f->order, f->blocks_cap, sizeof(*f->order));
+    }
+
+    f->blocks[f->num_blocks] = (IrBlock) { -1, -1 };
+    return f->num_blocks++;
+}
+
+// Starts filling block b. The block before it must have been terminated.
+static void start_block(IrFunc *f, int b) {
+    assert(f->cur < 0);
+    f->blocks[b].begin = f->len;
+    f->order[f->num_order++] = b;
+    f->cur = b;
+    return;
+}
+
+static IrInst *add(IrFunc *f, IrOp op) {
+    // Code after a terminator is unreachable, but it still needs a block
+    if (f->cur < 0) {
+        start_block(f, new_block(f));
+    }
+
+    if (f->len == f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 256;
+        f->insts = grow_array(f->insts, f->cap, sizeof(*f->insts));
+    }
+
+    IrInst *inst = &f->insts[f->len++];
+    *inst = (IrInst) {0};
+    inst->op = op;
+    return inst;
+}
+
+static int add_value(IrFunc *f, IrOp op, int a, int b) {
+    IrInst *inst = add(f, op);
+    inst->a = a;
+    inst->b = b;
+    return inst->dst = ++f->num_values;
+}
+
+static void end_block(IrFunc *f) {
+    f->blocks[f->cur].end = f->len;
+    f->cur = -1;
+    return;
+}
+
+static void jump(IrFunc *f, int target) {
+    add(f, IR_JMP)->succ[0] = target;
+    end_block(f);
+    return;
+}
+
+static void branch(IrFunc *f, int cond, int then, int els) {
+    IrInst *inst = add(f, IR_BR);
+    inst->a = cond;
+    inst->succ[0] = then;
+    inst->succ[1] = els;
+    end_block(f);
+    return;
+}
+
+// Continues into block b, jumping to it unless the current block has
+// already been terminated
+static void fall_into(IrFunc *f, int b) {
+    if (f->cur >= 0) {
+        jump(f, b);
+    }
+
+    start_block(f, b);
+    return;
+}
+
+//
+// Lowering
+//
+
+static int lower_expr(IrFunc *f, Node node);
+static void lower_stmt(IrFunc *f, Node node);
+
+static int var_addr(IrFunc *f, Obj *var) {
+    IrInst *inst = add(f, var->is_local ? IR_LOCAL : IR_GLOBAL);
+    inst->var = var;
+    return inst->dst = ++f->num_values;
+}
+
+// The value of an array is its address, so arrays are neither loaded nor
+// stored.
+static int load(IrFunc *f, int addr, Type *ty) {
+    if (ty->kind == TY_ARRAY) {
+        return addr;
+    }
+
+    IrInst *inst = add(f, IR_LOAD);
+    inst->a = addr;
+    inst->size = ty->size;
+    return inst->dst = ++f->num_values;
+}
+
+static void store(IrFunc *f, int addr, int val, Type *ty) {
+    if (ty->kind == TY_ARRAY) {
+        return;
+    }
+
+    IrInst *inst = add(f, IR_STORE);
+    inst->a = addr;
+    inst->b = val;
+    inst->size = ty->size;
+    return;
+}
+
+static int lower_addr(IrFunc *f, Node node) {
+    if (node == 0) {
+        error("Invalid lvalue");
+    }
+
+    switch (node_kind(node)) {
+    case ND_VAR:
+        return var_addr(f, node_var(node));
+    case ND_DEREF:
+        return lower_expr(f, node_lhs(node));
+    default:
+        error_tk(node_tk(node), "Not an lvalue");
+    }
+}
+
+static int lower_call(IrFunc *f, Node node) {
+    int nargs = node_count(node);
+    assert(nargs <= 8);
+
+    int args[8];
+    for (int i = 0; i < nargs; ++i) {
+        args[i] = lower_expr(f, node_children(node)[i]);
+    }
+
+    if (f->num_args + nargs > f->args_cap) {
+        f->args_cap = f->args_cap ? f->args_cap * 2 : 64;
+        f->args = grow_array(f->args, f->args_cap, sizeof(*f->args));
+    }
+
+    int first = f->num_args;
+    for (int i = 0; i < nargs; ++i) {
+        f->args[f->num_args++] = args[i];
+    }
+
+    IrInst *inst = add(f, IR_CALL);
+    inst->a = first;
+    inst->b = nargs;
+    inst->sym = node_funcname(node);
+    return inst->dst = ++f->num_values;
+}
+
+static IrOp binary_op(Node node) {
+    switch (node_kind(node)) {
+    case ND_ADD: return IR_ADD;
+    case ND_SUB: return IR_SUB;
+    case ND_MUL: return IR_MUL;
+    case ND_DIV: return IR_DIV;
+    case ND_EQ: return IR_EQ;
+    case ND_NE: return IR_NE;
+    case ND_LT: return IR_LT;
+    case ND_LE: return IR_LE;
+    case ND_GT: return IR_GT;
+    case ND_GE: return IR_GE;
+    default:
+        error_tk(node_tk(node), "Invalid expression");
+    }
+}
+
+static int lower_expr(IrFunc *f, Node node) {
+    if (node == 0) {
+        error_tk(node_tk(node), "Invalid expression");
+    }
+
+    switch (node_kind(node)) {
+    case ND_NEG:
+        return add_value(f, IR_NEG, lower_expr(f, node_lhs(node)), 0);
+    case ND_NUM: {
+        IrInst *inst = add(f, IR_IMM);
+        inst->imm = node_val(node);
+        return inst->dst = ++f->num_values;
+    }
+    case ND_VAR:
+        return load(f, var_addr(f, node_var(node)), node_ty(node));
+    case ND_DEREF:
+        return load(f, lower_expr(f, node_lhs(node)), node_ty(node));
+    case ND_ADDR:
+        return lower_addr(f, node_lhs(node));
+    case ND_ASSIGN: {
+        int addr = lower_addr(f, node_lhs(node));
+        int val = lower_expr(f, node_rhs(node));
+        store(f, addr, val, node_ty(node));
+        return val;
+    }
+    case ND_STMT_EXPR: {
+        // The type checker made sure the last statement is an expression
+        int n = node_count(node);
+        for (int i = 0; i < n - 1; ++i) {
+            lower_stmt(f, node_children(node)[i]);
+        }
+        return lower_expr(f, node_lhs(node_children(node)[n - 1]));
+    }
+    case ND_FUNC_CALL:
+        return lower_call(f, node);
+    default:
+        break;
+    }
+
+    IrOp op = binary_op(node);
+    int lhs = lower_expr(f, node_lhs(node));
+    int rhs = lower_expr(f, node_rhs(node));
+    return add_value(f, op, lhs, rhs);
+}
+
+static void lower_stmt(IrFunc *f, Node node) {
+    if (node == 0) {
+        error_tk(node_tk(node), "Invalid statement");
+    }
+
+    switch (node_kind(node)) {
+    case ND_IF: {
+        int then = new_block(f);
+        int els = new_block(f);
+        int end = node_els(node) != 0 ? new_block(f) : els;
+        branch(f, lower_expr(f, node_cond(node)), then, els);
+        start_block(f, then);
+        lower_stmt(f, node_then(node));
+        if (node_els(node) != 0) {
+            if (f->cur >= 0) {
+                jump(f, end);
+            }
+            start_block(f, els);
+            lower_stmt(f, node_els(node));
+        }
+        fall_into(f, end);
+        return;
+    }
+    case ND_FOR: {
+        if (node_init(node) != 0) {
+            lower_stmt(f, node_init(node));
+        }
+
+        int begin = new_block(f);
+        fall_into(f, begin);
+        int end = new_block(f);
+        if (node_cond(node) != 0) {
+            int body = new_block(f);
+            branch(f, lower_expr(f, node_cond(node)), body, end);
+            start_block(f, body);
+        }
+
+        lower_stmt(f, node_then(node));
+        if (node_inc(node) != 0) {
+            lower_expr(f, node_inc(node));
+        }
+        if (f->cur >= 0) {
+            jump(f, begin);
+        }
+        start_block(f, end);
+        return;
+    }
+    case ND_BLOCK:
+        for (int i = 0; i < node_count(node); ++i) {
+            lower_stmt(f, node_children(node)[i]);
+        }
+        return;
+    case ND_RETURN: {
+        int val = lower_expr(f, node_lhs(node));
+        add(f, IR_RET)->a = val;
+        end_block(f);
+        return;
+    }
+    case ND_EXPR_STMT:
+        lower_expr(f, node_lhs(node));
+        return;
+    default:
+        error_tk(node_tk(node), "Invalid statement");
+    }
+}
+
+// Lowers a function into f, whose arrays are reused
+void ir_build(IrFunc *f, Obj *fn) {
+    f->len = 0;
+    f->num_blocks = 0;
+    f->num_order = 0;
+    f->num_args = 0;
+    f->num_values = 0;
+    f->cur = -1;
+
+    start_block(f, new_block(f));
+
+    int i = 0;
+    for (Obj *v = fn->params; v != NULL; v = v->next) {
+        IrInst *inst = add(f, IR_PARAM);
+        inst->imm = i++;
+        int val = inst->dst = ++f->num_values;
+        store(f, var_addr(f, v), val, v->ty);
+    }
+
+    lower_stmt(f, fn->body);
+    if (f->cur >= 0) {
+        add(f, IR_RET);
+        end_block(f);
+    }
+
+    return;
+}
+
+//
+// Verifier
+//
+
+static bool is_terminator(IrOp op) {
+    return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+static int num_succs(IrInst *inst) {
+    switch (inst->op) {
+    case IR_JMP:
+        return 1;
+    case IR_BR:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+// Stores pointers to the values an instruction uses into ops, which must
+// have room for 8, and returns how many there are
+int ir_operands(IrFunc *f, IrInst *inst, int **ops) {
+    switch (inst->op) {
+    case IR_IMM:
+    case IR_PARAM:
+    case IR_LOCAL:
+    case IR_GLOBAL:
+    case IR_JMP:
+        return 0;
+    case IR_LOAD:
+    case IR_NEG:
+    case IR_BR:
+        ops[0] = &inst->a;
+        return 1;
+    case IR_RET:
+        ops[0] = &inst->a;
+        return inst->a != 0;
+    case IR_CALL:
+        for (int i = 0; i < inst->b; ++i) {
+            ops[i] = &f->args[inst->a + i];
+        }
+        return inst->b;
+    default:
+        ops[0] = &inst->a;
+        ops[1] = &inst->b;
+        return 2;
+    }
+}
+
+static bool defines_value(IrOp op) {
+    return op != IR_STORE && !is_terminator(op);
+}
+
+typedef struct {
+    IrFunc *f;
+    Obj *fn;
+
+    // Block and index of each instruction and of each value's definition
+    int *inst_block;
+    int *def_block;
+    int *def_index;
+
+    // Reverse postorder number and immediate dominator of each block, -1
+    // for unreachable ones
+    int *rpo;
+    int *idom;
+
+    // Instruction being checked
+    int cur;
+} Verifier;
+
+static void fail(Verifier *v, char *msg) {
+    error("Invalid IR for %s at instruction %d: %s", v->fn->name, v->cur, msg);
+}
+
+static void *alloc_array(int n, size_t size) {
+    void *p = calloc(n > 0 ? n : 1, size);
+    if (p == NULL) {
+        error("Out of memory");
+    }
+
+    return p;
+}
+
+// Numbers the blocks reachable from the entry in reverse postorder. The
+// walk keeps its own stack, as functions can nest deeply.
+static int *number_blocks(Verifier *v, int *rpo_order) {
+    IrFunc *f = v->f;
+    int *stack = alloc_array(f->num_blocks, sizeof(int));
+    int *next = alloc_array(f->num_blocks, sizeof(int));
+    bool *seen = alloc_array(f->num_blocks, sizeof(bool));
+    int post = f->num_blocks;
+
+    for (int b = 0; b < f->num_blocks; ++b) {
+        v->rpo[b] = -1;
+    }
+
+    int sp = 0;
+    stack[sp++] = 0;
+    seen[0] = true;
+    while (sp > 0) {
+        int b = stack[sp - 1];
+        IrInst *term = &f->insts[f->blocks[b].end - 1];
+        if (next[b] < num_succs(term)) {
+            int s = term->succ[next[b]++];
+            if (!seen[s]) {
+                seen[s] = true;
+                stack[sp++] = s;
+            }
+            continue;
+        }
+
+        v->rpo[b] = --post;
+        sp--;
+    }
+
+    // Shift the numbers down to start from zero
+    int num_reachable = f->num_blocks - post;
+    for (int b = 0; b < f->num_blocks; ++b) {
+        if (v->rpo[b] >= 0) {
+            v->rpo[b] -= post;
+            rpo_order[v->rpo[b]] = b;
+        }
+    }
+
+    free(stack);
+    free(next);
+    free(seen);
+    return rpo_order + num_reachable;
+}
+
+static int intersect(Verifier *v, int b1, int b2) {
+    while (b1 != b2) {
+        while (v->rpo[b1] > v->rpo[b2]) {
+            b1 = v->idom[b1];
+        }
+        while (v->rpo[b2] > v->rpo[b1]) {
+            b2 = v->idom[b2];
+        }
+    }
+
+    return b1;
+}
+
+// Finds immediate dominators with the iterative algorithm of Cooper,
+// Harvey and Kennedy
+static void find_dominators(Verifier *v) {
+    IrFunc *f = v->f;
+    int *rpo_order = alloc_array(f->num_blocks, sizeof(int));
+    int n = number_blocks(v, rpo_order) - rpo_order;
+
+    // Predecessors of each reachable block, in one array
+    int *num_preds = alloc_array(f->num_blocks + 1, sizeof(int));
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        IrInst *term = &f->insts[f->blocks[rpo_order[i]].end - 1];
+        for (int j = 0; j < num_succs(term); ++j) {
+            num_preds[term->succ[j] + 1]++;
+            total++;
+        }
+    }
+    for (int b = 0; b < f->num_blocks; ++b) {
+        num_preds[b + 1] += num_preds[b];
+    }
+
+    int *preds = alloc_array(total, sizeof(int));
+    int *fill = alloc_array(f->num_blocks, sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        int b = rpo_order[i];
+        IrInst *term = &f->insts[f->blocks[b].end - 1];
+        for (int j = 0; j < num_succs(term); ++j) {
+            int s = term->succ[j];
+            preds[num_preds[s] + fill[s]++] = b;
+        }
+    }
+
+    for (int b = 0; b < f->num_blocks; ++b) {
+        v->idom[b] = -1;
+    }
+    v->idom[0] = 0;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 1; i < n; ++i) {
+            int b = rpo_order[i];
+            int idom = -1;
+            for (int j = num_preds[b]; j < num_preds[b + 1]; ++j) {
+                int p = preds[j];
+                if (v->idom[p] < 0) {
+                    continue;
+                }
+                idom = idom < 0 ? p : intersect(v, p, idom);
+            }
+
+            if (v->idom[b] != idom) {
+                v->idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+
+    free(rpo_order);
+    free(num_preds);
+    free(preds);
+    free(fill);
+    return;
+}
+
+static bool dominates(Verifier *v, int d, int b) {
+    while (b != d && b != 0) {
+        b = v->idom[b];
+    }
+
+    return b == d;
+}
+
+static void check_use(Verifier *v, int val) {
+    int b = v->inst_block[v->cur];
+    int d = v->def_block[val];
+
+    if (d < 0) {
+        fail(v, "use of undefined value");
+    }
+
+    if (d == b) {
+        if (v->def_index[val] >= v->cur) {
+            fail(v, "use before definition");
+        }
+    } else if (v->rpo[b] >= 0 && !dominates(v, d, b)) {
+        fail(v, "use not dominated by definition");
+    }
+
+    return;
+}
+
+// Checks that f is well-formed and in SSA form. A failure is an internal
+// error in the compiler, and is reported as such.
+void ir_verify(IrFunc *f, Obj *fn) {
+    Verifier v = { f, fn };
+    v.inst_block = alloc_array(f->len, sizeof(int));
+    v.def_block = alloc_array(f->num_values + 1, sizeof(int));
+    v.def_index = alloc_array(f->num_values + 1, sizeof(int));
+    v.rpo = alloc_array(f->num_blocks, sizeof(int));
+    v.idom = alloc_array(f->num_blocks, sizeof(int));
+
+    for (int i = 0; i <= f->num_values; ++i) {
+        v.def_block[i] = -1;
+    }
+
+    // The blocks must cover the instructions in order, each ending with
+    // its only terminator
+    int pos = 0;
+    for (int i = 0; i < f->num_order; ++i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        v.cur = pos;
+        if (bb->begin != pos || bb->end <= bb->begin) {
+            fail(&v, "block out of order or empty");
+        }
+
+        for (int j = bb->begin; j < bb->end; ++j) {
+            v.cur = j;
+            v.inst_block[j] = f->order[i];
+            if (is_terminator(f->insts[j].op) != (j == bb->end - 1)) {
+                fail(&v, "block not ended by exactly one terminator");
+            }
+        }
+        pos = bb->end;
+    }
+
+    v.cur = pos;
+    if (pos != f->len || f->num_order != f->num_blocks || f->order[0] != 0) {
+        fail(&v, "blocks do not cover the function");
+    }
+
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        v.cur = i;
+
+        if (defines_value(inst->op)) {
+            if (inst->dst < 1 || inst->dst > f->num_values || v.def_block[inst->dst] >= 0) {
+                fail(&v, "value not defined exactly once");
+            }
+            v.def_block[inst->dst] = v.inst_block[i];
+            v.def_index[inst->dst] = i;
+        } else if (inst->dst != 0) {
+            fail(&v, "instruction cannot define a value");
+        }
+
+        for (int j = 0; j < num_succs(inst); ++j) {
+            if (inst->succ[j] < 0 || inst->succ[j] >= f->num_blocks) {
+                fail(&v, "branch to nonexistent block");
+            }
+        }
+
+        switch (inst->op) {
+        case IR_PARAM:
+            if (v.inst_block[i] != 0 || inst->imm < 0 || inst->imm >= 8) {
+                fail(&v, "bad parameter");
+            }
+            break;
+        case IR_LOAD:
+        case IR_STORE:
+            if (inst->size != 1 && inst->size != 8) {
+                fail(&v, "bad access size");
+            }
+            break;
+        case IR_CALL:
+            if (inst->b > 8 || inst->a < 0 || inst->a + inst->b > f->num_args) {
+                fail(&v, "bad arguments");
+            }
+            break;
+        default:
+            break;
+        }
+
+        int *ops[8];
+        int n = ir_operands(f, inst, ops);
+        for (int j = 0; j < n; ++j) {
+            if (*ops[j] < 1 || *ops[j] > f->num_values) {
+                fail(&v, "operand out of range");
+            }
+        }
+    }
+
+    find_dominators(&v);
+    for (int i = 0; i < f->len; ++i) {
+        v.cur = i;
+        int *ops[8];
+        int n = ir_operands(f, &f->insts[i], ops);
+        for (int j = 0; j < n; ++j) {
+            check_use(&v, *ops[j]);
+        }
+    }
+
+    free(v.inst_block);
+    free(v.def_block);
+    free(v.def_index);
+    free(v.rpo);
+    free(v.idom);
+    return;
+}
+
+//
+// Constant folding
+//
+
+typedef struct {
+    IrFunc *f;
+
+    // Instruction defining each value, and the value each removed one was
+    // replaced by
+    int *def;
+    int *repl;
+
+    bool *dead;
+    bool *reachable;
+
+    // Value of the local variable at each frame offset, valid if its
+    // generation is the current one
+    int *known;
+    int *known_gen;
+    int gen;
+} Folder;
+
+static IrInst *def_of(Folder *fo, int val) {
+    return &fo->f->insts[fo->def[val]];
+}
+
+static bool is_const(Folder *fo, int val, long long *out) {
+    IrInst *inst = def_of(fo, val);
+    if (inst->op != IR_IMM) {
+        return false;
+    }
+
+    *out = inst->imm;
+    return true;
+}
+
+static void set_const(IrInst *inst, long long val) {
+    inst->op = IR_IMM;
+    inst->imm = val;
+    inst->a = inst->b = 0;
+    return;
+}
+
+// Removes instruction i, whose value is the same as val
+static void replace(Folder *fo, int i, int val) {
+    fo->repl[fo->f->insts[i].dst] = val;
+    fo->dead[i] = true;
+    return;
+}
+
+// Evaluates a binary operation on constants with the wrapping 64-bit
+// arithmetic of the generated code. Returns false for divisions whose
+// result is undefined.
+static bool eval(IrOp op, long long x, long long y, long long *out) {
+    unsigned long long ux = x;
+    unsigned long long uy = y;
+
+    switch (op) {
+    case IR_ADD: *out = (long long)(ux + uy); return true;
+    case IR_SUB: *out = (long long)(ux - uy); return true;
+    case IR_MUL: *out = (long long)(ux * uy); return true;
+    case IR_DIV:
+        if (y == 0 || (x == LLONG_MIN && y == -1)) {
+            return false;
+        }
+        *out = x / y;
+        return true;
+    case IR_EQ: *out = x == y; return true;
+    case IR_NE: *out = x != y; return true;
+    case IR_LT: *out = x < y; return true;
+    case IR_LE: *out = x <= y; return true;
+    case IR_GT: *out = x > y; return true;
+    case IR_GE: *out = x >= y; return true;
+    default: return false;
+    }
+}
+
+// The operation that gives the same result with its operands swapped, or
+// -1 if there is none
+static int swapped_op(IrOp op) {
+    switch (op) {
+    case IR_ADD:
+    case IR_MUL:
+    case IR_EQ:
+    case IR_NE:
+        return op;
+    case IR_LT: return IR_GT;
+    case IR_LE: return IR_GE;
+    case IR_GT: return IR_LT;
+    case IR_GE: return IR_LE;
+    default: return -1;
+    }
+}
+
+static void fold_binary(Folder *fo, int i) {
+    IrInst *inst = &fo->f->insts[i];
+    long long x, y, val;
+    bool ca = is_const(fo, inst->a, &x);
+    bool cb = is_const(fo, inst->b, &y);
+
+    if (ca && cb) {
+        if (eval(inst->op, x, y, &val)) {
+            set_const(inst, val);
+        }
+        return;
+    }
+
+    // Keep constants on the right, where the identities below and
+    // instruction selection look for them
+    if (ca && swapped_op(inst->op) >= 0) {
+        inst->op = swapped_op(inst->op);
+        int tmp = inst->a;
+        inst->a = inst->b;
+        inst->b = tmp;
+        y = x;
+        cb = true;
+        ca = false;
+    }
+
+    if (inst->a == inst->b) {
+        switch (inst->op) {
+        case IR_SUB:
+        case IR_NE:
+        case IR_LT:
+        case IR_GT:
+            set_const(inst, 0);
+            return;
+        case IR_EQ:
+        case IR_LE:
+        case IR_GE:
+            set_const(inst, 1);
+            return;
+        default:
+            break;
+        }
+    }
+
+    if (ca && x == 0 && inst->op == IR_SUB) {
+        inst->op = IR_NEG;
+        inst->a = inst->b;
+        inst->b = 0;
+        return;
+    }
+
+    if (!cb) {
+        return;
+    }
+
+    switch (inst->op) {
+    case IR_ADD:
+    case IR_SUB:
+        if (y == 0) {
+            replace(fo, i, inst->a);
+        }
+        break;
+    case IR_MUL:
+        if (y == 0) {
+            set_const(inst, 0);
+        } else if (y == 1) {
+            replace(fo, i, inst->a);
+        } else if (y == -1) {
+            inst->op = IR_NEG;
+            inst->b = 0;
+        }
+        break;
+    case IR_DIV:
+        if (y == 1) {
+            replace(fo, i, inst->a);
+        } else if (y == -1) {
+            inst->op = IR_NEG;
+            inst->b = 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return;
+}
+
+static void fold_inst(Folder *fo, int i) {
+    IrInst *inst = &fo->f->insts[i];
+    long long x;
+
+    switch (inst->op) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+        fold_binary(fo, i);
+        break;
+    case IR_NEG:
+        if (is_const(fo, inst->a, &x)) {
+            set_const(inst, (long long)(0 - (unsigned long long)x));
+        } else if (def_of(fo, inst->a)->op == IR_NEG) {
+            replace(fo, i, def_of(fo, inst->a)->a);
+        }
+        break;
+    case IR_BR:
+        if (is_const(fo, inst->a, &x)) {
+            inst->op = IR_JMP;
+            inst->succ[0] = inst->succ[x == 0];
+            inst->a = 0;
+        } else if (inst->succ[0] == inst->succ[1]) {
+            inst->op = IR_JMP;
+            inst->a = 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return;
+}
+
+// Returns the local variable at address val, or NULL if val is any other
+// address
+static Obj *local_var(Folder *fo, int val) {
+    IrInst *inst = def_of(fo, val);
+    return inst->op == IR_LOCAL ? inst->var : NULL;
+}
+
+// Forgets the contents of every local variable
+static void forget_all(Folder *fo) {
+    fo->gen++;
+    return;
+}
+
+// Replaces loads of local variables whose 8-byte value is already known
+// in the block, from an earlier load or store, by that value. Stores
+// through other addresses and calls may change any variable whose address
+// has been taken, so they end what is known.
+static void forward(Folder *fo, int i) {
+    IrInst *inst = &fo->f->insts[i];
+
+    switch (inst->op) {
+    case IR_LOAD: {
+        Obj *var = local_var(fo, inst->a);
+        if (var == NULL || inst->size != 8) {
+            break;
+        }
+
+        int off = var->offset;
+        if (fo->known_gen[off] == fo->gen) {
+            replace(fo, i, fo->known[off]);
+        } else {
+            fo->known_gen[off] = fo->gen;
+            fo->known[off] = inst->dst;
+        }
+        break;
+    }
+    case IR_STORE: {
+        Obj *var = local_var(fo, inst->a);
+        if (var == NULL) {
+            forget_all(fo);
+            break;
+        }
+
+        int off = var->offset;
+        fo->known_gen[off] = inst->size == 8 ? fo->gen : 0;
+        fo->known[off] = inst->b;
+        break;
+    }
+    case IR_CALL:
+        forget_all(fo);
+        break;
+    default:
+        break;
+    }
+
+    return;
+}
+
+static bool has_side_effects(IrOp op) {
+    return op == IR_STORE || op == IR_CALL || is_terminator(op);
+}
+
+static void find_reachable(Folder *fo) {
+    IrFunc *f = fo->f;
+    int *stack = alloc_array(f->num_blocks, sizeof(int));
+    memset(fo->reachable, 0, f->num_blocks * sizeof(bool));
+
+    int sp = 0;
+    stack[sp++] = 0;
+    fo->reachable[0] = true;
+    while (sp > 0) {
+        IrInst *term = &f->insts[f->blocks[stack[--sp]].end - 1];
+        for (int j = 0; j < num_succs(term); ++j) {
+            int s = term->succ[j];
+            if (!fo->reachable[s]) {
+                fo->reachable[s] = true;
+                stack[sp++] = s;
+            }
+        }
+    }
+
+    free(stack);
+    return;
+}
+
+// Removes the instructions without side effects whose values are not used
+// by reachable code. Uses follow definitions in layout order, so one
+// backward walk removes whole dead chains.
+static void remove_dead(Folder *fo) {
+    IrFunc *f = fo->f;
+    int *uses = alloc_array(f->num_values + 1, sizeof(int));
+
+    for (int i = 0; i < f->num_order; ++i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        for (int j = bb->begin; fo->reachable[f->order[i]] && j < bb->end; ++j) {
+            int *ops[8];
+            int n = fo->dead[j] ? 0 : ir_operands(f, &f->insts[j], ops);
+            for (int k = 0; k < n; ++k) {
+                uses[*ops[k]]++;
+            }
+        }
+    }
+
+    for (int i = f->num_order - 1; i >= 0; --i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        for (int j = bb->end - 1; fo->reachable[f->order[i]] && j >= bb->begin; --j) {
+            IrInst *inst = &f->insts[j];
+            if (fo->dead[j] || has_side_effects(inst->op) || uses[inst->dst] > 0) {
+                continue;
+            }
+
+            fo->dead[j] = true;
+            int *ops[8];
+            int n = ir_operands(f, inst, ops);
+            for (int k = 0; k < n; ++k) {
+                uses[*ops[k]]--;
+            }
+        }
+    }
+
+    free(uses);
+    return;
+}
+
+// Follows jumps through blocks that consist of nothing but a jump
+static int jump_target(Folder *fo, int b) {
+    IrFunc *f = fo->f;
+    for (int n = 0; n < f->num_blocks; ++n) {
+        IrBlock *bb = &f->blocks[b];
+        IrInst *term = &f->insts[bb->end - 1];
+        if (term->op != IR_JMP) {
+            break;
+        }
+
+        for (int j = bb->begin; j < bb->end - 1; ++j) {
+            if (!fo->dead[j]) {
+                return b;
+            }
+        }
+        b = term->succ[0];
+    }
+
+    return b;
+}
+
+// Removes the dead instructions and unreachable blocks, and numbers the
+// remaining blocks in layout order
+static void compact(Folder *fo) {
+    IrFunc *f = fo->f;
+    int *number = alloc_array(f->num_blocks, sizeof(int));
+    int num_order = 0;
+    for (int i = 0; i < f->num_order; ++i) {
+        if (fo->reachable[f->order[i]]) {
+            number[f->order[i]] = num_order++;
+        }
+    }
+
+    // Instructions only move down, so they can be rewritten in place, but
+    // block numbers change arbitrarily
+    IrBlock *blocks = alloc_array(f->num_blocks, sizeof(IrBlock));
+    memcpy(blocks, f->blocks, f->num_blocks * sizeof(IrBlock));
+
+    int len = 0;
+    for (int i = 0; i < f->num_order; ++i) {
+        int b = f->order[i];
+        if (!fo->reachable[b]) {
+            continue;
+        }
+
+        int begin = len;
+        for (int j = blocks[b].begin; j < blocks[b].end; ++j) {
+            if (fo->dead[j]) {
+                continue;
+            }
+
+            IrInst *inst = &f->insts[len++];
+            *inst = f->insts[j];
+            for (int k = 0; k < num_succs(inst); ++k) {
+                inst->succ[k] = number[inst->succ[k]];
+            }
+        }
+
+        f->blocks[number[b]] = (IrBlock) { begin, len };
+        f->order[number[b]] = number[b];
+    }
+
+    f->len = len;
+    f->num_blocks = f->num_order = num_order;
+
+    free(number);
+    free(blocks);
+    return;
+}
+
+// Evaluates operations on constants, applies algebraic identities such as
+// x*1 = x and x-x = 0, turns branches on constants into jumps, and then
+// removes the code that is left dead or unreachable.
+void ir_fold(IrFunc *f) {
+    Folder fo = { f };
+    fo.def = alloc_array(f->num_values + 1, sizeof(int));
+    fo.repl = alloc_array(f->num_values + 1, sizeof(int));
+    fo.dead = alloc_array(f->len, sizeof(bool));
+    fo.reachable = alloc_array(f->num_blocks, sizeof(bool));
+
+    int max_offset = 0;
+    for (int i = 0; i < f->len; ++i) {
+        if (f->insts[i].op == IR_LOCAL && f->insts[i].var->offset > max_offset) {
+            max_offset = f->insts[i].var->offset;
+        }
+    }
+    fo.known = alloc_array(max_offset + 1, sizeof(int));
+    fo.known_gen = alloc_array(max_offset + 1, sizeof(int));
+
+    // Definitions come before their uses in layout order, as each block is
+    // laid out after the blocks dominating it
+    for (int i = 0; i < f->num_order; ++i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        forget_all(&fo);
+
+        for (int j = bb->begin; j < bb->end; ++j) {
+            IrInst *inst = &f->insts[j];
+            int *ops[8];
+            int n = ir_operands(f, inst, ops);
+            for (int k = 0; k < n; ++k) {
+                if (fo.repl[*ops[k]]) {
+                    *ops[k] = fo.repl[*ops[k]];
+                }
+            }
+
+            if (defines_value(inst->op)) {
+                fo.def[inst->dst] = j;
+            }
+            forward(&fo, j);
+            if (!fo.dead[j]) {
+                fold_inst(&fo, j);
+            }
+        }
+    }
+
+    find_reachable(&fo);
+    remove_dead(&fo);
+
+    for (int i = 0; i < f->len; ++i) {
+        IrInst *inst = &f->insts[i];
+        for (int j = 0; j < num_succs(inst); ++j) {
+            inst->succ[j] = jump_target(&fo, inst->succ[j]);
+        }
+    }
+
+    find_reachable(&fo);
+    compact(&fo);
+
+    free(fo.def);
+    free(fo.repl);
+    free(fo.dead);
+    free(fo.reachable);
+    free(fo.known);
+    free(fo.known_gen);
+    return;
+}
+
+//
+// Textual dump
+//
+
+static char *op_name[] = {
+    [IR_IMM] = "imm",
+    [IR_PARAM] = "param",
+    [IR_LOCAL] = "local",
+    [IR_GLOBAL] = "global",
+    [IR_LOAD] = "load",
+    [IR_STORE] = "store",
+    [IR_ADD] = "add",
+    [IR_SUB] = "sub",
+    [IR_MUL] = "mul",
+    [IR_DIV] = "div",
+    [IR_NEG] = "neg",
+    [IR_EQ] = "eq",
+    [IR_NE] = "ne",
+    [IR_LT] = "lt",
+    [IR_LE] = "le",
+    [IR_GT] = "gt",
+    [IR_GE] = "ge",
+    [IR_CALL] = "call",
+    [IR_JMP] = "jmp",
+    [IR_BR] = "br",
+    [IR_RET] = "ret",
+};
+
+static void dump_inst(IrFunc *f, IrInst *inst, FILE *fp) {
+    fprintf(fp, "    ");
+    if (inst->dst != 0) {
+        fprintf(fp, "v%d = ", inst->dst);
+    }
+    fprintf(fp, "%s", op_name[inst->op]);
+
+    switch (inst->op) {
+    case IR_IMM:
+    case IR_PARAM:
+        fprintf(fp, " %lld", inst->imm);
+        break;
+    case IR_LOCAL:
+    case IR_GLOBAL:
+        fprintf(fp, " %s", inst->var->name);
+        break;
+    case IR_LOAD:
+        fprintf(fp, ".%d v%d", inst->size, inst->a);
+        break;
+    case IR_STORE:
+        fprintf(fp, ".%d v%d, v%d", inst->size, inst->a, inst->b);
+        break;
+    case IR_NEG:
+        fprintf(fp, " v%d", inst->a);
+        break;
+    case IR_CALL:
+        fprintf(fp, " %s(", inst->sym);
+        for (int i = 0; i < inst->b; ++i) {
+            fprintf(fp, "%sv%d", i ? ", " : "", f->args[inst->a + i]);
+        }
+        fprintf(fp, ")");
+        break;
+    case IR_JMP:
+        fprintf(fp, " bb%d", inst->succ[0]);
+        break;
+    case IR_BR:
+        fprintf(fp, " v%d, bb%d, bb%d", inst->a, inst->succ[0], inst->succ[1]);
+        break;
+    case IR_RET:
+        if (inst->a != 0) {
+            fprintf(fp, " v%d", inst->a);
+        }
+        break;
+    default:
+        fprintf(fp, " v%d, v%d", inst->a, inst->b);
+        break;
+    }
+
+    fprintf(fp, "\n");
+    return;
+}
+
+void ir_dump(IrFunc *f, Obj *fn, FILE *fp) {
+    fprintf(fp, "function %s\n", fn->name);
+    for (int i = 0; i < f->num_order; ++i) {
+        IrBlock *bb = &f->blocks[f->order[i]];
+        fprintf(fp, "bb%d:\n", f->order[i]);
+        for (int j = bb->begin; j < bb->end; ++j) {
+            dump_inst(f, &f->insts[j], fp);
+        }
+    }
+
+    return;
+}
@@ -1,23 +1,72 @@
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "main.h"
 
+// A file to compile and what came of it
+typedef struct {
+    char *path;
+    bool failed;
+    int lines;
+    int tokens;
+    long bytes;
+} Input;
+
 static char *opt_o;
-static char *input_file;
+static char *opt_d;
+static bool opt_c;
+static int opt_max_errors = 1;
+static char *opt_server;
+static char *opt_connect;
+static bool opt_cache_stats;
+static bool opt_peephole_stats;
+static bool opt_time_report;
+static bool opt_mem_report;
+static bool opt_report_json;
+
+// Connection to a compile server, or -1 to compile in this process
+static int server_conn = -1;
+
+static Input *inputs;
+static int num_inputs;
 
 static void usage(int status) {
-    fprintf(stderr, "Usage: ./main [-o <path>] <file>\n");
+    fprintf(stderr, "Usage: ./main [-c] [-o <path> | -d <dir>] [-j <n>] [-fmax-errors=<n>] [--connect=<socket>]\n"
+                    "              [--cache=<dir> [--cache-stats]] [-ftime-report] [-fmem-report]\n"
+                    "              [-freport-format=text|json] [-fdump-ir] [-fverify-ir] [-fpeephole-stats]\n"
+                    "              <file>...\n"
+                    "       ./main [-j <n>] [--cache=<dir>] --server=<socket>\n");
     exit(status);
 }
 
+static void add_input(char *path) {
+    static int cap;
+    if (num_inputs == cap) {
+        cap = cap ? cap * 2 : 16;
+        inputs = grow_array(inputs, cap, sizeof(*inputs));
+    }
+
+    inputs[num_inputs++] = (Input) { .path = path };
+    return;
+}
+
 static void parse_args(int argc, char **argv) {
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "--help") == 0) {
             usage(EXIT_SUCCESS);
         }
 
+        if (strcmp(argv[i], "-c") == 0) {
+            opt_c = true;
+            continue;
+        }
+
         if (strcmp(argv[i], "-o") == 0) {
             if (argv[++i] == NULL) {
                 usage(EXIT_FAILURE);
@@ -32,38 +81,302 @@ static void parse_args(int argc, char **argv) {
             continue;
         }
 
+        if (strcmp(argv[i], "-d") == 0) {
+            if (argv[++i] == NULL) {
+                usage(EXIT_FAILURE);
+            }
+
+            opt_d = argv[i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "-j") == 0) {
+            if (argv[++i] == NULL) {
+                usage(EXIT_FAILURE);
+            }
+
+            num_threads = atoi(argv[i]);
+            continue;
+        }
+
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            num_threads = atoi(argv[i] + 2);
+            continue;
+        }
+
+        if (strncmp(argv[i], "-fmax-errors=", 13) == 0) {
+            opt_max_errors = atoi(argv[i] + 13);
+            continue;
+        }
+
+        if (strcmp(argv[i], "-ftime-report") == 0) {
+            opt_time_report = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-fmem-report") == 0) {
+            opt_mem_report = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-fdump-ir") == 0) {
+            dump_ir = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-fverify-ir") == 0) {
+            verify_ir = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-fpeephole-stats") == 0) {
+            opt_peephole_stats = true;
+            continue;
+        }
+
+        if (strncmp(argv[i], "-freport-format=", 16) == 0) {
+            if (strcmp(argv[i] + 16, "json") == 0) {
+                opt_report_json = true;
+            } else if (strcmp(argv[i] + 16, "text") == 0) {
+                opt_report_json = false;
+            } else {
+                error("Unknown report format: %s", argv[i] + 16);
+            }
+            continue;
+        }
+
+        if (strncmp(argv[i], "--server=", 9) == 0) {
+            opt_server = argv[i] + 9;
+            continue;
+        }
+
+        if (strncmp(argv[i], "--connect=", 10) == 0) {
+            opt_connect = argv[i] + 10;
+            continue;
+        }
+
+        if (strncmp(argv[i], "--cache=", 8) == 0) {
+            cache_init(argv[i] + 8);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--cache-stats") == 0) {
+            opt_cache_stats = true;
+            continue;
+        }
+
         if (argv[i][0] == '-' && argv[i][1] != '\0') {
             error("Unknown argument: %s", argv[i]);
         }
 
-        input_file = argv[i];
+        add_input(argv[i]);
+    }
+
+    if (opt_server != NULL) {
+        if (num_inputs > 0) {
+            error("Cannot compile files with --server");
+        }
+        return;
+    }
+
+    if (opt_connect == NULL) {
+        opt_connect = getenv("MAIN_SERVER");
     }
 
-    if (input_file == NULL) {
+    if (num_inputs == 0) {
         error("No input files");
     }
+
+    if (opt_o != NULL && num_inputs > 1) {
+        error("Cannot use -o with multiple input files; use -d instead");
+    }
 }
 
-static FILE *open_file(char *path) {
+// With a single input, the output goes to -o or to stdout. Otherwise each
+// input gets an output file named after it in -d or the current directory,
+// with .s or .o in place of its extension.
+static char *output_path(char *input) {
+    if (num_inputs == 1 && opt_d == NULL) {
+        return opt_o;
+    }
+
+    char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    char *dot = strrchr(base, '.');
+    int len = dot ? dot - base : (int)strlen(base);
+    return format("%s/%.*s%s", opt_d ? opt_d : ".", len, base, opt_c ? ".o" : ".s");
+}
+
+static int open_file(char *path) {
     if (path == NULL || strcmp(path, "-") == 0) {
-        return stdout;
+        return STDOUT_FILENO;
     }
 
-    FILE *out = fopen(path, "w");
-    if (out == NULL) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
         error("Cannot open output file: %s: %s", path, strerror(errno));
     }
 
+    return fd;
+}
+
+static void free_output(void *arg) {
+    buf_free(arg);
+    return;
+}
+
+// Has the compile server compile a file. Returns the output, or NULL if
+// compilation failed.
+static Buffer *compile_remote(Input *in) {
+    char *src = read_file(in->path);
+    Buffer *out = arena_new(Buffer);
+    buf_init(out, -1);
+    arena_on_release(free_output, out);
+
+    if (!server_compile(server_conn, in->path, src, strlen(src), opt_c, out)) {
+        return NULL;
+    }
     return out;
 }
 
+// Compiles one file on the calling thread, or has the compile server
+// compile it. A fatal error gives up on this file only, and removes its
+// partly written output.
+static void compile_file(Input *in) {
+    jmp_buf *prev = error_abort;
+    jmp_buf env;
+    char *volatile path = NULL;
+    volatile int fd = -1;
+
+    if (setjmp(env) == 0) {
+        error_abort = &env;
+        max_errors = opt_max_errors;
+
+        if (server_conn >= 0) {
+            Buffer *out = compile_remote(in);
+            if (out != NULL) {
+                path = output_path(in->path);
+                fd = open_file(path);
+                out->fd = fd;
+                buf_flush(out);
+            } else {
+                in->failed = true;
+            }
+        } else {
+            phase_start(PHASE_TOKENIZE);
+            Token tk = tokenize_file(in->path);
+            in->lines = tokens->num_lines;
+            in->tokens = tokens->len;
+            in->bytes = tokens->offset[tokens->len - 1];
+
+            phase_start(PHASE_PARSE);
+            Obj *prog = parse(tk);
+            stats_count(prog);
+            if (error_count() == 0) {
+                path = output_path(in->path);
+                fd = open_file(path);
+                codegen(prog, fd, opt_c);
+            } else {
+                in->failed = true;
+            }
+        }
+    } else {
+        in->failed = true;
+    }
+
+    error_abort = prev;
+    if (fd >= 0 && fd != STDOUT_FILENO) {
+        close(fd);
+        if (in->failed) {
+            unlink(path);
+        }
+    }
+
+    stats_end_file();
+    arena_release();
+    return;
+}
+
+static void compile_task(void *arg, int i) {
+    compile_file(&((Input *)arg)[i]);
+    return;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(double secs) {
+    long lines = 0;
+    long toks = 0;
+    long bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < num_inputs; ++i) {
+        lines += inputs[i].lines;
+        toks += inputs[i].tokens;
+        bytes += inputs[i].bytes;
+        failed += inputs[i].failed;
+    }
+
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+
+    fprintf(stderr, "%d files (%d failed), %ld lines, %ld tokens, %.1f MB in %.3f s: "
+            "%.0f lines/s, %.0f tokens/s, %.1f MB/s\n",
+            num_inputs, failed, lines, toks, bytes / 1e6, secs,
+            lines / secs, toks / secs, bytes / 1e6 / secs);
+    return;
+}
+
 int main(int argc, char **argv) {
     parse_args(argc, argv);
 
-    Token *tk = tokenize_file(input_file);
-    Obj *prog = parse(tk);
+    if (opt_server != NULL) {
+        run_server(opt_server);
+    }
+
+    if (opt_time_report || opt_mem_report) {
+        stats_enable(num_inputs == 1);
+    }
+
+    // A single file is compiled on this thread, which leaves the pool to
+    // code generation. Several files are compiled in parallel, each on one
+    // thread. With a compile server, files are sent over one connection in
+    // turn.
+    double start = now();
+    if (opt_connect != NULL) {
+        server_conn = server_connect(opt_connect);
+        for (int i = 0; i < num_inputs; ++i) {
+            compile_file(&inputs[i]);
+        }
+        close(server_conn);
+    } else if (num_inputs == 1) {
+        compile_file(&inputs[0]);
+    } else {
+        run_parallel(num_inputs, compile_task, inputs);
+        report(now() - start);
+    }
+
+    if (opt_cache_stats) {
+        cache_report();
+    }
+
+    if (opt_peephole_stats) {
+        peephole_report();
+    }
+
+    if (opt_time_report || opt_mem_report) {
+        stats_report(opt_time_report, opt_mem_report, opt_report_json);
+    }
+
+    bool failed = false;
+    for (int i = 0; i < num_inputs; ++i) {
+        failed |= inputs[i].failed;
+    }
 
-    FILE *out = open_file(opt_o);
-    codegen(prog, out);
-    return EXIT_SUCCESS;
+    free(inputs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
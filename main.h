@@ -1,19 +1,92 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include <setjmp.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-typedef struct Token Token;
-typedef struct Node Node;
+typedef uint32_t Node;
 typedef struct Obj Obj;
 typedef struct Type Type;
 
+//
+// Arena
+//
+
+void *arena_alloc(size_t size);
+char *arena_strndup(char *p, size_t len);
+void arena_on_release(void (*fn)(void *), void *arg);
+void arena_release(void);
+
+// Bytes allocated on this thread by arena_alloc and by the arrays that are
+// grown with realloc. Tasks on the thread pool add theirs to the thread
+// that started them.
+extern _Thread_local size_t bytes_allocated;
+
+void *grow_array(void *p, int cap, size_t size);
+
+#define arena_new(T) ((T *)arena_alloc(sizeof(T)))
+
 //
 // String
 //
 
 char *format(char *fmt, ...);
+int intern(char *s, int len);
+char *atom_name(int id);
+char **atom_table(void);
+void share_atom_table(char **names);
+
+//
+// Hashmap
+//
+
+typedef struct {
+    void *key;
+    int keylen;
+    uint64_t hash;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *buckets;
+    int capacity;
+    int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void *hashmap_get_ptr(HashMap *map, void *key);
+void hashmap_put_ptr(HashMap *map, void *key, void *val);
+
+//
+// Thread pool
+//
+
+extern int num_threads;
+
+void run_parallel(int n, void (*fn)(void *arg, int i), void *arg);
+
+//
+// Scanner
+//
+
+// Number of zero bytes every source buffer carries after its terminating
+// NUL, so that the vectorized scanners can read past the end of input.
+#define SCAN_PADDING 64
+
+void scan_init(void);
+bool scan_use(char *name);
+char *skip_space(char *p);
+char *skip_ident(char *p);
+char *skip_digits(char *p);
+char *find_newline(char *p);
+char *find_comment_end(char *p);
 
 //
 // Tokenizer
@@ -29,30 +102,130 @@ typedef enum {
     TK_EOF,
 } TokenKind;
 
-// Token
-struct Token {
-    TokenKind kind;
-    Token *next;
-
-    // Integer literal
-    long long val;
-
-    // String literal
-    Type *ty;
+// Keyword kind
+typedef enum {
+    KW_NONE,
+    KW_RETURN,
+    KW_IF,
+    KW_ELSE,
+    KW_FOR,
+    KW_WHILE,
+    KW_INT,
+    KW_SIZEOF,
+    KW_CHAR,
+} KeywordKind;
+
+// Punctuator kind
+typedef enum {
+    PU_NONE,
+    PU_LPAREN,
+    PU_RPAREN,
+    PU_LBRACE,
+    PU_RBRACE,
+    PU_LBRACKET,
+    PU_RBRACKET,
+    PU_SEMICOLON,
+    PU_COMMA,
+    PU_PLUS,
+    PU_MINUS,
+    PU_STAR,
+    PU_SLASH,
+    PU_AMP,
+    PU_ASSIGN,
+    PU_EQ,
+    PU_NE,
+    PU_LT,
+    PU_LE,
+    PU_GT,
+    PU_GE,
+} PunctKind;
+
+// String literal
+typedef struct {
     char *str;
-
-    // Identifier
-    char *loc;
-    size_t len;
-};
+    Type *ty;
+} StrLit;
+
+// Token stream. Tokens are stored in parallel arrays and referred to by
+// their index, so the token after tk is tk + 1. The last token is always
+// TK_EOF.
+typedef int Token;
+
+typedef struct {
+    char *filename;
+    char *input;
+
+    // Byte offsets of the start of every line
+    int *line_starts;
+    int num_lines;
+
+    // Per-token arrays
+    int len;
+    int cap;
+    unsigned char *kind;
+    uint32_t *offset;
+    uint32_t *length;
+
+    // KeywordKind, PunctKind, atom ID, or an index into vals or strs
+    uint32_t *payload;
+
+    // Integer and string literals
+    long long *vals;
+    int num_vals;
+    StrLit *strs;
+    int num_strs;
+} TokenStream;
+
+extern _Thread_local TokenStream *tokens;
+
+static inline TokenKind tk_kind(Token tk) {
+    return tokens->kind[tk];
+}
+
+static inline char *tk_loc(Token tk) {
+    return tokens->input + tokens->offset[tk];
+}
+
+static inline int tk_len(Token tk) {
+    return tokens->length[tk];
+}
+
+static inline char *tk_name(Token tk) {
+    return atom_name(tokens->payload[tk]);
+}
+
+static inline long long tk_val(Token tk) {
+    return tokens->vals[tokens->payload[tk]];
+}
+
+static inline StrLit *tk_str(Token tk) {
+    return &tokens->strs[tokens->payload[tk]];
+}
+
+static inline bool is_punct(Token tk, PunctKind punct) {
+    return tokens->kind[tk] == TK_PUNCT && tokens->payload[tk] == punct;
+}
+
+static inline bool is_keyword(Token tk, KeywordKind kw) {
+    return tokens->kind[tk] == TK_KEYWORD && tokens->payload[tk] == kw;
+}
+
+extern _Thread_local int max_errors;
+extern _Thread_local jmp_buf *error_recovery;
+extern _Thread_local jmp_buf *error_abort;
+extern _Thread_local Token error_token;
+extern _Thread_local FILE *error_output;
 
 int error(char *fmt, ...);
 int error_at(char *loc, char *fmt, ...);
-int error_tk(Token *tk, char *fmt, ...);
-bool equal(Token *tk, char *op);
-Token *skip(Token *tk, char *op);
-bool consume(Token **rest, Token *tk, char *str);
-Token *tokenize_file(char *path);
+int error_tk(Token tk, char *fmt, ...);
+_Noreturn void abort_file(void);
+int error_count(void);
+Token skip(Token tk, PunctKind punct);
+bool consume(Token *rest, Token tk, PunctKind punct);
+char *read_file(char *path);
+Token tokenize_file(char *path);
+Token tokenize_buffer(char *filename, char *p, size_t len);
 
 //
 // Parser
@@ -71,12 +244,19 @@ struct Obj {
     // Global variable
     char *init_data;
 
+    // String literal, which is anonymous and read-only
+    bool is_literal;
+
     // Function
     bool is_function;
     Obj *params;
-    Node *body;
+    Node body;
     Obj *locals;
     int stack_size;
+
+    // Tokens of the definition, from the declarator to the closing brace
+    Token begin;
+    Token end;
 };
 
 // AST node kind
@@ -106,41 +286,106 @@ typedef enum {
     ND_NUM,
 } NodeKind;
 
-// AST node
-struct Node {
-    NodeKind kind;
+// AST node. Nodes are stored in parallel arrays in an arena-backed pool
+// and referred to by index; index 0 is the null node. The meaning of the
+// two operand slots depends on the kind:
+//
+//   binary operators      a = lhs, b = rhs
+//   ND_NEG, ND_ADDR, ND_DEREF,
+//   ND_RETURN, ND_EXPR_STMT
+//                         a = lhs
+//   ND_NUM                a = low half of the value, b = high half
+//   ND_VAR                a = index into vars
+//   ND_IF                 a = index of cond, then, els in extra
+//   ND_FOR                a = index of cond, then, init, inc in extra
+//   ND_BLOCK, ND_STMT_EXPR, ND_FUNC_CALL
+//                         a = index of a count and that many statements
+//                             or arguments in extra
+typedef struct {
+    // Per-node arrays
+    int len;
+    int cap;
+    unsigned char *kind;
     Token *tk;
+    Type **ty;
+    uint32_t *a;
+    uint32_t *b;
 
-// Expression
-    Type *ty;
-    Node *lhs;
-    Node *rhs;
+    // Out-of-line children. extra[0] is 0, the empty list.
+    Node *extra;
+    int num_extra;
+    int extra_cap;
 
-    // Variable
-    Obj *var;
+    // Variables referred to by ND_VAR nodes
+    Obj **vars;
+    int num_vars;
+    int vars_cap;
+} NodePool;
 
-    // Integer literal
-    long long val;
+extern _Thread_local NodePool *nodes;
 
-    // Function call
-    char *funcname;
-    Node *args;
+static inline NodeKind node_kind(Node node) {
+    return nodes->kind[node];
+}
 
-// Statement
-    Node *next;
+static inline Token node_tk(Node node) {
+    return nodes->tk[node];
+}
 
-    // Block or statement expression
-    Node *body;
+static inline Type *node_ty(Node node) {
+    return nodes->ty[node];
+}
 
-    // if or for
-    Node *cond;
-    Node *then;
-    Node *els;
-    Node *init;
-    Node *inc;
-};
+static inline Node node_lhs(Node node) {
+    return nodes->a[node];
+}
+
+static inline Node node_rhs(Node node) {
+    return nodes->b[node];
+}
 
-Obj *parse(Token *tk);
+static inline long long node_val(Node node) {
+    return (long long)((uint64_t)nodes->b[node] << 32 | nodes->a[node]);
+}
+
+static inline Obj *node_var(Node node) {
+    return nodes->vars[nodes->a[node]];
+}
+
+static inline char *node_funcname(Node node) {
+    return tk_name(nodes->tk[node]);
+}
+
+static inline Node node_cond(Node node) {
+    return nodes->extra[nodes->a[node]];
+}
+
+static inline Node node_then(Node node) {
+    return nodes->extra[nodes->a[node] + 1];
+}
+
+static inline Node node_els(Node node) {
+    return nodes->extra[nodes->a[node] + 2];
+}
+
+static inline Node node_init(Node node) {
+    return nodes->extra[nodes->a[node] + 2];
+}
+
+static inline Node node_inc(Node node) {
+    return nodes->extra[nodes->a[node] + 3];
+}
+
+// Statements of a block or statement expression, or arguments of a call
+static inline int node_count(Node node) {
+    return nodes->extra[nodes->a[node]];
+}
+
+static inline Node *node_children(Node node) {
+    return &nodes->extra[nodes->a[node] + 1];
+}
+
+Obj *parse(Token tk);
 
 //
 // Types
@@ -155,15 +400,13 @@ typedef enum {
     TY_ARRAY,
 } TypeKind;
 
-// Type node
+// Type node. Derived types are canonical: structurally identical types
+// are the same object, so types can be compared by pointer.
 struct Type {
     TypeKind kind;
     int size;
 
-    // Declaration
-    Token *name;
-
-    // Pointer
+    // Pointer or array
     Type *base;
 
     // Array
@@ -171,24 +414,341 @@ struct Type {
 
     // Function type
     Type *return_ty;
-    Type *params;
-    Type *next;
+    Type **params;
+    int num_params;
 };
 
 extern Type *ty_char;
 extern Type *ty_int;
 
+// Number of nodes visited by add_type
+extern _Thread_local long type_visits;
+
+int type_count(void);
+
 bool is_integer(Type *ty);
-Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
-Type *func_type(Type *return_ty);
+Type *func_type(Type *return_ty, Type **params, int num_params);
 Type *array_of(Type *base, int len);
-void add_type(Node *node);
+void add_type(Node node);
+
+//
+// Emitter
+//
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+
+    // Flushed to fd when full, or grown if fd is negative
+    int fd;
+} Buffer;
+
+bool read_full(int fd, void *p, size_t len);
+bool write_full(int fd, void *p, size_t len);
+void buf_init(Buffer *b, int fd);
+void buf_flush(Buffer *b);
+void buf_free(Buffer *b);
+void buf_reserve(Buffer *b, size_t len);
+void buf_str(Buffer *b, char *s);
+void buf_int(Buffer *b, long long val);
+void buf_reg(Buffer *b, char prefix, int reg);
+
+static inline void buf_write(Buffer *b, char *s, size_t len) {
+    if (b->cap - b->len < len) {
+        buf_reserve(b, len);
+    }
+
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    return;
+}
+
+// Appends a string literal, whose length is known at compile time
+#define buf_lit(b, s) buf_write(b, s, sizeof(s) - 1)
+
+//
+// Assembler
+//
+
+// Registers are numbered 0-30 for x0-x30; 31 is the stack pointer in the
+// instructions below that accept it.
+#define REG_FP 29
+#define REG_LR 30
+#define REG_SP 31
+
+// AArch64 instructions used by the code generator
+typedef enum {
+    I_ADD,      // add rd, rn, rm, lsl #imm
+    I_SUB,      // sub rd, rn, rm, lsl #imm
+    I_ADD_LSR,  // add rd, rn, rm, lsr #imm
+    I_MUL,      // mul rd, rn, rm
+    I_SMULH,    // smulh rd, rn, rm
+    I_SDIV,     // sdiv rd, rn, rm
+    I_NEG,      // neg rd, rm, lsl #imm
+    I_LSL,      // lsl rd, rn, #imm
+    I_LSR,      // lsr rd, rn, #imm
+    I_ASR,      // asr rd, rn, #imm
+    I_ADD_IMM,  // add rd, rn, #imm
+    I_SUB_IMM,  // sub rd, rn, #imm
+    I_MOV,      // mov rd, rn
+    I_MOV_IMM,  // mov rd, #imm
+    I_CMP,      // cmp rn, rm
+    I_CMP_IMM,  // cmp rn, #imm
+    I_CSET,     // cset rd, <imm: condition code>
+    I_LDR,      // ldr xd, [rn, #imm]
+    I_LDRB,     // ldrb wd, [rn, #imm]
+    I_STR,      // str xd, [rn, #imm]
+    I_STRB,     // strb wd, [rn, #imm]
+    I_STP_PRE,  // stp rd, rm, [rn, #imm]!
+    I_LDP_POST, // ldp rd, rm, [rn], #imm
+    I_ADR,      // adr rd, sym
+    I_BL,       // bl sym
+    I_B,        // b label
+    I_BCOND,    // b<imm: condition code> label
+    I_RET,      // ret
+    I_LABEL,    // label:
+} InstKind;
+
+// Condition codes, as encoded in instructions
+typedef enum {
+    COND_EQ = 0,
+    COND_NE = 1,
+    COND_GE = 10,
+    COND_LT = 11,
+    COND_GT = 12,
+    COND_LE = 13,
+} CondCode;
+
+typedef struct {
+    unsigned char kind;
+    unsigned char rd;
+    unsigned char rn;
+    unsigned char rm;
+    int label;
+    long long imm;
+    char *sym;
+} Inst;
+
+// Local label. Its name is prefix followed by name, or by num if name is
+// NULL.
+typedef struct {
+    char *prefix;
+    char *name;
+    int num;
+} Label;
+
+// Relocation against sym at offset bytes into the encoded code
+typedef struct {
+    int offset;
+    int type;
+    char *sym;
+} Fixup;
+
+// Numbered label printed at offset bytes into the output buffer
+typedef struct {
+    int offset;
+    int num;
+} LabelRef;
+
+// Instructions of a function
+typedef struct {
+    Inst *insts;
+    int len;
+    int cap;
+
+    Label *labels;
+    int num_labels;
+    int labels_cap;
+
+    // Added to numbered labels when printing, so that functions generated
+    // separately still get distinct labels
+    int label_base;
+
+    Fixup *fixups;
+    int num_fixups;
+    int fixups_cap;
+
+    // Where print_code wrote numbered labels, so that the text can be
+    // reused with another label_base
+    LabelRef *label_refs;
+    int num_label_refs;
+    int label_refs_cap;
+} Code;
+
+void code_reset(Code *c);
+void code_free(Code *c);
+Inst *code_add(Code *c, InstKind kind);
+int code_label(Code *c, char *prefix, char *name, int num);
+void code_fixup(Code *c, int offset, int type, char *sym);
+void print_code(Code *c, Buffer *b);
+void encode_code(Code *c, Buffer *b);
+
+//
+// Peephole optimizer
+//
+
+void peephole(Code *c);
+void peephole_report(void);
+
+//
+// ELF writer
+//
+
+typedef enum {
+    SEC_TEXT,
+    SEC_DATA,
+    SEC_BSS,
+    SEC_RODATA,
+} SectionKind;
+
+void elf_init(void);
+void elf_define(char *name, SectionKind sec, bool is_func, int size);
+void elf_bytes(SectionKind sec, void *p, int len);
+void elf_reloc(int type, char *sym, int offset);
+int elf_size(SectionKind sec);
+void elf_write(int fd);
+
+//
+// Intermediate representation
+//
+
+// Functions are lowered to basic blocks of three-address instructions in
+// SSA form: each instruction defines at most one value, values are
+// numbered from 1 and defined exactly once, and every use is dominated by
+// the definition. Local variables stay in stack slots and are accessed
+// with loads and stores, so no phi instructions are needed.
+typedef enum {
+    IR_IMM,     // dst = imm
+    IR_PARAM,   // dst = parameter number imm
+    IR_LOCAL,   // dst = address of local var
+    IR_GLOBAL,  // dst = address of global var
+    IR_LOAD,    // dst = size bytes at address a
+    IR_STORE,   // size bytes at address a = b
+    IR_ADD,     // dst = a + b
+    IR_SUB,     // dst = a - b
+    IR_MUL,     // dst = a * b
+    IR_DIV,     // dst = a / b
+    IR_NEG,     // dst = -a
+    IR_EQ,      // dst = a == b
+    IR_NE,      // dst = a != b
+    IR_LT,      // dst = a < b
+    IR_LE,      // dst = a <= b
+    IR_GT,      // dst = a > b
+    IR_GE,      // dst = a >= b
+    IR_CALL,    // dst = sym(b arguments starting at args[a])
+    IR_JMP,     // goto succ[0]
+    IR_BR,      // goto a ? succ[0] : succ[1]
+    IR_RET,     // return a, or nothing if a is 0
+} IrOp;
+
+typedef struct {
+    unsigned char op;
+    unsigned char size;
+    int dst;
+    int a;
+    int b;
+    int succ[2];
+    long long imm;
+    Obj *var;
+    char *sym;
+} IrInst;
+
+// The instructions of a block are insts[begin] to insts[end - 1], and the
+// last one is its only terminator: IR_JMP, IR_BR or IR_RET.
+typedef struct {
+    int begin;
+    int end;
+} IrBlock;
+
+// A function in IR. Blocks are laid out in the order of their
+// instructions, which is listed in order; blocks[0] is the entry.
+typedef struct {
+    IrInst *insts;
+    int len;
+    int cap;
+
+    IrBlock *blocks;
+    int *order;
+    int num_blocks;
+    int num_order;
+    int blocks_cap;
+
+    int *args;
+    int num_args;
+    int args_cap;
+
+    int num_values;
+
+    // Block being filled while lowering, or -1 after a terminator
+    int cur;
+} IrFunc;
+
+// Set by -fdump-ir and -fverify-ir
+extern bool dump_ir;
+extern bool verify_ir;
+
+void ir_build(IrFunc *f, Obj *fn);
+int ir_operands(IrFunc *f, IrInst *inst, int **ops);
+void ir_verify(IrFunc *f, Obj *fn);
+void ir_fold(IrFunc *f);
+void ir_dump(IrFunc *f, Obj *fn, FILE *fp);
+void ir_free(IrFunc *f);
 
 //
 // Code generator
 //
 
-void codegen(Obj *prog, FILE *out);
+void codegen(Obj *prog, int fd, bool emit_obj);
+
+//
+// Compilation cache
+//
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} CacheKey;
+
+// Directory of the cache, or NULL if it is not in use
+extern char *cache_dir;
+
+void cache_init(char *dir);
+void cache_key(Obj *fn, bool emit_obj, CacheKey *key);
+char *cache_load(CacheKey *key, int *num_labels);
+void cache_render(char *entry, Code *code, Buffer *out);
+void cache_store(CacheKey *key, bool emit_obj, Code *code, int num_labels, Buffer *out);
+void cache_report(void);
+
+//
+// Statistics
+//
+
+typedef enum {
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_OFFSETS,
+    PHASE_CODEGEN,
+    PHASE_OUTPUT,
+    NUM_PHASES,
+} Phase;
+
+extern bool stats_enabled;
+
+void stats_enable(bool one_file);
+void phase_start(Phase phase);
+void phase_end(void);
+void stats_count(Obj *prog);
+void stats_end_file(void);
+void stats_report(bool time, bool mem, bool json);
+
+//
+// Compile server
+//
+
+_Noreturn void run_server(char *path);
+int server_connect(char *path);
+bool server_compile(int conn, char *name, char *src, size_t len, bool emit_obj, Buffer *out);
 
 #endif
@@ -1,4 +1,5 @@
 #define _POSIX_C_SOURCE 200809L
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -6,59 +7,189 @@
 #include <string.h>
 #include "main.h"
 
-static Obj *locals;
-static Obj *globals;
+// Calls pass arguments in x0-x7 only, which is also where parameters
+// arrive
+#define MAX_ARGS 8
+
+// Block scope. Each scope maps the interned names declared in it to their
+// variables; lookups walk from the innermost scope outwards.
+typedef struct Scope Scope;
+struct Scope {
+    Scope *next;
+    HashMap vars;
+};
+
+// Parser state is per thread, as each thread parses one file at a time
+_Thread_local NodePool *nodes;
+
+static _Thread_local Obj *locals;
+static _Thread_local Obj *globals;
+static _Thread_local Scope *scope;
+static _Thread_local int num_unique_names;
+
+// Children of the lists being parsed. A nested list pushes its children
+// above those of the enclosing one and moves them to the pool when it is
+// complete, so every list ends up contiguous.
+static _Thread_local Node *scratch;
+static _Thread_local int scratch_len;
+static _Thread_local int scratch_cap;
+
+static void enter_scope(void) {
+    Scope *sc = arena_new(Scope);
+    sc->next = scope;
+    scope = sc;
+    return;
+}
 
-static Obj *find_var(Token *tk) {
-    for (Obj *v = locals; v != NULL; v = v->next) {
-        if (strlen(v->name) == tk->len && !strncmp(tk->loc, v->name, tk->len)) {
-            return v;
-        }
-    }
+static void leave_scope(void) {
+    scope = scope->next;
+    return;
+}
 
-    for (Obj *v = globals; v != NULL; v = v->next) {
-        if (strlen(v->name) == tk->len && !strncmp(tk->loc, v->name, tk->len)) {
-            return v;
+static void push_scope(Obj *var) {
+    hashmap_put_ptr(&scope->vars, var->name, var);
+    return;
+}
+
+static Obj *find_var(Token tk) {
+    for (Scope *sc = scope; sc != NULL; sc = sc->next) {
+        Obj *var = hashmap_get_ptr(&sc->vars, tk_name(tk));
+        if (var != NULL) {
+            return var;
         }
     }
 
     return NULL;
 }
 
-static Node *new_node(NodeKind kind, Token *tk) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = kind;
-    node->tk = tk;
+// Returns a copy of the first len elements of p in a new arena array of
+// cap elements. The old array is left to the arena.
+static void *grow(void *p, int len, int cap, size_t size) {
+    void *buf = arena_alloc(size * cap);
+    memcpy(buf, p, size * len);
+    return buf;
+}
+
+static void new_pool(int cap) {
+    nodes = arena_new(NodePool);
+    nodes->cap = cap;
+    nodes->kind = arena_alloc(sizeof(*nodes->kind) * cap);
+    nodes->tk = arena_alloc(sizeof(*nodes->tk) * cap);
+    nodes->ty = arena_alloc(sizeof(*nodes->ty) * cap);
+    nodes->a = arena_alloc(sizeof(*nodes->a) * cap);
+    nodes->b = arena_alloc(sizeof(*nodes->b) * cap);
+    nodes->len = 1;
+
+    nodes->extra_cap = cap;
+    nodes->extra = arena_alloc(sizeof(*nodes->extra) * cap);
+    nodes->num_extra = 1;
+
+    nodes->vars_cap = 64;
+    nodes->vars = arena_alloc(sizeof(*nodes->vars) * nodes->vars_cap);
+
+    scratch_cap = 64;
+    scratch = arena_alloc(sizeof(*scratch) * scratch_cap);
+    scratch_len = 0;
+    return;
+}
+
+static Node new_node(NodeKind kind, Token tk) {
+    NodePool *p = nodes;
+    if (p->len == p->cap) {
+        p->cap *= 2;
+        p->kind = grow(p->kind, p->len, p->cap, sizeof(*p->kind));
+        p->tk = grow(p->tk, p->len, p->cap, sizeof(*p->tk));
+        p->ty = grow(p->ty, p->len, p->cap, sizeof(*p->ty));
+        p->a = grow(p->a, p->len, p->cap, sizeof(*p->a));
+        p->b = grow(p->b, p->len, p->cap, sizeof(*p->b));
+    }
+
+    Node node = p->len++;
+    p->kind[node] = kind;
+    p->tk[node] = tk;
+    p->ty[node] = NULL;
+    p->a[node] = 0;
+    p->b[node] = 0;
     return node;
 }
 
-static Node *new_binary(NodeKind kind, Node *lhs, Node *rhs, Token *tk) {
-    Node *node = new_node(kind, tk);
-    node->lhs = lhs;
-    node->rhs = rhs;
+static uint32_t add_extra(Node node) {
+    NodePool *p = nodes;
+    if (p->num_extra == p->extra_cap) {
+        p->extra_cap *= 2;
+        p->extra = grow(p->extra, p->num_extra, p->extra_cap, sizeof(*p->extra));
+    }
+
+    p->extra[nodes->num_extra] = node;
+    return nodes->num_extra++;
+}
+
+static void list_push(Node node) {
+    if (scratch_len == scratch_cap) {
+        scratch_cap *= 2;
+        scratch = grow(scratch, scratch_len, scratch_cap, sizeof(*scratch));
+    }
+
+    scratch[scratch_len++] = node;
+    return;
+}
+
+// Moves the children pushed since base to the pool and returns the index
+// of the list.
+static uint32_t list_end(int base) {
+    int n = scratch_len - base;
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t idx = add_extra(n);
+    for (int i = 0; i < n; ++i) {
+        add_extra(scratch[base + i]);
+    }
+
+    scratch_len = base;
+    return idx;
+}
+
+static Node new_binary(NodeKind kind, Node lhs, Node rhs, Token tk) {
+    Node node = new_node(kind, tk);
+    nodes->a[node] = lhs;
+    nodes->b[node] = rhs;
+    add_type(node);
     return node;
 }
 
-static Node *new_unary(NodeKind kind, Node *lhs, Token *tk) {
-    Node *node = new_node(kind, tk);
-    node->lhs = lhs;
+static Node new_unary(NodeKind kind, Node lhs, Token tk) {
+    Node node = new_node(kind, tk);
+    nodes->a[node] = lhs;
+    add_type(node);
     return node;
 }
 
-static Node *new_num(long long val, Token *tk) {
-    Node *node = new_node(ND_NUM, tk);
-    node->val = val;
+static Node new_num(long long val, Token tk) {
+    Node node = new_node(ND_NUM, tk);
+    nodes->a[node] = (uint32_t)val;
+    nodes->b[node] = (uint32_t)((uint64_t)val >> 32);
+    add_type(node);
     return node;
 }
 
-static Node *new_var_node(Obj *var, Token *tk) {
-    Node *node = new_node(ND_VAR, tk);
-    node->var = var;
+static Node new_var_node(Obj *var, Token tk) {
+    NodePool *p = nodes;
+    if (p->num_vars == p->vars_cap) {
+        p->vars_cap *= 2;
+        p->vars = grow(p->vars, p->num_vars, p->vars_cap, sizeof(*p->vars));
+    }
+
+    p->vars[p->num_vars] = var;
+    Node node = new_node(ND_VAR, tk);
+    p->a[node] = p->num_vars++;
+    add_type(node);
     return node;
 }
 
 static Obj *new_var(char *name, Type *ty) {
-    Obj *var = calloc(1, sizeof(Obj));
+    Obj *var = arena_new(Obj);
     var->name = name;
     var->ty = ty;
     return var;
@@ -69,6 +200,7 @@ static Obj *new_lvar(char *name, Type *ty) {
     var->is_local = true;
     var->next = locals;
     locals = var;
+    push_scope(var);
     return var;
 }
 
@@ -76,166 +208,188 @@ static Obj *new_gvar(char *name, Type *ty) {
     Obj *var = new_var(name, ty);
     var->next = globals;
     globals = var;
+    push_scope(var);
     return var;
 }
 
 static char *new_unique_name(void) {
-    static int cnt = 0;
-    return format(".L..%d", cnt++);
+    return format(".L..%d", num_unique_names++);
 }
 
+// Anonymous globals cannot be referred to by name, so they are not
+// added to any scope.
 static Obj *new_anon_gvar(Type *ty) {
-    return new_gvar(new_unique_name(), ty);
+    Obj *var = new_var(new_unique_name(), ty);
+    var->next = globals;
+    globals = var;
+    return var;
 }
 
 static Obj *new_string_literal(char *p, Type *ty) {
     Obj *var = new_anon_gvar(ty);
     var->init_data = p;
+    var->is_literal = true;
     return var;
 }
 
-static Node *new_add(Node *lhs, Node *rhs, Token *tk) {
-    add_type(lhs);
-    add_type(rhs);
-
+static Node new_add(Node lhs, Node rhs, Token tk) {
     // num + num
-    if (is_integer(lhs->ty) && is_integer(rhs->ty)) {
+    if (is_integer(node_ty(lhs)) && is_integer(node_ty(rhs))) {
         return new_binary(ND_ADD, lhs, rhs, tk);
     }
 
     // num + ptr
-    if (lhs->ty->base != NULL && is_integer(rhs->ty)) {
-        rhs = new_binary(ND_MUL, rhs, new_num(lhs->ty->base->size, tk), tk);
+    if (node_ty(lhs)->base != NULL && is_integer(node_ty(rhs))) {
+        rhs = new_binary(ND_MUL, rhs, new_num(node_ty(lhs)->base->size, tk), tk);
         return new_binary(ND_ADD, lhs, rhs, tk);
     }
 
     // ptr + num
-    if (is_integer(lhs->ty) && rhs->ty->base != NULL) {
-        lhs = new_binary(ND_MUL, lhs, new_num(rhs->ty->base->size, tk), tk);
+    if (is_integer(node_ty(lhs)) && node_ty(rhs)->base != NULL) {
+        lhs = new_binary(ND_MUL, lhs, new_num(node_ty(rhs)->base->size, tk), tk);
         return new_binary(ND_ADD, rhs, lhs, tk);
     }
 
     error_tk(tk, "Invalid operands");
 }
 
-static Node *new_sub(Node *lhs, Node *rhs, Token *tk) {
-    add_type(lhs);
-    add_type(rhs);
-
+static Node new_sub(Node lhs, Node rhs, Token tk) {
     // num - num
-    if (is_integer(lhs->ty) && is_integer(rhs->ty)) {
+    if (is_integer(node_ty(lhs)) && is_integer(node_ty(rhs))) {
         return new_binary(ND_SUB, lhs, rhs, tk);
     }
 
     // ptr - num
-    if (lhs->ty->base != NULL && is_integer(rhs->ty)) {
-        rhs = new_binary(ND_MUL, rhs, new_num(lhs->ty->base->size, tk), tk);
+    if (node_ty(lhs)->base != NULL && is_integer(node_ty(rhs))) {
+        rhs = new_binary(ND_MUL, rhs, new_num(node_ty(lhs)->base->size, tk), tk);
         return new_binary(ND_SUB, lhs, rhs, tk);
     }
 
     // ptr - ptr
-    if (lhs->ty->base != NULL && rhs->ty->base != NULL) {
-        Node *node = new_binary(ND_SUB, lhs, rhs, tk);
-        node->ty = ty_int;
-        return new_binary(ND_DIV, node, new_num(lhs->ty->base->size, tk), tk);
+    if (node_ty(lhs)->base != NULL && node_ty(rhs)->base != NULL) {
+        Node node = new_binary(ND_SUB, lhs, rhs, tk);
+        nodes->ty[node] = ty_int;
+        return new_binary(ND_DIV, node, new_num(node_ty(lhs)->base->size, tk), tk);
     }
 
     error_tk(tk, "Invalid operands");
 }
 
-static Node *stmt(Token **rest, Token *tk);
-static Node *compound_stmt(Token **rest, Token *tk);
-static Node *expr_stmt(Token **rest, Token *tk);
-static Node *expr(Token **rest, Token *tk);
-static Node *assign(Token **rest, Token *tk);
-static Node *equality(Token **rest, Token *tk);
-static Node *relational(Token **rest, Token *tk);
-static Node *add(Token **rest, Token *tk);
-static Node *mul(Token **rest, Token *tk);
-static Node *unary(Token **rest, Token *tk);
-static Node *postfix(Token **rest, Token *tk);
-static Node *primary(Token **rest, Token *tk);
-
-static Type *type_suffix(Token **rest, Token *tk, Type *ty);
-
-static char *get_ident(Token *tk) {
-    if (tk->kind != TK_IDENT) {
+static Node stmt(Token *rest, Token tk);
+static Node compound_stmt(Token *rest, Token tk);
+static Node expr_stmt(Token *rest, Token tk);
+static Node expr(Token *rest, Token tk);
+static Node assign(Token *rest, Token tk);
+static Node equality(Token *rest, Token tk);
+static Node relational(Token *rest, Token tk);
+static Node add(Token *rest, Token tk);
+static Node mul(Token *rest, Token tk);
+static Node unary(Token *rest, Token tk);
+static Node postfix(Token *rest, Token tk);
+static Node primary(Token *rest, Token tk);
+
+// A parsed declarator. Types are shared, so the declared name is kept
+// apart from the type.
+typedef struct {
+    Type *ty;
+    Token name;
+
+    // Parameter names if ty is a function type
+    Token *params;
+} Decl;
+
+static Type *type_suffix(Token *rest, Token tk, Type *ty, Token **params);
+
+static char *get_ident(Token tk) {
+    if (tk_kind(tk) != TK_IDENT) {
         error_tk(tk, "Expected an identifier");
     }
 
-    return strndup(tk->loc, tk->len);
+    return tk_name(tk);
 }
 
-static int get_number(Token *tk) {
-    if (tk->kind != TK_NUM) {
+static int get_number(Token tk) {
+    if (tk_kind(tk) != TK_NUM) {
         error_tk(tk, "Expected a number");
     }
 
-    return tk->val;
+    return tk_val(tk);
 }
 
 // declspec = "char" | "int"
-static Type *declspec(Token **rest, Token *tk) {
-    if (equal(tk, "char")) {
-        *rest = skip(tk, "char");
+static Type *declspec(Token *rest, Token tk) {
+    if (is_keyword(tk, KW_CHAR)) {
+        *rest = tk + 1;
         return ty_char;
     }
 
-    *rest = skip(tk, "int");
+    if (!is_keyword(tk, KW_INT)) {
+        error_tk(tk, "Expected a type name");
+    }
+
+    *rest = tk + 1;
     return ty_int;
 }
 
 // declarator = "*"* ident type-suffix?
-static Type *declarator(Token **rest, Token *tk, Type *ty) {
-    while (consume(&tk, tk, "*")) {
+static Decl declarator(Token *rest, Token tk, Type *ty) {
+    while (consume(&tk, tk, PU_STAR)) {
         ty = pointer_to(ty);
     }
 
-    if (tk->kind != TK_IDENT) {
+    if (tk_kind(tk) != TK_IDENT) {
         error_tk(tk, "Expected a variable name");
     }
 
-    ty = type_suffix(rest, tk->next, ty);
-    ty->name = tk;
-    return ty;
+    Decl decl = {0};
+    decl.name = tk;
+    decl.ty = type_suffix(rest, tk + 1, ty, &decl.params);
+    return decl;
 }
 
 // func-params = (param ("," param)*)? ")"
 // param       = declspec declarator
-static Type *func_params(Token **rest, Token *tk, Type *ty) {
-    Type head = {0};
-    Type *cur = &head;
-
-    while (!equal(tk, ")")) {
-        if (cur != &head) {
-            tk = skip(tk, ",");
+static Type *func_params(Token *rest, Token tk, Type *ty, Token **params) {
+    int n = 0;
+    int cap = 8;
+    Type **types = arena_alloc(sizeof(*types) * cap);
+    Token *names = arena_alloc(sizeof(*names) * cap);
+
+    while (!is_punct(tk, PU_RPAREN)) {
+        if (n > 0) {
+            tk = skip(tk, PU_COMMA);
         }
 
         Type *basety = declspec(&tk, tk);
-        Type *ty = declarator(&tk, tk, basety);
+        Decl decl = declarator(&tk, tk, basety);
 
-        cur->next = copy_type(ty);
-        cur = cur->next;
+        if (n == cap) {
+            cap *= 2;
+            types = grow(types, n, cap, sizeof(*types));
+            names = grow(names, n, cap, sizeof(*names));
+        }
+        types[n] = decl.ty;
+        names[n] = decl.name;
+        n += 1;
     }
 
-    ty = func_type(ty);
-    ty->params = head.next;
-    *rest = tk->next;
-    return ty;
+    *params = names;
+    *rest = tk + 1;
+    return func_type(ty, types, n);
 }
 
 // type-suffix = "(" func-params
 //             | "[" num "]" type-suffix
 //             | _
-static Type *type_suffix(Token **rest, Token *tk, Type *ty) {
-    if (equal(tk, "(")) {
-        return func_params(rest, tk->next, ty);
+static Type *type_suffix(Token *rest, Token tk, Type *ty, Token **params) {
+    if (is_punct(tk, PU_LPAREN)) {
+        return func_params(rest, tk + 1, ty, params);
     }
 
-    if (equal(tk, "[")) {
-        int len = get_number(tk->next);
-        tk = skip(tk->next->next, "]");
-        ty = type_suffix(rest, tk, ty);
+    if (is_punct(tk, PU_LBRACKET)) {
+        int len = get_number(tk + 1);
+        tk = skip(tk + 2, PU_RBRACKET);
+        ty = type_suffix(rest, tk, ty, params);
         return array_of(ty, len);
     }
 
@@ -244,40 +398,38 @@ static Type *type_suffix(Token **rest, Token *tk, Type *ty) {
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
-static Node *declaration(Token **rest, Token *tk) {
+static Node declaration(Token *rest, Token tk) {
     Type *basety = declspec(&tk, tk);
 
-    Node head = {0};
-    Node *cur = &head;
+    int base = scratch_len;
     int i = 0;
 
-    while (!equal(tk, ";")) {
+    while (!is_punct(tk, PU_SEMICOLON)) {
         if (i++ > 0) {
-            tk = skip(tk, ",");
+            tk = skip(tk, PU_COMMA);
         }
 
-        Type *ty = declarator(&tk, tk, basety);
-        Obj *var = new_lvar(get_ident(ty->name), ty);
+        Decl decl = declarator(&tk, tk, basety);
+        Obj *var = new_lvar(get_ident(decl.name), decl.ty);
 
-        if (!equal(tk, "=")) {
+        if (!is_punct(tk, PU_ASSIGN)) {
             continue;
         }
 
-        Node *lhs = new_var_node(var, tk);
-        Node *rhs = expr(&tk, tk->next);
-        Node *node = new_binary(ND_ASSIGN, lhs, rhs, tk);
-        cur->next = new_unary(ND_EXPR_STMT, node, tk);
-        cur = cur->next;
+        Node lhs = new_var_node(var, tk);
+        Node rhs = expr(&tk, tk + 1);
+        Node node = new_binary(ND_ASSIGN, lhs, rhs, tk);
+        list_push(new_unary(ND_EXPR_STMT, node, tk));
     }
 
-    Node *node = new_node(ND_BLOCK, tk);
-    node->body = head.next;
-    *rest = skip(tk, ";");
+    Node node = new_node(ND_BLOCK, tk);
+    nodes->a[node] = list_end(base);
+    *rest = skip(tk, PU_SEMICOLON);
     return node;
 }
 
-static bool is_typename(Token *tk) {
-    return equal(tk, "int") || equal(tk, "char");
+static bool is_typename(Token tk) {
+    return is_keyword(tk, KW_INT) || is_keyword(tk, KW_CHAR);
 }
 
 // stmt = "return" expr ";"
@@ -286,109 +438,193 @@ static bool is_typename(Token *tk) {
 //      | "while" "(" expr ")" stmt
 //      | "{" compound-stmt
 //      | expr-stmt
-static Node *stmt(Token **rest, Token *tk) {
-    if (equal(tk, "return")) {
-        Node *node = new_node(ND_RETURN, tk);
-        node->lhs = expr(&tk, tk->next);
-        *rest = skip(tk, ";");
+static Node stmt(Token *rest, Token tk) {
+    if (is_keyword(tk, KW_RETURN)) {
+        // expr() may grow the pool, so it must be called before
+        // nodes->a is loaded
+        Node node = new_node(ND_RETURN, tk);
+        Node lhs = expr(&tk, tk + 1);
+        nodes->a[node] = lhs;
+        *rest = skip(tk, PU_SEMICOLON);
         return node;
     }
 
-    if (equal(tk, "if")) {
-        Node *node = new_node(ND_IF, tk);
-        tk = skip(tk->next, "(");
-        node->cond = expr(&tk, tk);
-        tk = skip(tk, ")");
-        node->then = stmt(&tk, tk);
-        if (equal(tk, "else")) {
-            node->els = stmt(&tk, tk->next);
+    if (is_keyword(tk, KW_IF)) {
+        Node node = new_node(ND_IF, tk);
+        tk = skip(tk + 1, PU_LPAREN);
+        Node cond = expr(&tk, tk);
+        tk = skip(tk, PU_RPAREN);
+        Node then = stmt(&tk, tk);
+        Node els = 0;
+        if (is_keyword(tk, KW_ELSE)) {
+            els = stmt(&tk, tk + 1);
         }
+        nodes->a[node] = add_extra(cond);
+        add_extra(then);
+        add_extra(els);
         *rest = tk;
         return node;
     }
 
-    if (equal(tk, "for")) {
-        Node *node = new_node(ND_FOR, tk);
-        tk = skip(tk->next, "(");
-        node->init = expr_stmt(&tk, tk);
-        if (!equal(tk, ";")) {
-            node->cond = expr(&tk, tk);
+    if (is_keyword(tk, KW_FOR)) {
+        Node node = new_node(ND_FOR, tk);
+        tk = skip(tk + 1, PU_LPAREN);
+        Node init = expr_stmt(&tk, tk);
+        Node cond = 0;
+        if (!is_punct(tk, PU_SEMICOLON)) {
+            cond = expr(&tk, tk);
         }
-        tk = skip(tk, ";");
-        if (!equal(tk, ")")) {
-            node->inc = expr(&tk, tk);
+        tk = skip(tk, PU_SEMICOLON);
+        Node inc = 0;
+        if (!is_punct(tk, PU_RPAREN)) {
+            inc = expr(&tk, tk);
         }
-        tk = skip(tk, ")");
-        node->then = stmt(&tk, tk);
+        tk = skip(tk, PU_RPAREN);
+        Node then = stmt(&tk, tk);
+        nodes->a[node] = add_extra(cond);
+        add_extra(then);
+        add_extra(init);
+        add_extra(inc);
         *rest = tk;
         return node;
     }
 
-    if (equal(tk, "while")) {
-        Node *node = new_node(ND_FOR, tk);
-        tk = skip(tk->next, "(");
-        node->cond = expr(&tk, tk);
-        tk = skip(tk, ")");
-        node->then = stmt(&tk, tk);
+    if (is_keyword(tk, KW_WHILE)) {
+        Node node = new_node(ND_FOR, tk);
+        tk = skip(tk + 1, PU_LPAREN);
+        Node cond = expr(&tk, tk);
+        tk = skip(tk, PU_RPAREN);
+        Node then = stmt(&tk, tk);
+        nodes->a[node] = add_extra(cond);
+        add_extra(then);
+        add_extra(0);
+        add_extra(0);
         *rest = tk;
         return node;
     }
 
-    if (equal(tk, "{")) {
-        return compound_stmt(rest, tk->next);
+    if (is_punct(tk, PU_LBRACE)) {
+        return compound_stmt(rest, tk + 1);
     }
 
     return expr_stmt(rest, tk);
 }
 
-// compound-stmt = (declaration | stmt)* "}"
-static Node *compound_stmt(Token **rest, Token *tk) {
-    Node head = {0};
-    Node *cur = &head;
+// Skips the rest of a statement or top-level declaration that starts at
+// tk after an error at err: up to and including the first ";" at brace
+// depth 0 after err, or the "}" closing a block the statement opened. A
+// "}" that closes an enclosing block is not consumed.
+static Token skip_erroneous(Token tk, Token err) {
+    int depth = 0;
+    bool seen = err < 0;
+
+    for (; tk_kind(tk) != TK_EOF; tk = tk + 1) {
+        seen = seen || tk == err;
+
+        if (is_punct(tk, PU_LBRACE)) {
+            depth += 1;
+        } else if (is_punct(tk, PU_RBRACE)) {
+            if (depth == 0) {
+                return tk;
+            }
+            depth -= 1;
+            if (depth == 0 && seen && !is_keyword(tk + 1, KW_ELSE)) {
+                return tk + 1;
+            }
+        } else if (is_punct(tk, PU_SEMICOLON) && depth == 0 && seen) {
+            return tk + 1;
+        }
+    }
+
+    return tk;
+}
+
+// block-item = declaration | stmt
+//
+// If errors are not fatal, an error inside the item skips to its end and
+// the item is dropped (0 is returned).
+static Node block_item(Token *rest, Token tk) {
+    jmp_buf env;
+    jmp_buf *prev = error_recovery;
+    Scope *sc = scope;
+    int base = scratch_len;
+
+    if (max_errors != 1) {
+        if (setjmp(env) != 0) {
+            error_recovery = prev;
+            scope = sc;
+            scratch_len = base;
+            *rest = skip_erroneous(tk, error_token);
+            return 0;
+        }
+        error_recovery = &env;
+    }
+
+    Node node;
+    if (is_typename(tk)) {
+        node = declaration(rest, tk);
+    } else {
+        node = stmt(rest, tk);
+    }
+
+    error_recovery = prev;
+    return node;
+}
+
+// compound-stmt = block-item* "}"
+static Node compound_stmt(Token *rest, Token tk) {
+    int base = scratch_len;
 
-    while (!equal(tk, "}")) {
-        Node *node;
-        if (is_typename(tk)) {
-            node = declaration(&tk, tk);
-        } else {
-            node = stmt(&tk, tk);
+    enter_scope();
+
+    while (!is_punct(tk, PU_RBRACE)) {
+        if (tk_kind(tk) == TK_EOF) {
+            // Report a missing "}" once, not once for every open block.
+            if (error_token != tk) {
+                error_tk(tk, "Expected '}'");
+            }
+            break;
         }
 
-        cur->next = node;
-        cur = cur->next;
-        add_type(cur);
+        Node node = block_item(&tk, tk);
+        if (node != 0) {
+            list_push(node);
+        }
     }
 
-    Node *node = new_node(ND_BLOCK, tk);
-    node->body = head.next;
-    *rest = tk->next;
+    leave_scope();
+
+    Node node = new_node(ND_BLOCK, tk);
+    nodes->a[node] = list_end(base);
+    *rest = tk_kind(tk) == TK_EOF ? tk : tk + 1;
     return node;
 }
 
 // expr-stmt = expr? ";"
-static Node *expr_stmt(Token **rest, Token *tk) {
-    if (equal(tk, ";")) {
-        *rest = tk->next;
+static Node expr_stmt(Token *rest, Token tk) {
+    if (is_punct(tk, PU_SEMICOLON)) {
+        *rest = tk + 1;
         return new_node(ND_BLOCK, tk);
     }
 
-    Node *node = new_node(ND_EXPR_STMT, tk);
-    node->lhs = expr(&tk, tk);
-    *rest = skip(tk, ";");
+    Node node = new_node(ND_EXPR_STMT, tk);
+    Node lhs = expr(&tk, tk);
+    nodes->a[node] = lhs;
+    *rest = skip(tk, PU_SEMICOLON);
     return node;
 }
 
 // expr = assign
-static Node *expr(Token **rest, Token *tk) {
+static Node expr(Token *rest, Token tk) {
     return assign(rest, tk);
 }
 
 // assign = equality ("=" assign)?
-static Node *assign(Token **rest, Token *tk) {
-    Node *lhs = equality(&tk, tk);
+static Node assign(Token *rest, Token tk) {
+    Node lhs = equality(&tk, tk);
 
-    if (equal(tk, "=")) {
-        Node *rhs = assign(&tk, tk->next);
+    if (is_punct(tk, PU_ASSIGN)) {
+        Node rhs = assign(&tk, tk + 1);
         lhs = new_binary(ND_ASSIGN, lhs, rhs, tk);
     }
 
@@ -397,20 +633,20 @@ static Node *assign(Token **rest, Token *tk) {
 }
 
 // equality = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tk) {
-    Node *lhs = relational(&tk, tk);
+static Node equality(Token *rest, Token tk) {
+    Node lhs = relational(&tk, tk);
 
     while (true) {
-        Token *start = tk;
+        Token start = tk;
 
-        if (equal(tk, "==")) {
-            Node *rhs = relational(&tk, tk->next);
+        if (is_punct(tk, PU_EQ)) {
+            Node rhs = relational(&tk, tk + 1);
             lhs = new_binary(ND_EQ, lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, "!=")) {
-            Node *rhs = relational(&tk, tk->next);
+        if (is_punct(tk, PU_NE)) {
+            Node rhs = relational(&tk, tk + 1);
             lhs = new_binary(ND_NE, lhs, rhs, start);
             continue;
         }
@@ -421,32 +657,32 @@ static Node *equality(Token **rest, Token *tk) {
 }
 
 // relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(Token **rest, Token *tk) {
-    Node *lhs = add(&tk, tk);
+static Node relational(Token *rest, Token tk) {
+    Node lhs = add(&tk, tk);
 
     while (true) {
-        Token *start = tk;
+        Token start = tk;
 
-        if (equal(tk, "<")) {
-            Node *rhs = add(&tk, tk->next);
+        if (is_punct(tk, PU_LT)) {
+            Node rhs = add(&tk, tk + 1);
             lhs = new_binary(ND_LT, lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, "<=")) {
-            Node *rhs = add(&tk, tk->next);
+        if (is_punct(tk, PU_LE)) {
+            Node rhs = add(&tk, tk + 1);
             lhs = new_binary(ND_LE, lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, ">")) {
-            Node *rhs = add(&tk, tk->next);
+        if (is_punct(tk, PU_GT)) {
+            Node rhs = add(&tk, tk + 1);
             lhs = new_binary(ND_GT, lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, ">=")) {
-            Node *rhs = add(&tk, tk->next);
+        if (is_punct(tk, PU_GE)) {
+            Node rhs = add(&tk, tk + 1);
             lhs = new_binary(ND_GE, lhs, rhs, start);
             continue;
         }
@@ -457,20 +693,20 @@ static Node *relational(Token **rest, Token *tk) {
 }
 
 // add = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tk) {
-    Node *lhs = mul(&tk, tk);
+static Node add(Token *rest, Token tk) {
+    Node lhs = mul(&tk, tk);
 
     while (true) {
-        Token *start = tk;
+        Token start = tk;
 
-        if (equal(tk, "+")) {
-            Node *rhs = mul(&tk, tk->next);
+        if (is_punct(tk, PU_PLUS)) {
+            Node rhs = mul(&tk, tk + 1);
             lhs = new_add(lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, "-")) {
-            Node *rhs = mul(&tk, tk->next);
+        if (is_punct(tk, PU_MINUS)) {
+            Node rhs = mul(&tk, tk + 1);
             lhs = new_sub(lhs, rhs, start);
             continue;
         }
@@ -481,20 +717,20 @@ static Node *add(Token **rest, Token *tk) {
 }
 
 // mul = unary ("*" unary | "/" unary)*
-static Node *mul(Token **rest, Token *tk) {
-    Node *lhs = unary(&tk, tk);
+static Node mul(Token *rest, Token tk) {
+    Node lhs = unary(&tk, tk);
 
     while (true) {
-        Token *start = tk;
+        Token start = tk;
 
-        if (equal(tk, "*")) {
-            Node *rhs = unary(&tk, tk->next);
+        if (is_punct(tk, PU_STAR)) {
+            Node rhs = unary(&tk, tk + 1);
             lhs = new_binary(ND_MUL, lhs, rhs, start);
             continue;
         }
 
-        if (equal(tk, "/")) {
-            Node *rhs = unary(&tk, tk->next);
+        if (is_punct(tk, PU_SLASH)) {
+            Node rhs = unary(&tk, tk + 1);
             lhs = new_binary(ND_DIV, lhs, rhs, start);
             continue;
         }
@@ -506,23 +742,23 @@ static Node *mul(Token **rest, Token *tk) {
 
 // unary = ("+" | "-" | "*" | "&") unary
 //       | postfix
-static Node *unary(Token **rest, Token *tk) {
-    if (equal(tk, "+")) {
-        return unary(rest, tk->next);
+static Node unary(Token *rest, Token tk) {
+    if (is_punct(tk, PU_PLUS)) {
+        return unary(rest, tk + 1);
     }
 
-    if (equal(tk, "-")) {
-        Node *node = unary(rest, tk->next);
+    if (is_punct(tk, PU_MINUS)) {
+        Node node = unary(rest, tk + 1);
         return new_unary(ND_NEG, node, tk);
     }
 
-    if (equal(tk, "*")) {
-        Node *node = unary(rest, tk->next);
+    if (is_punct(tk, PU_STAR)) {
+        Node node = unary(rest, tk + 1);
         return new_unary(ND_DEREF, node, tk);
     }
 
-    if (equal(tk, "&")) {
-        Node *node = unary(rest, tk->next);
+    if (is_punct(tk, PU_AMP)) {
+        Node node = unary(rest, tk + 1);
         return new_unary(ND_ADDR, node, tk);
     }
 
@@ -530,13 +766,13 @@ static Node *unary(Token **rest, Token *tk) {
 }
 
 // postfix = primary ("[" expr "]")*
-static Node *postfix(Token **rest, Token *tk) {
-    Node *node = primary(&tk, tk);
+static Node postfix(Token *rest, Token tk) {
+    Node node = primary(&tk, tk);
 
-    while (equal(tk, "[")) {
-        Token *start = tk;
-        Node *idx = expr(&tk, tk->next);
-        tk = skip(tk, "]");
+    while (is_punct(tk, PU_LBRACKET)) {
+        Token start = tk;
+        Node idx = expr(&tk, tk + 1);
+        tk = skip(tk, PU_RBRACKET);
         node = new_add(node, idx, start);
         node = new_unary(ND_DEREF, node, start);
     }
@@ -546,27 +782,29 @@ static Node *postfix(Token **rest, Token *tk) {
 }
 
 // funccall = ident "(" ")"
-static Node *funccall(Token **rest, Token *tk) {
-    Token *start = tk;
-    tk = tk->next->next;
+static Node funccall(Token *rest, Token tk) {
+    Token start = tk;
+    tk = tk + 2;
 
-    Node head = {0};
-    Node *cur = &head;
+    int base = scratch_len;
 
-    while (!equal(tk, ")")) {
-        if (cur != &head) {
-            tk = skip(tk, ",");
+    while (!is_punct(tk, PU_RPAREN)) {
+        if (scratch_len != base) {
+            tk = skip(tk, PU_COMMA);
         }
 
-        cur->next = assign(&tk, tk);
-        cur = cur->next;
+        list_push(assign(&tk, tk));
     }
 
-    *rest = skip(tk, ")");
+    if (scratch_len - base > MAX_ARGS) {
+        error_tk(start, "Too many arguments");
+    }
+
+    *rest = skip(tk, PU_RPAREN);
 
-    Node *node = new_node(ND_FUNC_CALL, start);
-    node->funcname = strndup(start->loc, start->len);
-    node->args = head.next;
+    Node node = new_node(ND_FUNC_CALL, start);
+    nodes->a[node] = list_end(base);
+    add_type(node);
     return node;
 }
 
@@ -576,28 +814,30 @@ static Node *funccall(Token **rest, Token *tk) {
 //         | funccall
 //         | ident
 //         | num
-static Node *primary(Token **rest, Token *tk) {
-    if (equal(tk, "(") && equal(tk->next, "{")) {
-        Node *node = new_node(ND_STMT_EXPR, tk);
-        node->body = compound_stmt(&tk, tk->next->next)->body;
-        *rest = skip(tk, ")");
+static Node primary(Token *rest, Token tk) {
+    if (is_punct(tk, PU_LPAREN) && is_punct(tk + 1, PU_LBRACE)) {
+        Token start = tk;
+        Node node = compound_stmt(&tk, tk + 2);
+        nodes->kind[node] = ND_STMT_EXPR;
+        nodes->tk[node] = start;
+        add_type(node);
+        *rest = skip(tk, PU_RPAREN);
         return node;
     }
 
-    if (equal(tk, "(")) {
-        Node *node = expr(&tk, tk->next);
-        *rest = skip(tk, ")");
+    if (is_punct(tk, PU_LPAREN)) {
+        Node node = expr(&tk, tk + 1);
+        *rest = skip(tk, PU_RPAREN);
         return node;
     }
 
-    if (equal(tk, "sizeof")) {
-        Node *node = unary(rest, tk->next);
-        add_type(node);
-        return new_num(node->ty->size, tk);
+    if (is_keyword(tk, KW_SIZEOF)) {
+        Node node = unary(rest, tk + 1);
+        return new_num(node_ty(node)->size, tk);
     }
 
-    if (tk->kind == TK_IDENT) {
-        if (equal(tk->next, "(")) {
+    if (tk_kind(tk) == TK_IDENT) {
+        if (is_punct(tk + 1, PU_LPAREN)) {
             return funccall(rest, tk);
         }
 
@@ -605,89 +845,128 @@ static Node *primary(Token **rest, Token *tk) {
         if (var == NULL) {
             error_tk(tk, "Undefined variable");
         }
-        *rest = tk->next;
+        *rest = tk + 1;
         return new_var_node(var, tk);
     }
 
-    if (tk->kind == TK_STR) {
-        Obj *var = new_string_literal(tk->str, tk->ty);
-        *rest = tk->next;
+    if (tk_kind(tk) == TK_STR) {
+        Obj *var = new_string_literal(tk_str(tk)->str, tk_str(tk)->ty);
+        *rest = tk + 1;
         return new_var_node(var, tk);
     }
 
-    if (tk->kind == TK_NUM) {
-        Node *node = new_num(tk->val, tk);
-        *rest = tk->next;
+    if (tk_kind(tk) == TK_NUM) {
+        Node node = new_num(tk_val(tk), tk);
+        *rest = tk + 1;
         return node;
     }
 
     error_tk(tk, "Expected a number");
 }
 
-static void create_param_lvars(Type *params) {
-    if (params == NULL) {
-        return;
+// Creates the parameters last to first, so that the first one ends up at
+// the head of locals.
+static void create_param_lvars(Decl *decl) {
+    for (int i = decl->ty->num_params - 1; i >= 0; --i) {
+        new_lvar(get_ident(decl->params[i]), decl->ty->params[i]);
     }
 
-    create_param_lvars(params->next);
-    new_lvar(get_ident(params->name), params);
     return;
 }
 
 // function = declspec declarator "{" compound-stmt
-static Token *function(Token *tk, Type *basety) {
-    Type *ty = declarator(&tk, tk, basety);
+static Token function(Token tk, Type *basety) {
+    Token begin = tk;
+    Decl decl = declarator(&tk, tk, basety);
+    if (decl.ty->num_params > MAX_ARGS) {
+        error_tk(decl.name, "Too many parameters");
+    }
 
-    Obj *fn = new_gvar(get_ident(ty->name), ty);
+    Obj *fn = new_gvar(get_ident(decl.name), decl.ty);
     fn->is_function = true;
+    fn->begin = begin;
 
     locals = NULL;
-    create_param_lvars(ty->params);
+    enter_scope();
+    create_param_lvars(&decl);
     fn->params = locals;
 
-    tk = skip(tk, "{");
+    tk = skip(tk, PU_LBRACE);
     fn->body = compound_stmt(&tk, tk);
     fn->locals = locals;
+    fn->end = tk;
+    leave_scope();
     return tk;
 }
 
-static Token *global_variable(Token *tk, Type *basety) {
+static Token global_variable(Token tk, Type *basety) {
     bool first = true;
 
-    while (!consume(&tk, tk, ";")) {
+    while (!consume(&tk, tk, PU_SEMICOLON)) {
         if (!first) {
-            tk = skip(tk, ",");
+            tk = skip(tk, PU_COMMA);
         }
 
-        Type *ty = declarator(&tk, tk, basety);
-        new_gvar(get_ident(ty->name), ty);
+        Decl decl = declarator(&tk, tk, basety);
+        new_gvar(get_ident(decl.name), decl.ty);
         first = false;
     }
 
     return tk;
 }
 
-static bool is_function(Token *tk) {
-    if (equal(tk, ";")) {
+static bool is_function(Token tk, Type *basety) {
+    if (is_punct(tk, PU_SEMICOLON)) {
         return false;
     }
 
-    Type dummy = {0};
-    Type *ty = declarator(&tk, tk, &dummy);
-    return ty->kind == TY_FUNC;
+    Decl decl = declarator(&tk, tk, basety);
+    return decl.ty->kind == TY_FUNC;
 }
 
-// parse = (function | global-variable)*
-Obj *parse(Token *tk) {
-    globals = NULL;
-    while (tk->kind != TK_EOF) {
-        Type *basety = declspec(&tk, tk);
+// external-decl = declspec (function | global-variable)
+//
+// If errors are not fatal, an error skips to the end of the declaration.
+static Token external_decl(Token start) {
+    jmp_buf env;
+    jmp_buf *prev = error_recovery;
+    Scope *sc = scope;
+    int base = scratch_len;
 
-        if (is_function(tk)) {
-            tk = function(tk, basety);
-        } else {
-            tk = global_variable(tk, basety);
+    if (max_errors != 1) {
+        if (setjmp(env) != 0) {
+            error_recovery = prev;
+            scope = sc;
+            scratch_len = base;
+            Token next = skip_erroneous(start, error_token);
+            return next != start ? next : start + 1;
         }
+        error_recovery = &env;
+    }
+
+    Token tk = start;
+    Type *basety = declspec(&tk, tk);
+
+    if (is_function(tk, basety)) {
+        tk = function(tk, basety);
+    } else {
+        tk = global_variable(tk, basety);
+    }
+
+    error_recovery = prev;
+    return tk;
+}
+
+// parse = external-decl*
+Obj *parse(Token tk) {
+    globals = NULL;
+    scope = NULL;
+    num_unique_names = 0;
+    new_pool(tokens->len + 16);
+    enter_scope();
+
+    while (tk_kind(tk) != TK_EOF) {
+        tk = external_decl(tk);
     }
 
     return globals;
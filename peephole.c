@@ -0,0 +1,400 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"
+
+// The peephole optimizer rewrites the instructions of a function after
+// they are generated and before they are printed or encoded. Instructions
+// are moved one at a time to the end of an output list, which is rewritten
+// in place, and the rules in the table below are tried on the end of the
+// list. A rule that fires can expose a match for another, so the rules are
+// tried again until none does.
+//
+// Rules that remove or retarget the write to a register need to know that
+// its value is not used later. Which registers are live after each
+// instruction is found before the pass. A rule only asks about the
+// registers live after the last instruction it matches, and an instruction
+// that takes the place of the ones matched takes over the liveness of the
+// last one. The condition flags are set right before they are used, so
+// they are never live across a branch or label.
+
+typedef struct {
+    Inst *insts;
+    int len;
+
+    // Index in the code before the pass of each output instruction
+    int *orig;
+
+    // Registers live after each instruction of the code before the pass
+    uint32_t *live;
+
+    // Number of times each rule fired
+    long *fired;
+} Peephole;
+
+#define ALL_REGS 0xffffffffu
+
+// Values are kept in x0-x17; the registers above are never retargeted
+#define MAX_VALUE_REG 17
+
+// Registers a call may read: the argument registers
+#define CALL_USES 0xffu
+
+// Registers a call may change: the caller-saved ones and the link register
+#define CALL_DEFS (0x7ffffu | 1u << REG_LR)
+
+// Registers live at a return: the result, the callee-saved ones, the frame
+// pointer, the link register and sp
+#define RET_USES (1u | ~0x7ffffu)
+
+static uint32_t bit(int reg) {
+    return 1u << reg;
+}
+
+static uint32_t uses(Inst *inst) {
+    switch (inst->kind) {
+    case I_ADD:
+    case I_SUB:
+    case I_ADD_LSR:
+    case I_MUL:
+    case I_SMULH:
+    case I_SDIV:
+    case I_CMP:
+        return bit(inst->rn) | bit(inst->rm);
+    case I_NEG:
+        return bit(inst->rm);
+    case I_ADD_IMM:
+    case I_SUB_IMM:
+    case I_LSL:
+    case I_LSR:
+    case I_ASR:
+    case I_MOV:
+    case I_CMP_IMM:
+    case I_LDR:
+    case I_LDRB:
+    case I_LDP_POST:
+        return bit(inst->rn);
+    case I_STR:
+    case I_STRB:
+        return bit(inst->rd) | bit(inst->rn);
+    case I_STP_PRE:
+        return bit(inst->rd) | bit(inst->rm) | bit(inst->rn);
+    case I_BL:
+        return CALL_USES;
+    case I_RET:
+        return RET_USES;
+    default:
+        return 0;
+    }
+}
+
+static uint32_t defs(Inst *inst) {
+    switch (inst->kind) {
+    case I_STR:
+    case I_STRB:
+    case I_CMP:
+    case I_CMP_IMM:
+    case I_B:
+    case I_BCOND:
+    case I_RET:
+    case I_LABEL:
+        return 0;
+    case I_STP_PRE:
+        return bit(inst->rn);
+    case I_LDP_POST:
+        return bit(inst->rd) | bit(inst->rm) | bit(inst->rn);
+    case I_BL:
+        return CALL_DEFS;
+    default:
+        return bit(inst->rd);
+    }
+}
+
+// Finds the registers live after each instruction of c by iterating to a
+// fixed point, since branches can go back
+static void find_live(Code *c, uint32_t *live) {
+    int *label_at = malloc(sizeof(int) * (c->num_labels + 1));
+    uint32_t *live_in = malloc(sizeof(uint32_t) * (c->len + 1));
+    if (label_at == NULL || live_in == NULL) {
+        error("Out of memory");
+    }
+
+    for (int i = 0; i < c->num_labels; ++i) {
+        label_at[i] = -1;
+    }
+    for (int i = 0; i < c->len; ++i) {
+        if (c->insts[i].kind == I_LABEL) {
+            label_at[c->insts[i].label] = i;
+        }
+        live[i] = 0;
+        live_in[i] = 0;
+    }
+    live_in[c->len] = 0;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = c->len - 1; i >= 0; --i) {
+            Inst *inst = &c->insts[i];
+            uint32_t out = 0;
+
+            if (inst->kind == I_B || inst->kind == I_BCOND) {
+                int target = label_at[inst->label];
+                out = target < 0 ? ALL_REGS : live_in[target];
+            }
+            if (inst->kind != I_B && inst->kind != I_RET) {
+                out |= live_in[i + 1];
+            }
+
+            uint32_t in = uses(inst) | (out & ~defs(inst));
+            if (out != live[i] || in != live_in[i]) {
+                live[i] = out;
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+
+    free(label_at);
+    free(live_in);
+    return;
+}
+
+// Returns true if reg is not used after the instruction at output index i
+static bool is_dead(Peephole *p, int i, int reg) {
+    return (p->live[p->orig[i]] & bit(reg)) == 0;
+}
+
+// Removes n output instructions starting at w, moving the ones after them
+// down
+static void remove_insts(Peephole *p, Inst *w, int n) {
+    int i = w - p->insts;
+    for (int j = i + n; j < p->len; ++j) {
+        p->insts[j - n] = p->insts[j];
+        p->orig[j - n] = p->orig[j];
+    }
+
+    p->len -= n;
+    return;
+}
+
+// Instructions whose only effect is to write rd, where rd is one of the
+// registers the code generator keeps values in
+static bool is_pure_def(Inst *inst) {
+    switch (inst->kind) {
+    case I_ADD:
+    case I_SUB:
+    case I_ADD_LSR:
+    case I_MUL:
+    case I_SMULH:
+    case I_SDIV:
+    case I_NEG:
+    case I_ADD_IMM:
+    case I_SUB_IMM:
+    case I_LSL:
+    case I_LSR:
+    case I_ASR:
+    case I_MOV:
+    case I_MOV_IMM:
+    case I_CSET:
+    case I_LDR:
+    case I_LDRB:
+    case I_ADR:
+        return inst->rd <= MAX_VALUE_REG;
+    default:
+        return false;
+    }
+}
+
+static CondCode invert(CondCode cond) {
+    return cond ^ 1;
+}
+
+//
+// Rules
+//
+
+// str xA, [xB, #n]; ldr xC, [xB, #n] => str xA, [xB, #n]; mov xC, xA
+static bool store_load(Peephole *p, Inst *w) {
+    if (w[0].kind != I_STR || w[1].kind != I_LDR || w[0].rn != w[1].rn || w[0].imm != w[1].imm) {
+        return false;
+    }
+
+    if (w[1].rd == w[0].rd) {
+        remove_insts(p, &w[1], 1);
+    } else {
+        w[1] = (Inst) { .kind = I_MOV, .rd = w[1].rd, .rn = w[0].rd };
+    }
+    return true;
+}
+
+// sub sp, sp, #n; add sp, sp, #n => nothing, and the other way around
+static bool sp_pair(Peephole *p, Inst *w) {
+    bool sub_add = w[0].kind == I_SUB_IMM && w[1].kind == I_ADD_IMM;
+    bool add_sub = w[0].kind == I_ADD_IMM && w[1].kind == I_SUB_IMM;
+    if (!sub_add && !add_sub) {
+        return false;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (w[i].rd != REG_SP || w[i].rn != REG_SP) {
+            return false;
+        }
+    }
+
+    if (w[0].imm != w[1].imm) {
+        return false;
+    }
+
+    remove_insts(p, w, 2);
+    return true;
+}
+
+// add xA, xA, #0 => nothing, including for sp
+static bool add_zero(Peephole *p, Inst *w) {
+    if ((w[0].kind != I_ADD_IMM && w[0].kind != I_SUB_IMM) || w[0].rd != w[0].rn || w[0].imm != 0) {
+        return false;
+    }
+
+    remove_insts(p, w, 1);
+    return true;
+}
+
+// mov xA, xA => nothing
+static bool self_move(Peephole *p, Inst *w) {
+    if (w[0].kind != I_MOV || w[0].rd != w[0].rn) {
+        return false;
+    }
+
+    remove_insts(p, w, 1);
+    return true;
+}
+
+// op xA, ...; mov xB, xA => op xB, ... if xA is dead. This includes a
+// constant loaded with mov xA, #n and then moved.
+static bool def_move(Peephole *p, Inst *w) {
+    if (!is_pure_def(&w[0]) || w[1].kind != I_MOV || w[1].rn != w[0].rd || w[1].rd > MAX_VALUE_REG) {
+        return false;
+    }
+
+    int i = w - p->insts;
+    if (!is_dead(p, i + 1, w[0].rd)) {
+        return false;
+    }
+
+    w[0].rd = w[1].rd;
+    p->orig[i] = p->orig[i + 1];
+    remove_insts(p, &w[1], 1);
+    return true;
+}
+
+// b L; L: => L:
+static bool branch_next(Peephole *p, Inst *w) {
+    if ((w[0].kind != I_B && w[0].kind != I_BCOND) || w[1].kind != I_LABEL || w[0].label != w[1].label) {
+        return false;
+    }
+
+    remove_insts(p, w, 1);
+    return true;
+}
+
+// cset xA, cc; cmp xA, #0; beq L => b!cc L if xA is dead, and likewise
+// for bne
+static bool cset_branch(Peephole *p, Inst *w) {
+    if (w[0].kind != I_CSET || w[1].kind != I_CMP_IMM || w[2].kind != I_BCOND) {
+        return false;
+    }
+
+    if (w[1].rn != w[0].rd || w[1].imm != 0 || (w[2].imm != COND_EQ && w[2].imm != COND_NE)) {
+        return false;
+    }
+
+    int i = w - p->insts;
+    if (!is_dead(p, i + 2, w[0].rd)) {
+        return false;
+    }
+
+    CondCode cond = w[2].imm == COND_EQ ? invert(w[0].imm) : w[0].imm;
+    w[0] = (Inst) { .kind = I_BCOND, .imm = cond, .label = w[2].label };
+    p->orig[i] = p->orig[i + 2];
+    remove_insts(p, &w[1], 2);
+    return true;
+}
+
+typedef struct {
+    char *name;
+
+    // Number of instructions at the end of the output it matches
+    int len;
+
+    bool (*apply)(Peephole *p, Inst *w);
+} Rule;
+
+static Rule rules[] = {
+    { "store-load", 2, store_load },
+    { "sp-pair", 2, sp_pair },
+    { "add-zero", 1, add_zero },
+    { "self-move", 1, self_move },
+    { "def-move", 2, def_move },
+    { "branch-next", 2, branch_next },
+    { "cset-branch", 3, cset_branch },
+};
+
+#define NUM_RULES (int)(sizeof(rules) / sizeof(*rules))
+
+static atomic_long total_fired[NUM_RULES];
+
+static bool apply_rules(Peephole *p) {
+    for (int i = 0; i < NUM_RULES; ++i) {
+        Rule *r = &rules[i];
+        if (p->len >= r->len && r->apply(p, &p->insts[p->len - r->len])) {
+            p->fired[i]++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void peephole(Code *c) {
+    long fired[NUM_RULES] = {0};
+    Peephole p = { c->insts, 0 };
+    p.orig = malloc(sizeof(int) * (c->len + 1));
+    p.live = malloc(sizeof(uint32_t) * (c->len + 1));
+    p.fired = fired;
+    if (p.orig == NULL || p.live == NULL) {
+        error("Out of memory");
+    }
+
+    find_live(c, p.live);
+
+    // The output never gets ahead of the input
+    for (int i = 0; i < c->len; ++i) {
+        p.insts[p.len] = c->insts[i];
+        p.orig[p.len] = i;
+        p.len++;
+        while (apply_rules(&p)) {
+            continue;
+        }
+    }
+    c->len = p.len;
+
+    for (int i = 0; i < NUM_RULES; ++i) {
+        if (fired[i] > 0) {
+            atomic_fetch_add(&total_fired[i], fired[i]);
+        }
+    }
+
+    free(p.orig);
+    free(p.live);
+    return;
+}
+
+// Prints how many times each rule fired, for -fpeephole-stats
+void peephole_report(void) {
+    for (int i = 0; i < NUM_RULES; ++i) {
+        fprintf(stderr, "peephole: %-12s %ld\n", rules[i].name, atomic_load(&total_fired[i]));
+    }
+
+    return;
+}
@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "main.h"
+
+// run_parallel starts threads for the duration of one call. They take
+// task indices from a shared counter until all tasks are done, so tasks of
+// uneven size balance out. A call made from inside a task runs its tasks
+// serially instead of starting more threads.
+//
+// A fatal error in a task stops the remaining tasks from starting, and is
+// raised again in the calling thread once all threads are done.
+
+// Number of threads to use, or 0 for one per online CPU
+int num_threads;
+
+static _Thread_local bool in_task;
+
+typedef struct {
+    int n;
+    atomic_int next;
+    atomic_bool failed;
+    atomic_size_t bytes;
+    void (*fn)(void *arg, int i);
+    void *arg;
+} Job;
+
+static void *worker(void *p) {
+    Job *job = p;
+    jmp_buf *prev = error_abort;
+    jmp_buf env;
+    size_t bytes = bytes_allocated;
+
+    in_task = true;
+    if (setjmp(env) == 0) {
+        error_abort = &env;
+        for (int i = atomic_fetch_add(&job->next, 1); i < job->n; i = atomic_fetch_add(&job->next, 1)) {
+            job->fn(job->arg, i);
+        }
+    } else {
+        atomic_store(&job->failed, true);
+        atomic_store(&job->next, job->n);
+    }
+
+    // The caller adds what all threads allocated to its own count
+    atomic_fetch_add(&job->bytes, bytes_allocated - bytes);
+    bytes_allocated = bytes;
+
+    error_abort = prev;
+    in_task = false;
+    return NULL;
+}
+
+static int thread_count(void) {
+    if (num_threads > 0) {
+        return num_threads;
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// Calls fn(arg, i) for each i in [0, n), in no particular order, and
+// returns when all calls have returned.
+void run_parallel(int n, void (*fn)(void *arg, int i), void *arg) {
+    int nthreads = thread_count();
+    if (nthreads > n) {
+        nthreads = n;
+    }
+
+    if (in_task || nthreads <= 1) {
+        for (int i = 0; i < n; ++i) {
+            fn(arg, i);
+        }
+        return;
+    }
+
+    Job job = { .n = n, .fn = fn, .arg = arg };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    atomic_init(&job.bytes, 0);
+
+    pthread_t *threads = calloc(nthreads - 1, sizeof(pthread_t));
+    if (threads == NULL) {
+        error("Out of memory");
+    }
+
+    // The calling thread works too. If a thread cannot be started, the
+    // others pick up its share.
+    int started = 0;
+    while (started < nthreads - 1 && pthread_create(&threads[started], NULL, worker, &job) == 0) {
+        ++started;
+    }
+
+    worker(&job);
+
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    bytes_allocated += atomic_load(&job.bytes);
+
+    if (atomic_load(&job.failed)) {
+        abort_file();
+    }
+
+    return;
+}
@@ -0,0 +1,508 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "main.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Scanning kernels for the lexer's hot loops. Each kernel returns a pointer
+// to the first byte that ends the run it skips. The vector versions read up
+// to 32 bytes at a time and may look past the terminating NUL, which is why
+// every input buffer is followed by SCAN_PADDING zero bytes.
+
+typedef struct {
+    char *name;
+    char *(*skip_space)(char *p);
+    char *(*skip_ident)(char *p);
+    char *(*skip_digits)(char *p);
+    char *(*find_newline)(char *p);
+    char *(*find_comment_end)(char *p);
+} Scanner;
+
+//
+// Scalar fallback
+//
+
+enum {
+    CC_SPACE = 1,
+    CC_DIGIT = 2,
+    CC_ALPHA = 4,
+};
+
+static unsigned char char_class[256] = {
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE, ['\f'] = CC_SPACE, ['\r'] = CC_SPACE,
+
+    ['0'] = CC_DIGIT, ['1'] = CC_DIGIT, ['2'] = CC_DIGIT, ['3'] = CC_DIGIT,
+    ['4'] = CC_DIGIT, ['5'] = CC_DIGIT, ['6'] = CC_DIGIT, ['7'] = CC_DIGIT,
+    ['8'] = CC_DIGIT, ['9'] = CC_DIGIT,
+
+    ['_'] = CC_ALPHA,
+    ['a'] = CC_ALPHA, ['b'] = CC_ALPHA, ['c'] = CC_ALPHA, ['d'] = CC_ALPHA,
+    ['e'] = CC_ALPHA, ['f'] = CC_ALPHA, ['g'] = CC_ALPHA, ['h'] = CC_ALPHA,
+    ['i'] = CC_ALPHA, ['j'] = CC_ALPHA, ['k'] = CC_ALPHA, ['l'] = CC_ALPHA,
+    ['m'] = CC_ALPHA, ['n'] = CC_ALPHA, ['o'] = CC_ALPHA, ['p'] = CC_ALPHA,
+    ['q'] = CC_ALPHA, ['r'] = CC_ALPHA, ['s'] = CC_ALPHA, ['t'] = CC_ALPHA,
+    ['u'] = CC_ALPHA, ['v'] = CC_ALPHA, ['w'] = CC_ALPHA, ['x'] = CC_ALPHA,
+    ['y'] = CC_ALPHA, ['z'] = CC_ALPHA,
+    ['A'] = CC_ALPHA, ['B'] = CC_ALPHA, ['C'] = CC_ALPHA, ['D'] = CC_ALPHA,
+    ['E'] = CC_ALPHA, ['F'] = CC_ALPHA, ['G'] = CC_ALPHA, ['H'] = CC_ALPHA,
+    ['I'] = CC_ALPHA, ['J'] = CC_ALPHA, ['K'] = CC_ALPHA, ['L'] = CC_ALPHA,
+    ['M'] = CC_ALPHA, ['N'] = CC_ALPHA, ['O'] = CC_ALPHA, ['P'] = CC_ALPHA,
+    ['Q'] = CC_ALPHA, ['R'] = CC_ALPHA, ['S'] = CC_ALPHA, ['T'] = CC_ALPHA,
+    ['U'] = CC_ALPHA, ['V'] = CC_ALPHA, ['W'] = CC_ALPHA, ['X'] = CC_ALPHA,
+    ['Y'] = CC_ALPHA, ['Z'] = CC_ALPHA,
+};
+
+static bool in_class(char c, int cls) {
+    return char_class[(unsigned char)c] & cls;
+}
+
+static char *skip_space_scalar(char *p) {
+    while (in_class(*p, CC_SPACE)) {
+        p += 1;
+    }
+    return p;
+}
+
+static char *skip_ident_scalar(char *p) {
+    while (in_class(*p, CC_ALPHA | CC_DIGIT)) {
+        p += 1;
+    }
+    return p;
+}
+
+static char *skip_digits_scalar(char *p) {
+    while (in_class(*p, CC_DIGIT)) {
+        p += 1;
+    }
+    return p;
+}
+
+static char *find_newline_scalar(char *p) {
+    while (*p != '\n' && *p != '\0') {
+        p += 1;
+    }
+    return p;
+}
+
+static char *find_comment_end_scalar(char *p) {
+    for (; *p != '\0'; ++p) {
+        if (p[0] == '*' && p[1] == '/') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static Scanner scalar_scanner = {
+    "scalar",
+    skip_space_scalar,
+    skip_ident_scalar,
+    skip_digits_scalar,
+    find_newline_scalar,
+    find_comment_end_scalar,
+};
+
+#if defined(__x86_64__)
+
+//
+// SSE2 (always available on x86-64)
+//
+
+// Bytes x with lo <= x <= lo + n, compared as unsigned.
+static __m128i in_range_sse2(__m128i x, char lo, char n) {
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(n)), d);
+}
+
+static __m128i is_space_sse2(__m128i x) {
+    __m128i sp = _mm_cmpeq_epi8(x, _mm_set1_epi8(' '));
+    return _mm_or_si128(sp, in_range_sse2(x, '\t', '\r' - '\t'));
+}
+
+static __m128i is_digit_sse2(__m128i x) {
+    return in_range_sse2(x, '0', 9);
+}
+
+static __m128i is_ident_sse2(__m128i x) {
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i alpha = in_range_sse2(lower, 'a', 25);
+    __m128i us = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+    return _mm_or_si128(_mm_or_si128(alpha, us), is_digit_sse2(x));
+}
+
+static char *skip_space_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        unsigned mask = ~_mm_movemask_epi8(is_space_sse2(x)) & 0xffff;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static char *skip_ident_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        unsigned mask = ~_mm_movemask_epi8(is_ident_sse2(x)) & 0xffff;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static char *skip_digits_sse2(char *p) {
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        unsigned mask = ~_mm_movemask_epi8(is_digit_sse2(x)) & 0xffff;
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static char *find_newline_sse2(char *p) {
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i zero = _mm_setzero_si128();
+
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(x, nl), _mm_cmpeq_epi8(x, zero));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+static char *find_comment_end_sse2(char *p) {
+    __m128i star = _mm_set1_epi8('*');
+    __m128i slash = _mm_set1_epi8('/');
+    __m128i zero = _mm_setzero_si128();
+
+    for (;; p += 16) {
+        __m128i x = _mm_loadu_si128((__m128i *)p);
+        __m128i y = _mm_loadu_si128((__m128i *)(p + 1));
+        __m128i end = _mm_and_si128(_mm_cmpeq_epi8(x, star), _mm_cmpeq_epi8(y, slash));
+        __m128i hit = _mm_or_si128(end, _mm_cmpeq_epi8(x, zero));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            char *q = p + __builtin_ctz(mask);
+            return *q == '\0' ? NULL : q;
+        }
+    }
+}
+
+static Scanner sse2_scanner = {
+    "sse2",
+    skip_space_sse2,
+    skip_ident_sse2,
+    skip_digits_sse2,
+    find_newline_sse2,
+    find_comment_end_sse2,
+};
+
+//
+// AVX2
+//
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i in_range_avx2(__m256i x, char lo, char n) {
+    __m256i d = _mm256_sub_epi8(x, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(n)), d);
+}
+
+AVX2 static __m256i is_space_avx2(__m256i x) {
+    __m256i sp = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' '));
+    return _mm256_or_si256(sp, in_range_avx2(x, '\t', '\r' - '\t'));
+}
+
+AVX2 static __m256i is_digit_avx2(__m256i x) {
+    return in_range_avx2(x, '0', 9);
+}
+
+AVX2 static __m256i is_ident_avx2(__m256i x) {
+    __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+    __m256i alpha = in_range_avx2(lower, 'a', 25);
+    __m256i us = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+    return _mm256_or_si256(_mm256_or_si256(alpha, us), is_digit_avx2(x));
+}
+
+AVX2 static char *skip_space_avx2(char *p) {
+    char *q = skip_space_sse2(p);
+    if (q < p + 16) {
+        return q;
+    }
+    p += 16;
+
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(is_space_avx2(x));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+AVX2 static char *skip_ident_avx2(char *p) {
+    char *q = skip_ident_sse2(p);
+    if (q < p + 16) {
+        return q;
+    }
+    p += 16;
+
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(is_ident_avx2(x));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+AVX2 static char *skip_digits_avx2(char *p) {
+    char *q = skip_digits_sse2(p);
+    if (q < p + 16) {
+        return q;
+    }
+    p += 16;
+
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(is_digit_avx2(x));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+AVX2 static char *find_newline_avx2(char *p) {
+    char *q = find_newline_sse2(p);
+    if (q < p + 16) {
+        return q;
+    }
+    p += 16;
+
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i zero = _mm256_setzero_si256();
+
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(x, nl), _mm256_cmpeq_epi8(x, zero));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+}
+
+AVX2 static char *find_comment_end_avx2(char *p) {
+    __m256i star = _mm256_set1_epi8('*');
+    __m256i slash = _mm256_set1_epi8('/');
+    __m256i zero = _mm256_setzero_si256();
+
+    for (;; p += 32) {
+        __m256i x = _mm256_loadu_si256((__m256i *)p);
+        __m256i y = _mm256_loadu_si256((__m256i *)(p + 1));
+        __m256i end = _mm256_and_si256(_mm256_cmpeq_epi8(x, star), _mm256_cmpeq_epi8(y, slash));
+        __m256i hit = _mm256_or_si256(end, _mm256_cmpeq_epi8(x, zero));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask != 0) {
+            char *q = p + __builtin_ctz(mask);
+            return *q == '\0' ? NULL : q;
+        }
+    }
+}
+
+static Scanner avx2_scanner = {
+    "avx2",
+    skip_space_avx2,
+    skip_ident_avx2,
+    skip_digits_avx2,
+    find_newline_avx2,
+    find_comment_end_avx2,
+};
+
+#elif defined(__aarch64__)
+
+//
+// NEON (always available on AArch64)
+//
+
+// NEON has no movemask. Narrowing each 16-bit lane by 4 bits leaves a
+// 64-bit mask with 4 bits per input byte.
+static uint64_t movemask_neon(uint8x16_t v) {
+    uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(n), 0);
+}
+
+static uint8x16_t in_range_neon(uint8x16_t x, char lo, char n) {
+    uint8x16_t d = vsubq_u8(x, vdupq_n_u8(lo));
+    return vcleq_u8(d, vdupq_n_u8(n));
+}
+
+static uint8x16_t is_space_neon(uint8x16_t x) {
+    uint8x16_t sp = vceqq_u8(x, vdupq_n_u8(' '));
+    return vorrq_u8(sp, in_range_neon(x, '\t', '\r' - '\t'));
+}
+
+static uint8x16_t is_digit_neon(uint8x16_t x) {
+    return in_range_neon(x, '0', 9);
+}
+
+static uint8x16_t is_ident_neon(uint8x16_t x) {
+    uint8x16_t lower = vorrq_u8(x, vdupq_n_u8(0x20));
+    uint8x16_t alpha = in_range_neon(lower, 'a', 25);
+    uint8x16_t us = vceqq_u8(x, vdupq_n_u8('_'));
+    return vorrq_u8(vorrq_u8(alpha, us), is_digit_neon(x));
+}
+
+static char *skip_space_neon(char *p) {
+    for (;; p += 16) {
+        uint8x16_t x = vld1q_u8((uint8_t *)p);
+        uint64_t mask = movemask_neon(vmvnq_u8(is_space_neon(x)));
+        if (mask != 0) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+}
+
+static char *skip_ident_neon(char *p) {
+    for (;; p += 16) {
+        uint8x16_t x = vld1q_u8((uint8_t *)p);
+        uint64_t mask = movemask_neon(vmvnq_u8(is_ident_neon(x)));
+        if (mask != 0) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+}
+
+static char *skip_digits_neon(char *p) {
+    for (;; p += 16) {
+        uint8x16_t x = vld1q_u8((uint8_t *)p);
+        uint64_t mask = movemask_neon(vmvnq_u8(is_digit_neon(x)));
+        if (mask != 0) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+}
+
+static char *find_newline_neon(char *p) {
+    for (;; p += 16) {
+        uint8x16_t x = vld1q_u8((uint8_t *)p);
+        uint8x16_t hit = vorrq_u8(vceqq_u8(x, vdupq_n_u8('\n')), vceqzq_u8(x));
+        uint64_t mask = movemask_neon(hit);
+        if (mask != 0) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+}
+
+static char *find_comment_end_neon(char *p) {
+    for (;; p += 16) {
+        uint8x16_t x = vld1q_u8((uint8_t *)p);
+        uint8x16_t y = vld1q_u8((uint8_t *)p + 1);
+        uint8x16_t end = vandq_u8(vceqq_u8(x, vdupq_n_u8('*')), vceqq_u8(y, vdupq_n_u8('/')));
+        uint64_t mask = movemask_neon(vorrq_u8(end, vceqzq_u8(x)));
+        if (mask != 0) {
+            char *q = p + (__builtin_ctzll(mask) >> 2);
+            return *q == '\0' ? NULL : q;
+        }
+    }
+}
+
+static Scanner neon_scanner = {
+    "neon",
+    skip_space_neon,
+    skip_ident_neon,
+    skip_digits_neon,
+    find_newline_neon,
+    find_comment_end_neon,
+};
+
+#endif
+
+static Scanner *scanner;
+
+static bool is_supported(Scanner *sc) {
+#if defined(__x86_64__)
+    if (sc == &avx2_scanner) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    (void)sc;
+    return true;
+}
+
+static Scanner *all_scanners[] = {
+#if defined(__x86_64__)
+    &avx2_scanner,
+    &sse2_scanner,
+#elif defined(__aarch64__)
+    &neon_scanner,
+#endif
+    &scalar_scanner,
+};
+
+// Selects the kernels the lexer uses. NULL picks the fastest set the CPU
+// supports. Returns false if the named set is unknown or unsupported.
+bool scan_use(char *name) {
+    for (int i = 0, n = sizeof(all_scanners) / sizeof(*all_scanners); i < n; ++i) {
+        Scanner *sc = all_scanners[i];
+        if (name != NULL && strcmp(sc->name, name) != 0) {
+            continue;
+        }
+
+        if (is_supported(sc)) {
+            scanner = sc;
+            return true;
+        }
+
+        if (name != NULL) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static void pick_scanner(void) {
+    if (scanner == NULL) {
+        scan_use(NULL);
+    }
+    return;
+}
+
+void scan_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, pick_scanner);
+    return;
+}
+
+char *skip_space(char *p) {
+    return scanner->skip_space(p);
+}
+
+char *skip_ident(char *p) {
+    return scanner->skip_ident(p);
+}
+
+char *skip_digits(char *p) {
+    return scanner->skip_digits(p);
+}
+
+char *find_newline(char *p) {
+    return scanner->find_newline(p);
+}
+
+char *find_comment_end(char *p) {
+    return scanner->find_comment_end(p);
+}
@@ -0,0 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "main.h"
+
+// Compile server. A long-running process listens on a Unix domain socket
+// and compiles the files its clients send, which saves starting a new
+// compiler process for every file. The client is ./main itself, run with
+// --connect.
+//
+// A connection carries any number of requests, each answered before the
+// next one is read. A request is a RequestHeader followed by the file name
+// and the source text; a response is a ResponseHeader followed by the
+// diagnostics and the output. Both ends are the same program on the same
+// machine, so headers are sent as they are laid out in memory.
+//
+// Each connection is served by a thread of its own. A fatal error unwinds
+// only the request that caused it, so one bad input cannot take the server
+// down.
+#define SERVER_MAGIC 0x63633031
+
+typedef struct {
+    uint32_t magic;
+    uint32_t emit_obj;
+    int32_t max_errors;
+    uint32_t name_len;
+    uint32_t source_len;
+} RequestHeader;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t failed;
+    uint32_t diag_len;
+    uint32_t output_len;
+} ResponseHeader;
+
+// Compiles a request's source, writing the output to fd and diagnostics
+// to diag. Returns false if compilation failed.
+static bool compile(RequestHeader *req, char *name, char *src, FILE *diag, int fd) {
+    jmp_buf *prev_abort = error_abort;
+    FILE *prev_output = error_output;
+    jmp_buf env;
+    volatile bool ok = false;
+
+    error_output = diag;
+    max_errors = req->max_errors;
+    if (setjmp(env) == 0) {
+        error_abort = &env;
+        Token tk = tokenize_buffer(name, src, req->source_len);
+        Obj *prog = parse(tk);
+        if (error_count() == 0) {
+            codegen(prog, fd, req->emit_obj);
+            ok = true;
+        }
+    }
+
+    error_abort = prev_abort;
+    error_output = prev_output;
+    arena_release();
+    return ok;
+}
+
+// Reads everything written to fd so far
+static char *read_back(int fd, uint32_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        return NULL;
+    }
+
+    char *buf = malloc(st.st_size + 1);
+    if (buf == NULL || !read_full(fd, buf, st.st_size)) {
+        free(buf);
+        return NULL;
+    }
+
+    *len = st.st_size;
+    return buf;
+}
+
+// Serves one request. Returns false when the connection is done.
+static bool serve_request(int conn) {
+    RequestHeader req;
+    if (!read_full(conn, &req, sizeof(req)) || req.magic != SERVER_MAGIC) {
+        return false;
+    }
+
+    char *name = malloc(req.name_len + 1);
+    char *src = malloc(req.source_len + 1);
+    bool ok = name != NULL && src != NULL &&
+              read_full(conn, name, req.name_len) &&
+              read_full(conn, src, req.source_len);
+
+    ResponseHeader res = { .magic = SERVER_MAGIC };
+    char *diag = NULL;
+    size_t diag_len = 0;
+    char *output = NULL;
+
+    if (ok) {
+        name[req.name_len] = '\0';
+
+        // The output goes to an unnamed temporary file, as the code
+        // generator writes to a file descriptor
+        FILE *diag_fp = open_memstream(&diag, &diag_len);
+        FILE *out_fp = tmpfile();
+        if (diag_fp != NULL && out_fp != NULL) {
+            res.failed = !compile(&req, name, src, diag_fp, fileno(out_fp));
+            if (!res.failed) {
+                output = read_back(fileno(out_fp), &res.output_len);
+                res.failed = output == NULL;
+            }
+        } else {
+            res.failed = true;
+        }
+
+        if (diag_fp != NULL) {
+            fclose(diag_fp);
+            res.diag_len = diag_len;
+        }
+        if (out_fp != NULL) {
+            fclose(out_fp);
+        }
+
+        ok = write_full(conn, &res, sizeof(res)) &&
+             write_full(conn, diag, res.diag_len) &&
+             write_full(conn, output, res.output_len);
+    }
+
+    free(name);
+    free(src);
+    free(diag);
+    free(output);
+    return ok;
+}
+
+static void *serve(void *arg) {
+    int conn = (intptr_t)arg;
+    while (serve_request(conn)) {
+        continue;
+    }
+
+    close(conn);
+    return NULL;
+}
+
+static void socket_addr(struct sockaddr_un *addr, char *path) {
+    *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        error("Socket path too long: %s", path);
+    }
+
+    strcpy(addr->sun_path, path);
+    return;
+}
+
+_Noreturn void run_server(char *path) {
+    struct sockaddr_un addr;
+    socket_addr(&addr, path);
+
+    // A client that goes away must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Replace the socket of a server that is gone, but nothing else
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0) {
+        error("Cannot listen on %s: %s", path, strerror(errno));
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            error("Cannot accept connection: %s", strerror(errno));
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve, (void *)(intptr_t)conn) != 0) {
+            serve((void *)(intptr_t)conn);
+        }
+    }
+}
+
+int server_connect(char *path) {
+    struct sockaddr_un addr;
+    socket_addr(&addr, path);
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        error("Cannot connect to compile server at %s: %s", path, strerror(errno));
+    }
+
+    return conn;
+}
+
+// Has the server compile len bytes of source at src. Diagnostics are
+// written to stderr and the output is appended to out. Returns false if
+// compilation failed.
+bool server_compile(int conn, char *name, char *src, size_t len, bool emit_obj, Buffer *out) {
+    RequestHeader req = { SERVER_MAGIC, emit_obj, max_errors, strlen(name), len };
+    ResponseHeader res;
+
+    if (!write_full(conn, &req, sizeof(req)) ||
+        !write_full(conn, name, req.name_len) ||
+        !write_full(conn, src, len) ||
+        !read_full(conn, &res, sizeof(res)) ||
+        res.magic != SERVER_MAGIC) {
+        error("Lost connection to compile server");
+    }
+
+    char *diag = malloc(res.diag_len + 1);
+    if (diag == NULL) {
+        error("Out of memory");
+    }
+
+    if (!read_full(conn, diag, res.diag_len)) {
+        error("Lost connection to compile server");
+    }
+    fwrite(diag, 1, res.diag_len, stderr);
+    free(diag);
+
+    buf_reserve(out, res.output_len);
+    if (!read_full(conn, out->data + out->len, res.output_len)) {
+        error("Lost connection to compile server");
+    }
+    out->len += res.output_len;
+    return !res.failed;
+}
@@ -0,0 +1,204 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "main.h"
+
+// Statistics for -ftime-report and -fmem-report. A thread compiling a file
+// times the phases it goes through and counts the bytes each one
+// allocates. When the file is done, its figures are added to the totals for
+// the process.
+//
+// CPU time is taken from the thread's clock when several files are
+// compiled, each on one thread, and from the process's clock when one file
+// is, as code generation then runs on the thread pool.
+
+typedef struct {
+    double wall;
+    double cpu;
+    long bytes;
+} PhaseStats;
+
+static char *phase_names[] = { "tokenize", "parse", "offsets", "codegen", "output" };
+
+bool stats_enabled;
+static clockid_t cpu_clock;
+
+static _Thread_local int cur_phase = -1;
+static _Thread_local double start_wall;
+static _Thread_local double start_cpu;
+static _Thread_local size_t start_bytes;
+static _Thread_local PhaseStats phases[NUM_PHASES];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static PhaseStats totals[NUM_PHASES];
+static long num_files;
+static long num_tokens;
+static long num_nodes;
+static long num_types;
+static long num_objects;
+static long num_functions;
+
+static double clock_secs(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_enable(bool one_file) {
+    stats_enabled = true;
+    cpu_clock = one_file ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID;
+    return;
+}
+
+// Ends the current phase of the calling thread, if any
+void phase_end(void) {
+    if (!stats_enabled || cur_phase < 0) {
+        return;
+    }
+
+    PhaseStats *p = &phases[cur_phase];
+    p->wall += clock_secs(CLOCK_MONOTONIC) - start_wall;
+    p->cpu += clock_secs(cpu_clock) - start_cpu;
+    p->bytes += bytes_allocated - start_bytes;
+    cur_phase = -1;
+    return;
+}
+
+// Ends the current phase of the calling thread and starts another
+void phase_start(Phase phase) {
+    if (!stats_enabled) {
+        return;
+    }
+
+    phase_end();
+    cur_phase = phase;
+    start_wall = clock_secs(CLOCK_MONOTONIC);
+    start_cpu = clock_secs(cpu_clock);
+    start_bytes = bytes_allocated;
+    return;
+}
+
+// Counts what a file was parsed into. Must be called before the arena is
+// released.
+void stats_count(Obj *prog) {
+    if (!stats_enabled) {
+        return;
+    }
+
+    long objs = 0;
+    long fns = 0;
+    for (Obj *v = prog; v != NULL; v = v->next) {
+        objs++;
+        if (v->is_function) {
+            fns++;
+            for (Obj *l = v->locals; l != NULL; l = l->next) {
+                objs++;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    num_tokens += tokens->len;
+    // Don't count the null node
+    num_nodes += nodes->len - 1;
+    num_types += type_count();
+    num_objects += objs;
+    num_functions += fns;
+    pthread_mutex_unlock(&lock);
+    return;
+}
+
+// Adds the phases of the file the calling thread compiled to the totals
+void stats_end_file(void) {
+    if (!stats_enabled) {
+        return;
+    }
+
+    phase_end();
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        totals[i].wall += phases[i].wall;
+        totals[i].cpu += phases[i].cpu;
+        totals[i].bytes += phases[i].bytes;
+        phases[i] = (PhaseStats) {0};
+    }
+    num_files++;
+    pthread_mutex_unlock(&lock);
+    return;
+}
+
+static long peak_rss(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss * 1024L;
+}
+
+static void print_json(FILE *fp) {
+    fprintf(fp, "{\"files\": %ld, \"tokens\": %ld, \"nodes\": %ld, \"types\": %ld, "
+            "\"objects\": %ld, \"functions\": %ld, \"peak_rss\": %ld, \"phases\": {",
+            num_files, num_tokens, num_nodes, num_types, num_objects, num_functions,
+            peak_rss());
+
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        fprintf(fp, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f, \"bytes\": %ld}",
+                i ? ", " : "", phase_names[i], totals[i].wall, totals[i].cpu, totals[i].bytes);
+    }
+
+    fprintf(fp, "}}\n");
+    return;
+}
+
+static void print_text(FILE *fp, bool time, bool mem) {
+    PhaseStats sum = {0};
+    for (int i = 0; i < NUM_PHASES; ++i) {
+        sum.wall += totals[i].wall;
+        sum.cpu += totals[i].cpu;
+        sum.bytes += totals[i].bytes;
+    }
+
+    fprintf(fp, "%-10s", "phase");
+    if (time) {
+        fprintf(fp, " %10s %10s %6s", "wall (s)", "cpu (s)", "wall %");
+    }
+    if (mem) {
+        fprintf(fp, " %12s", "alloc (KB)");
+    }
+    fprintf(fp, "\n");
+
+    for (int i = 0; i <= NUM_PHASES; ++i) {
+        PhaseStats *p = i < NUM_PHASES ? &totals[i] : &sum;
+        fprintf(fp, "%-10s", i < NUM_PHASES ? phase_names[i] : "total");
+        if (time) {
+            fprintf(fp, " %10.3f %10.3f %5.1f%%", p->wall, p->cpu,
+                    sum.wall > 0 ? p->wall / sum.wall * 100 : 0);
+        }
+        if (mem) {
+            fprintf(fp, " %12ld", p->bytes / 1024);
+        }
+        fprintf(fp, "\n");
+    }
+
+    fprintf(fp, "%ld files, %ld tokens, %ld nodes, %ld types, %ld objects, %ld functions\n",
+            num_files, num_tokens, num_nodes, num_types, num_objects, num_functions);
+    if (mem) {
+        fprintf(fp, "peak RSS %.1f MB\n", peak_rss() / 1e6);
+    }
+
+    return;
+}
+
+// Prints the totals to stderr, as a table of the figures asked for or as
+// a JSON object with all of them
+void stats_report(bool time, bool mem, bool json) {
+    pthread_mutex_lock(&lock);
+    if (json) {
+        print_json(stderr);
+    } else {
+        print_text(stderr, time, mem);
+    }
+    pthread_mutex_unlock(&lock);
+    return;
+}
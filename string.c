@@ -1,17 +1,79 @@
-#define _POSIX_C_SOURCE 200809L
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "main.h"
 
 char *format(char *fmt, ...) {
-    char *buf;
-    size_t buflen;
-    FILE *out = open_memstream(&buf, &buflen);
-
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(out, fmt, ap);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char *buf = arena_alloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
     va_end(ap);
-    fclose(out);
     return buf;
 }
+
+// Identifier atoms. Every distinct spelling is stored once and numbered,
+// so interned names can be compared by pointer or by ID. Atoms live in the
+// arena and the table is emptied when the arena is released. Like the
+// arena, the table belongs to the thread.
+typedef struct {
+    char *name;
+    int id;
+} Atom;
+
+static _Thread_local HashMap atoms;
+static _Thread_local char **atom_names;
+static _Thread_local int num_atoms;
+static _Thread_local int atom_cap;
+
+static void clear_atoms(void *arg) {
+    (void)arg;
+    free(atom_names);
+    atoms = (HashMap) {0};
+    atom_names = NULL;
+    num_atoms = 0;
+    atom_cap = 0;
+    return;
+}
+
+int intern(char *s, int len) {
+    Atom *atom = hashmap_get2(&atoms, s, len);
+    if (atom != NULL) {
+        return atom->id;
+    }
+
+    if (num_atoms == 0) {
+        arena_on_release(clear_atoms, NULL);
+    }
+
+    if (num_atoms == atom_cap) {
+        atom_cap = atom_cap ? atom_cap * 2 : 1024;
+        atom_names = grow_array(atom_names, atom_cap, sizeof(char *));
+    }
+
+    atom = arena_new(Atom);
+    atom->name = arena_strndup(s, len);
+    atom->id = num_atoms++;
+    atom_names[atom->id] = atom->name;
+    hashmap_put2(&atoms, atom->name, len, atom);
+    return atom->id;
+}
+
+char *atom_name(int id) {
+    return atom_names[id];
+}
+
+// Tasks on the thread pool look up names in the atoms of the thread that
+// started them, which must not intern anything until they are done
+char **atom_table(void) {
+    return atom_names;
+}
+
+void share_atom_table(char **names) {
+    atom_names = names;
+    return;
+}
@@ -19,9 +19,165 @@ rm -f $tmp/out
 test -f $tmp/out
 check '-o'
 
+# `-c` option
+echo 'int main() { return 0; }' > $tmp/main.c
+rm -f $tmp/out
+./main -c -o $tmp/out $tmp/main.c
+head -c 4 $tmp/out | od -An -c | grep -q '177   E   L   F'
+check '-c'
+
+# `-j` option
+for i in `seq 300`; do echo "int f$i(int x) { if (x) return $i; for (;;) return f$i(x - 1); }"; done > $tmp/fns.c
+./main -j1 -o $tmp/out1 $tmp/fns.c
+./main -j4 -o $tmp/out4 $tmp/fns.c
+cmp -s $tmp/out1 $tmp/out4
+check '-j'
+
+# Enough string literals in one function to grow the node pool while a
+# statement is being parsed
+(echo 'int f(int a) {'; for i in `seq 20`; do echo '    a = a + "abcdefghij"[1];'; done; echo '    return a; }') > $tmp/grow.c
+./main -o $tmp/out $tmp/grow.c
+check 'node pool growth'
+
 # `--help` option
 
 ./main --help 2>&1 | grep -q 'Usage:'
 check '--help'
 
+# `-fdump-ir` option
+./main -fdump-ir -o $tmp/out $tmp/main.c 2>&1 | grep -q '^    ret v1$'
+check '-fdump-ir'
+
+./main -fverify-ir -o $tmp/out $tmp/fns.c
+check '-fverify-ir'
+
+# Parameters are passed in registers only
+echo 'int f(int a, int b, int c, int d, int e, int f, int g, int h, int i) { return i; }' > $tmp/params.c
+./main -o $tmp/out $tmp/params.c 2>&1 | grep -q 'Too many parameters'
+check 'too many parameters'
+
+# `-fpeephole-stats` option
+echo 'int f(int x) { if (x < 3) return 1; return 2; }' > $tmp/cmp.c
+./main -fpeephole-stats -o $tmp/out $tmp/cmp.c 2>&1 | grep -q '^peephole: cset-branch  *1$'
+check '-fpeephole-stats'
+
+# `-fmax-errors` option
+printf 'int main() {\n    x = 1;\n    return y\n}\nint f( { return 0; }\n' > $tmp/errors.c
+./main -o $tmp/out $tmp/errors.c 2>&1 | grep -c '\^' | grep -q '^1$'
+check 'stop at first error'
+
+./main -fmax-errors=0 -o $tmp/out $tmp/errors.c 2>&1 | grep -c '\^' | grep -q '^3$'
+check '-fmax-errors=0'
+
+./main -fmax-errors=2 -o $tmp/out $tmp/errors.c 2>&1 | grep -c '\^' | grep -q '^2$'
+check '-fmax-errors=2'
+
+./main -fmax-errors=0 -o $tmp/out $tmp/errors.c 2>/dev/null
+test $? -ne 0
+check 'exit status with errors'
+
+./main -fmax-errors=0 $tmp/errors.c 2>&1 | grep -q 'errors.c:3:'
+check 'line numbers'
+
+# Multiple inputs
+mkdir $tmp/dir
+echo 'int a() { return 1; }' > $tmp/a.c
+echo 'int b() { return 2; }' > $tmp/b.c
+./main -d $tmp/dir $tmp/a.c $tmp/b.c 2>/dev/null
+test -f $tmp/dir/a.s && test -f $tmp/dir/b.s
+check 'multiple inputs'
+
+./main -o $tmp/out $tmp/a.c
+cmp -s $tmp/out $tmp/dir/a.s
+check 'multiple inputs output'
+
+./main -d $tmp/dir $tmp/a.c $tmp/b.c 2>&1 | grep -q 'tokens/s'
+check 'throughput report'
+
+rm -f $tmp/dir/*
+./main -d $tmp/dir $tmp/a.c $tmp/errors.c $tmp/b.c 2>/dev/null
+test $? -ne 0 && test -f $tmp/dir/a.s && test -f $tmp/dir/b.s && test ! -f $tmp/dir/errors.s
+check 'multiple inputs with errors'
+
+./main -o $tmp/out $tmp/a.c $tmp/b.c 2>/dev/null
+test $? -ne 0
+check '-o with multiple inputs'
+
+# Phase statistics
+./main -ftime-report -o $tmp/out $tmp/a.c 2>&1 | grep -q '^codegen '
+check '-ftime-report'
+
+./main -fmem-report -o $tmp/out $tmp/a.c 2>&1 | grep -q 'peak RSS'
+check '-fmem-report'
+
+./main -ftime-report -freport-format=json -o $tmp/out $tmp/a.c 2>&1 | grep -q '"phases": {"tokenize": {"wall": '
+check '-freport-format=json'
+
+./main -ftime-report -d $tmp/dir $tmp/a.c $tmp/b.c 2>&1 | grep -q '^2 files, '
+check '-ftime-report with multiple inputs'
+
+# Compilation cache
+./main --cache=$tmp/cache -o $tmp/out $tmp/a.c
+./main --cache=$tmp/cache -o $tmp/out2 $tmp/a.c
+cmp -s $tmp/out $tmp/dir/a.s && cmp -s $tmp/out2 $tmp/dir/a.s
+check '--cache'
+
+./main --cache=$tmp/cache --cache-stats -o $tmp/out $tmp/a.c 2>&1 | grep -q '1 hits, 0 misses'
+check '--cache-stats'
+
+# More functions than a batch, calling ones in later batches
+for i in `seq 600`; do echo "int f$i(int x) { if (x) return f$(( (i + 299) % 600 + 1 ))(x - 1); return $i; }"; done > $tmp/calls.c
+./main --cache=$tmp/cache -c -o $tmp/out $tmp/calls.c
+./main --cache=$tmp/cache -c -o $tmp/out $tmp/calls.c
+./main -c -o $tmp/out2 $tmp/calls.c
+cmp -s $tmp/out $tmp/out2
+check '--cache with -c'
+
+echo 'int g; int f() { return g; }' > $tmp/g.c
+./main --cache=$tmp/cache -o $tmp/out $tmp/g.c
+echo 'char g; int f() { return g; }' > $tmp/g.c
+./main --cache=$tmp/cache -o $tmp/out $tmp/g.c
+./main -o $tmp/out2 $tmp/g.c
+cmp -s $tmp/out $tmp/out2
+check 'cache key covers globals'
+
+echo 'int x; int f() { return sizeof(x); }' > $tmp/g.c
+./main --cache=$tmp/cache -o $tmp/out $tmp/g.c
+echo 'int x[4]; int f() { return sizeof(x); }' > $tmp/g.c
+./main --cache=$tmp/cache -o $tmp/out $tmp/g.c
+./main -o $tmp/out2 $tmp/g.c
+cmp -s $tmp/out $tmp/out2
+check 'cache key covers sizeof'
+
+# Compile server
+./main --server=$tmp/sock &
+server=$!
+trap 'kill $server; rm -rf $tmp' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  test -S $tmp/sock && break
+  sleep 0.1
+done
+
+./main --connect=$tmp/sock -o $tmp/out $tmp/a.c
+cmp -s $tmp/out $tmp/dir/a.s
+check '--connect'
+
+MAIN_SERVER=$tmp/sock ./main -c -o $tmp/out $tmp/a.c
+./main -c -o $tmp/out2 $tmp/a.c
+cmp -s $tmp/out $tmp/out2
+check 'MAIN_SERVER'
+
+./main --connect=$tmp/sock -fmax-errors=0 -o $tmp/out $tmp/errors.c 2>&1 | grep -c '\^' | grep -q '^3$'
+check 'server diagnostics'
+
+rm -f $tmp/dir/*
+./main --connect=$tmp/sock -d $tmp/dir $tmp/a.c $tmp/errors.c $tmp/b.c 2>/dev/null
+test $? -ne 0 && test -f $tmp/dir/a.s && test -f $tmp/dir/b.s && test ! -f $tmp/dir/errors.s
+check 'server survives errors'
+
+echo 'int main() { return add8(1, 2, 3, 4, 5, 6, 7, 8, 9); }' > $tmp/args.c
+./main --connect=$tmp/sock -o $tmp/out $tmp/args.c 2>&1 | grep -q 'Too many arguments'
+./main --connect=$tmp/sock -o $tmp/out $tmp/a.c && cmp -s $tmp/out $tmp/dir/a.s
+check 'server survives too many arguments'
+
 echo 'Success!'
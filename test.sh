@@ -56,6 +56,9 @@ assert 0 'int main() { return 1 > 2; }'
 assert 1 'int main() { return 1 >= 0; }'
 assert 1 'int main() { return 1 >= 1; }'
 assert 0 'int main() { return 1 >= 2; }'
+assert 7 'int main() { int x = 7; return x * 1 + 0 - (x - x); }'
+assert 1 'int main() { int x = 3; return (x <= x) + (x < x) - (x != x); }'
+assert 0 'int main() { return 9223372036854775807 + 1 < 0 == 0; }'
 
 assert 3 'int main() { int a; a = 3; return a; }'
 assert 3 'int main() { int a = 3; return a; }'
@@ -63,6 +66,7 @@ assert 8 'int main() { int a = 3; int z = 5; return a + z; }'
 assert 6 'int main() { int a; int b; a = b = 3; return a + b; }'
 assert 3 'int main() { int foo = 3; return foo; }'
 assert 8 'int main() { int foo123 = 3; int bar = 5; return foo123 + bar; }'
+assert 6 'int main() { int iff = 3; int chars = 2; int e = 1; return iff + chars + e; }'
 
 assert 1  'int main() { return 1; 2; 3; }'
 assert 2  'int main() { 1; return 2; 3; }'
@@ -77,6 +81,7 @@ assert 4  'int main() { if (0) { 1; 2; return 3; } else { return 4; } }'
 assert 3  'int main() { if (1) { 1; 2; return 3; } else { return 4; } }'
 assert 55 'int main() { int i = 0; int j = 0; for (i = 0; i <= 10; i = i + 1) j = i + j; return j; }'
 assert 3  'int main() { for (; ; ) { return 3; } return 5; }'
+assert 5  'int main() { int i = 5; for (; 0; ) i = 1; if (sizeof(i) - 8) return 2; return i; }'
 assert 10 'int main() { int i = 0; while(i < 10) i = i + 1; return i; }'
 
 assert 3 'int main() { int x = 3; return *&x; }'
@@ -87,6 +92,8 @@ assert 5 'int main() { int x = 3; int y = 5; return *(&x - (-1)); }'
 assert 5 'int main() { int x = 3; int *y = &x; *y = 5; return x; }'
 assert 7 'int main() { int x = 3; int y = 5; *(&x + 1) = 7; return y; }'
 assert 7 'int main() { int x = 3; int y = 5; *(&y - 1) = 7; return x; }'
+assert 5 'int main() { int x = 3; int *y = &x; x = 4; *y = 5; return x; }'
+assert 4 'int main() { char x = 260; return x; }'
 assert 5 'int main() { int x = 3; return (&x + 2) - &x + 3; }'
 assert 8 'int main() { int x, y; x = 3; y = 5; return x + y; }'
 assert 8 'int main() { int x = 3, y = 5; return x + y; }'
@@ -97,11 +104,20 @@ assert 8   'int main() { return add(3, 5); }'
 assert 2   'int main() { return sub(5, 3); }'
 assert 36  'int main() { return add8(1, 2, 3, 4, 5, 6, 7, 8); }'
 assert 120 'int main() { return add8(1, 2, 3, add8(4, 5, 6, 7, 8, 9, 10, 11), 12, 13, 14, 15); }'
+assert 15  'int main() { return 3 * (2 + add(1, 2)); }'
+assert 55  'int main() { return 1+(2+(3+(4+(5+(6+(7+(8+(9+10)))))))); }'
+assert 63  'int main() { int a=1; return a+(a+(a+(a+(a+(a+(a+(a+add8(1,2,3,4,5,6,7,8+(9+10))))))))); }'
 
 assert 32 'int main() { return ret32(); } int ret32() { return 32; }'
 assert 7  'int main() { return add2(3, 4); } int add2(int x, int y) { return x + y; }'
 assert 1  'int main() { return sub2(4, 3); } int sub2(int x, int y) { return x - y; }'
 assert 55 'int main() { return fib(9); } int fib(int x) { if (x <= 1) return 1; return fib(x - 1) + fib(x - 2); }'
+assert 13 'int main() { return f(3, 4); } int f(int x, int y) { return x + add(y, x) + x; }'
+assert 7  'int main() { return f(3, 10); } int f(int x, int y) { return sub(y, x); }'
+assert 7  'int main() { return f(-7) + 10; } int f(int x) { return x / 2; }'
+assert 68 'int main() { return f(10); } int f(int x) { return x / 7 + x / -3 + x * 3 - x * 6 + x * 10; }'
+assert 49 'int main() { return f(-100) + 50; } int f(int x) { return x / 100 * -7 + x / -8 * 4 - x * -9 / 16; }'
+assert 24 'int main() { return f(3, 5); } int f(int x, int y) { int r = 0; if (x < y) r = r + 1; if (x <= y) r = r + 2; if (x > y) r = r + 4; if (x >= y) r = r + 8; if (x == y) r = r + 16; if (x != y) r = r + 16; while (x < y) x = x + 1; return r + x; }'
 
 assert 3 'int main() { int x[2]; int *y = &x; *y = 3; return *x; }'
 assert 3 'int main() { int x[3]; *x = 3; *(x + 1) = 4; *(x + 2) = 5; return *x; }'
@@ -196,6 +212,11 @@ assert 1 'int main() { ({ 0; return 1; 2; }); return 3; }'
 assert 6 'int main() { return ({ 1; }) + ({ 2; }) + ({ 3; }); }'
 assert 3 'int main() { return ({ int x=3; x; }); }'
 
+assert 2 'int main() { int x = 2; { int x = 3; } return x; }'
+assert 2 'int main() { int x = 2; { int x = 3; } { int y = 4; return x; } }'
+assert 3 'int main() { int x = 2; { x = 3; } return x; }'
+assert 7 'int x; int main() { x = 2; return ({ int x = 3; x; }) + x + 2; }'
+
 assert 2 'int main() { /* return 1; */ return 2; }'
 assert 2 'int main() { // return 1;
 return 2; }'
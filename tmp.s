@@ -0,0 +1,12 @@
+	.text
+	.global main
+main:
+	stp x29, x30, [sp, #-16]!
+	mov x29, sp
+	sub sp, sp, #0
+	mov x0, #0
+	b .L.return.main
+.L.return.main:
+	mov sp, x29
+	ldp x29, x30, [sp], #16
+	ret
@@ -1,87 +1,199 @@
+#define _DEFAULT_SOURCE
 #define _POSIX_C_SOURCE 200809L
+#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "main.h"
 
-static char *current_filename;
-static char *current_input;
+// State of the file being compiled. Each thread compiles one file at a
+// time, so this is per thread.
+_Thread_local TokenStream *tokens;
+
+// Diagnostics. With max_errors == 1 the first error is fatal; otherwise
+// errors are counted and the parser may resume at error_recovery. A fatal
+// error unwinds to error_abort, which gives up on the current file, or
+// exits if there is none. Messages go to error_output, or to stderr if it
+// is NULL.
+_Thread_local int max_errors = 1;
+_Thread_local jmp_buf *error_recovery;
+_Thread_local jmp_buf *error_abort;
+_Thread_local Token error_token = -1;
+_Thread_local FILE *error_output;
+static _Thread_local int num_errors;
+
+_Noreturn void abort_file(void) {
+    if (error_abort != NULL) {
+        longjmp(*error_abort, 1);
+    }
+
+    exit(EXIT_FAILURE);
+}
 
 int error(char *fmt, ...) {
+    FILE *out = error_output ? error_output : stderr;
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    flockfile(out);
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    funlockfile(out);
     va_end(ap);
-    exit(EXIT_FAILURE);
+    abort_file();
 }
 
-static int verror_at(char *loc, char *fmt, va_list ap) {
-    char *line = loc;
-    while (current_input < line && line[-1] != '\n') {
-        line -= 1;
+static void build_line_index(TokenStream *ts) {
+    int cap = 1024;
+    int *starts = arena_alloc(sizeof(int) * cap);
+    int n = 1;
+    starts[0] = 0;
+
+    char *p = ts->input;
+    for (char *q = find_newline(p); *q != '\0'; q = find_newline(q + 1)) {
+        if (n == cap) {
+            int *buf = arena_alloc(sizeof(int) * cap * 2);
+            memcpy(buf, starts, sizeof(int) * cap);
+            starts = buf;
+            cap *= 2;
+        }
+        starts[n++] = q + 1 - p;
     }
 
-    char *end = loc;
-    while (*end != '\n') {
-        end += 1;
-    }
+    ts->line_starts = starts;
+    ts->num_lines = n;
+    return;
+}
 
-    int line_num = 1;
-    for (char *p = current_input; p < line; ++p) {
-        if (*p == '\n') {
-            line_num += 1;
+// Returns the 0-based line containing the given byte offset.
+static int find_line(int offset) {
+    int lo = 0;
+    int hi = tokens->num_lines - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (tokens->line_starts[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
     }
 
-    int indent = fprintf(stderr, "%s:%d: ", current_filename, line_num);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+    return lo;
+}
+
+static void verror_at(char *loc, char *fmt, va_list ap) {
+    int line_no = find_line(loc - tokens->input);
+    char *line = tokens->input + tokens->line_starts[line_no];
+    char *end = find_newline(loc);
+
+    // Keep the lines of one message together when files are compiled in
+    // parallel
+    FILE *out = error_output ? error_output : stderr;
+    flockfile(out);
+    int indent = fprintf(out, "%s:%d: ", tokens->filename, line_no + 1);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
 
     int pos = loc - line + indent;
-    fprintf(stderr, "%*s", pos, "");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    return EXIT_FAILURE;
+    fprintf(out, "%*s", pos, "");
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    funlockfile(out);
+
+    num_errors += 1;
+    if (max_errors != 0 && num_errors >= max_errors) {
+        abort_file();
+    }
+    return;
 }
 
-int error_at(char *loc, char *fmt, ...) {
+// Unwinds to the innermost recovery point, or gives up on the file if
+// there is none.
+_Noreturn static void bail_out(void) {
+    if (error_recovery != NULL) {
+        longjmp(*error_recovery, 1);
+    }
+
+    abort_file();
+}
+
+int error_count(void) {
+    return num_errors;
+}
+
+// Reports an error in the input without giving up on it. The caller is
+// expected to recover and carry on.
+static void lex_error(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(loc, fmt, ap);
     va_end(ap);
-    exit(EXIT_FAILURE);
+    return;
 }
 
-int error_tk(Token *tk, char *fmt, ...) {
+int error_at(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tk->loc, fmt, ap);
+    verror_at(loc, fmt, ap);
     va_end(ap);
-    exit(EXIT_FAILURE);
+    error_token = -1;
+    bail_out();
 }
 
-bool equal(Token *tk, char *op) {
-    bool len = tk->len == strlen(op);
-    bool loc = strncmp(tk->loc, op, tk->len) == 0;
-    return len && loc;
+int error_tk(Token tk, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    verror_at(tk_loc(tk), fmt, ap);
+    va_end(ap);
+    error_token = tk;
+    bail_out();
 }
 
-Token *skip(Token *tk, char *op) {
-    if (!equal(tk, op)) {
-        error_tk(tk, "Expected '%s'", op);
+static char *punct_str[] = {
+    [PU_LPAREN]    = "(",
+    [PU_RPAREN]    = ")",
+    [PU_LBRACE]    = "{",
+    [PU_RBRACE]    = "}",
+    [PU_LBRACKET]  = "[",
+    [PU_RBRACKET]  = "]",
+    [PU_SEMICOLON] = ";",
+    [PU_COMMA]     = ",",
+    [PU_PLUS]      = "+",
+    [PU_MINUS]     = "-",
+    [PU_STAR]      = "*",
+    [PU_SLASH]     = "/",
+    [PU_AMP]       = "&",
+    [PU_ASSIGN]    = "=",
+    [PU_EQ]        = "==",
+    [PU_NE]        = "!=",
+    [PU_LT]        = "<",
+    [PU_LE]        = "<=",
+    [PU_GT]        = ">",
+    [PU_GE]        = ">=",
+};
+
+Token skip(Token tk, PunctKind punct) {
+    if (!is_punct(tk, punct)) {
+        error_tk(tk, "Expected '%s'", punct_str[punct]);
     }
 
-    return tk->next;
+    return tk + 1;
 }
 
-bool consume(Token **rest, Token *tk, char *str) {
-    if (equal(tk, str)) {
-        *rest = tk->next;
+bool consume(Token *rest, Token tk, PunctKind punct) {
+    if (is_punct(tk, punct)) {
+        *rest = tk + 1;
         return true;
     }
 
@@ -89,59 +201,184 @@ bool consume(Token **rest, Token *tk, char *str) {
     return false;
 }
 
-static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tk = calloc(1, sizeof(Token));
-    tk->kind = kind;
-    tk->loc = start;
-    tk->len = end - start;
+static Token new_token(TokenKind kind, char *start, char *end, uint32_t payload) {
+    TokenStream *ts = tokens;
+    if (ts->len == ts->cap) {
+        ts->cap *= 2;
+        ts->kind = grow_array(ts->kind, ts->cap, sizeof(*ts->kind));
+        ts->offset = grow_array(ts->offset, ts->cap, sizeof(*ts->offset));
+        ts->length = grow_array(ts->length, ts->cap, sizeof(*ts->length));
+        ts->payload = grow_array(ts->payload, ts->cap, sizeof(*ts->payload));
+    }
+
+    Token tk = ts->len++;
+    ts->kind[tk] = kind;
+    ts->offset[tk] = start - ts->input;
+    ts->length[tk] = end - start;
+    ts->payload[tk] = payload;
     return tk;
 }
 
-static bool starts_with(char *p, char *q) {
-    return strncmp(p, q, strlen(q)) == 0;
+static void free_stream(void *arg) {
+    TokenStream *ts = arg;
+    free(ts->kind);
+    free(ts->offset);
+    free(ts->length);
+    free(ts->payload);
+    free(ts->vals);
+    free(ts->strs);
+    return;
+}
+
+static TokenStream *new_stream(char *filename, char *input) {
+    TokenStream *ts = arena_new(TokenStream);
+    ts->filename = filename;
+    ts->input = input;
+    build_line_index(ts);
+
+    // A rough guess that is right for typical code; the arrays grow as
+    // needed.
+    ts->cap = strlen(input) / 4 + 16;
+    ts->kind = grow_array(NULL, ts->cap, sizeof(*ts->kind));
+    ts->offset = grow_array(NULL, ts->cap, sizeof(*ts->offset));
+    ts->length = grow_array(NULL, ts->cap, sizeof(*ts->length));
+    ts->payload = grow_array(NULL, ts->cap, sizeof(*ts->payload));
+    arena_on_release(free_stream, ts);
+    return ts;
+}
+
+static uint32_t add_val(long long val) {
+    TokenStream *ts = tokens;
+    if ((ts->num_vals & (ts->num_vals - 1)) == 0) {
+        ts->vals = grow_array(ts->vals, ts->num_vals ? ts->num_vals * 2 : 16, sizeof(*ts->vals));
+    }
+
+    ts->vals[ts->num_vals] = val;
+    return ts->num_vals++;
+}
+
+static uint32_t add_str(char *str, Type *ty) {
+    TokenStream *ts = tokens;
+    if ((ts->num_strs & (ts->num_strs - 1)) == 0) {
+        ts->strs = grow_array(ts->strs, ts->num_strs ? ts->num_strs * 2 : 16, sizeof(*ts->strs));
+    }
+
+    ts->strs[ts->num_strs] = (StrLit) { str, ty };
+    return ts->num_strs++;
 }
 
 static bool is_ident1(char c) {
     return isalpha(c) || c == '_';
 }
 
-static bool is_ident2(char c) {
-    return isalnum(c) || c == '_';
-}
-
-static int read_punct(char *p) {
-    if (starts_with(p, "==")) return 2;
-    if (starts_with(p, "!=")) return 2;
-    if (starts_with(p, "<=")) return 2;
-    if (starts_with(p, ">=")) return 2;
-    if (starts_with(p, "+")) return 1;
-    if (starts_with(p, "-")) return 1;
-    if (starts_with(p, "*")) return 1;
-    if (starts_with(p, "/")) return 1;
-    if (starts_with(p, "(")) return 1;
-    if (starts_with(p, ")")) return 1;
-    if (starts_with(p, "<")) return 1;
-    if (starts_with(p, ">")) return 1;
-    if (starts_with(p, ";")) return 1;
-    if (starts_with(p, "=")) return 1;
-    if (starts_with(p, "{")) return 1;
-    if (starts_with(p, "}")) return 1;
-    if (starts_with(p, "&")) return 1;
-    if (starts_with(p, ",")) return 1;
-    if (starts_with(p, "[")) return 1;
-    if (starts_with(p, "]")) return 1;
-    return 0;
+static long long read_number(char *start, char *end) {
+    long long val = 0;
+    for (char *p = start; p < end; ++p) {
+        int d = *p - '0';
+        if (val > (LLONG_MAX - d) / 10) {
+            return LLONG_MAX;
+        }
+        val = val * 10 + d;
+    }
+
+    return val;
 }
 
-static bool is_keyword(Token *tk) {
-    static char *kw[] = { "return", "if", "else", "for", "while", "int", "sizeof", "char" };
-    for (int i = 0, n = sizeof(kw) / sizeof(*kw); i < n; ++i) {
-        if (equal(tk, kw[i])) {
-            return true;
+// Punctuators are recognized by a DFA generated from punct_str. Bytes are
+// first mapped to a small class number, so a transition is a single table
+// lookup and the cost per character does not depend on how many
+// punctuators there are. State 0 is the start state and also means "no
+// transition".
+#define PUNCT_MAX_STATES 128
+#define PUNCT_MAX_CLASSES 32
+
+static unsigned char punct_class[256];
+static unsigned char punct_next[PUNCT_MAX_STATES][PUNCT_MAX_CLASSES];
+static PunctKind punct_accept[PUNCT_MAX_STATES];
+
+static void build_punct_dfa(void) {
+    int nclasses = 1;
+    int nstates = 1;
+
+    for (int i = 0, n = sizeof(punct_str) / sizeof(*punct_str); i < n; ++i) {
+        if (punct_str[i] == NULL) {
+            continue;
         }
+
+        int state = 0;
+        for (char *q = punct_str[i]; *q != '\0'; ++q) {
+            unsigned char c = *q;
+            if (punct_class[c] == 0) {
+                assert(nclasses < PUNCT_MAX_CLASSES);
+                punct_class[c] = nclasses++;
+            }
+
+            unsigned char *next = &punct_next[state][punct_class[c]];
+            if (*next == 0) {
+                assert(nstates < PUNCT_MAX_STATES);
+                *next = nstates++;
+            }
+            state = *next;
+        }
+        punct_accept[state] = i;
     }
 
-    return false;
+    return;
+}
+
+// Returns the length of the longest punctuator at p, or 0 if there is none.
+static int read_punct(char *p, PunctKind *punct) {
+    int state = 0;
+    int len = 0;
+
+    for (int i = 0; ; ++i) {
+        state = punct_next[state][punct_class[(unsigned char)p[i]]];
+        if (state == 0) {
+            return len;
+        }
+
+        if (punct_accept[state] != PU_NONE) {
+            *punct = punct_accept[state];
+            len = i + 1;
+        }
+    }
+}
+
+// Keywords are recognized with a perfect hash of an identifier's length
+// and its first and last characters. The association values were picked so
+// that every keyword gets a slot of its own; adding a keyword means choosing
+// new values (and possibly a bigger table) that keep the slots distinct.
+#define KW_TABLE_SIZE 8
+
+static unsigned char kw_asso[256] = {
+    ['c'] = 3, ['e'] = 4, ['f'] = 6, ['i'] = 5, ['s'] = 4, ['t'] = 3, ['w'] = 1,
+};
+
+static struct {
+    char *name;
+    int len;
+    KeywordKind kw;
+} kw_table[KW_TABLE_SIZE] = {
+    [0] = { "sizeof", 6, KW_SIZEOF },
+    [1] = { "for",    3, KW_FOR    },
+    [2] = { "while",  5, KW_WHILE  },
+    [3] = { "int",    3, KW_INT    },
+    [4] = { "else",   4, KW_ELSE   },
+    [5] = { "if",     2, KW_IF     },
+    [6] = { "return", 6, KW_RETURN },
+    [7] = { "char",   4, KW_CHAR   },
+};
+
+static KeywordKind find_keyword(char *p, int len) {
+    unsigned char first = p[0];
+    unsigned char last = p[len - 1];
+    int h = (len + kw_asso[first] + kw_asso[last]) & (KW_TABLE_SIZE - 1);
+
+    if (kw_table[h].len == len && memcmp(kw_table[h].name, p, len) == 0) {
+        return kw_table[h].kw;
+    }
+
+    return KW_NONE;
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -161,7 +398,7 @@ static int read_escaped_char(char **new_pos, char *p) {
     if (*p == 'x') {
         p += 1;
         if (!isxdigit(*p)) {
-            error_at(p, "Invalid hex escape sequence");
+            lex_error(p, "Invalid hex escape sequence");
         }
 
         int c = 0;
@@ -195,7 +432,8 @@ static int read_escaped_char(char **new_pos, char *p) {
 static char *string_literal_end(char *p) {
     for (char *start = p; *p != '"'; ++p) {
         if (*p == '\n' || *p == '\0') {
-            error_at(start, "Unclosed string literal");
+            lex_error(start, "Unclosed string literal");
+            return p;
         }
 
         if (*p == '\\') {
@@ -206,9 +444,9 @@ static char *string_literal_end(char *p) {
     return p;
 }
 
-static Token *read_string_literal(char *start) {
+static Token read_string_literal(char *start) {
     char *end = string_literal_end(start + 1);
-    char *buf = calloc(1, end - start);
+    char *buf = arena_alloc(end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end; ) {
@@ -219,104 +457,136 @@ static Token *read_string_literal(char *start) {
         }
     }
 
-    Token *tk = new_token(TK_STR, start, end + 1);
-    tk->ty = array_of(ty_char, len + 1);
-    tk->str = buf;
-    return tk;
+    uint32_t idx = add_str(buf, array_of(ty_char, len + 1));
+    return new_token(TK_STR, start, end + 1, idx);
 }
 
-static void convert_keywords(Token *tk) {
-    for (Token *t = tk; t->kind != TK_EOF; t = t->next) {
-        if (is_keyword(t)) {
-            t->kind = TK_KEYWORD;
-        }
-    }
-
-    return;
-}
+static Token tokenize(char *filename, char *p) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, build_punct_dfa);
+    scan_init();
 
-Token *tokenize(char *filename, char *p) {
-    current_filename = filename;
-    current_input = p;
-    Token head = {0};
-    Token *cur = &head;
+    num_errors = 0;
+    error_recovery = NULL;
+    error_token = -1;
+    tokens = new_stream(filename, p);
 
     while (*p != '\0') {
         if (isspace(*p)) {
-            p += 1;
+            p = skip_space(p);
             continue;
         }
 
-        if (starts_with(p, "//")) {
-            p += 2;
-            while (*p != '\n') {
-                p += 1;
-            }
+        if (p[0] == '/' && p[1] == '/') {
+            p = find_newline(p + 2);
             continue;
         }
 
-        if (starts_with(p, "/*")) {
-            char *q = strstr(p + 2, "*/");
+        if (p[0] == '/' && p[1] == '*') {
+            char *q = find_comment_end(p + 2);
             if (!q) {
-                error_at(p, "Unclosed block comment");
+                lex_error(p, "Unclosed block comment");
+                p += strlen(p);
+                continue;
             }
             p = q + 2;
             continue;
         }
 
         if (isdigit(*p)) {
-            cur->next = new_token(TK_NUM, p, p);
-            cur = cur->next;
-            char *q = p;
-            cur->val = strtoll(p, &p, 10);
-            cur->len = p - q;
+            char *q = skip_digits(p);
+            new_token(TK_NUM, p, q, add_val(read_number(p, q)));
+            p = q;
             continue;
         }
 
         if (*p == '"') {
-            cur->next = read_string_literal(p);
-            cur = cur->next;
-            p += cur->len;
+            Token tk = read_string_literal(p);
+            p += tk_len(tk);
             continue;
         }
 
         if (is_ident1(*p)) {
-            char *start = p++;
-            while (is_ident2(*p)) {
-                p += 1;
+            char *start = p;
+            p = skip_ident(p + 1);
+            KeywordKind kw = find_keyword(start, p - start);
+            if (kw != KW_NONE) {
+                new_token(TK_KEYWORD, start, p, kw);
+            } else {
+                new_token(TK_IDENT, start, p, intern(start, p - start));
             }
-            cur->next = new_token(TK_IDENT, start, p);
-            cur = cur->next;
             continue;
         }
 
-        int punct_len = read_punct(p);
+        PunctKind punct;
+        int punct_len = read_punct(p, &punct);
         if (punct_len > 0) {
-            cur->next = new_token(TK_PUNCT, p, p + punct_len);
-            cur = cur->next;
+            new_token(TK_PUNCT, p, p + punct_len, punct);
             p += punct_len;
             continue;
         }
 
-        error_at(p, "Invalid token");
+        lex_error(p, "Invalid token");
+        p += 1;
     }
 
-    cur->next = new_token(TK_EOF, p, p);
-    convert_keywords(head.next);
-    return head.next;
+    new_token(TK_EOF, p, p, 0);
+    return 0;
 }
 
-static char *read_file(char *path) {
-    FILE *fp;
-    if (strcmp(path, "-") == 0) {
-        fp = stdin;
-    } else {
-        fp = fopen(path, "r");
-        if (fp == NULL) {
-            error("Cannot open %s: %s", path, strerror(errno));
+typedef struct {
+    void *addr;
+    size_t len;
+} Mapping;
+
+static void unmap(void *arg) {
+    Mapping *m = arg;
+    munmap(m->addr, m->len);
+    return;
+}
+
+// Maps a regular file into memory without copying it. The file is placed
+// at the start of an anonymous zero-filled region with room for the
+// terminating newline and NUL the lexer relies on plus SCAN_PADDING, so
+// those can be added in place. Returns NULL if the file cannot be
+// mapped, e.g. because it is a pipe.
+static char *map_file(FILE *fp) {
+    int fd = fileno(fp);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + 2 + SCAN_PADDING + page - 1) & ~(page - 1);
+
+    char *buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (size > 0) {
+        int prot = PROT_READ | PROT_WRITE;
+        if (mmap(buf, size, prot, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(buf, len);
+            return NULL;
         }
     }
 
+    Mapping *m = arena_new(Mapping);
+    m->addr = buf;
+    m->len = len;
+    arena_on_release(unmap, m);
+
+    if (size == 0 || buf[size - 1] != '\n') {
+        buf[size] = '\n';
+    }
+    return buf;
+}
+
+// Reads a stream that cannot be mapped, such as stdin or a pipe.
+static char *read_stream(FILE *fp) {
     char *buf;
     size_t buflen;
     FILE *out = open_memstream(&buf, &buflen);
@@ -330,19 +600,47 @@ static char *read_file(char *path) {
         fwrite(buf2, 1, n, out);
     }
 
-    if (fp != stdin) {
-        fclose(fp);
-    }
-
     fflush(out);
     if (buflen == 0 || buf[buflen - 1] != '\n') {
         fputc('\n', out);
     }
-    fputc('\0', out);
+    for (int i = 0; i < 1 + SCAN_PADDING; ++i) {
+        fputc('\0', out);
+    }
     fclose(out);
+    arena_on_release(free, buf);
     return buf;
 }
 
-Token *tokenize_file(char *path) {
+char *read_file(char *path) {
+    if (strcmp(path, "-") == 0) {
+        return read_stream(stdin);
+    }
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        error("Cannot open %s: %s", path, strerror(errno));
+    }
+
+    char *buf = map_file(fp);
+    if (buf == NULL) {
+        buf = read_stream(fp);
+    }
+
+    fclose(fp);
+    return buf;
+}
+
+Token tokenize_file(char *path) {
     return tokenize(path, read_file(path));
 }
+
+// Tokenizes len bytes at p, which need not be terminated or padded
+Token tokenize_buffer(char *filename, char *p, size_t len) {
+    char *buf = arena_alloc(len + 2 + SCAN_PADDING);
+    memcpy(buf, p, len);
+    if (len == 0 || buf[len - 1] != '\n') {
+        buf[len] = '\n';
+    }
+    return tokenize(filename, buf);
+}
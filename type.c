@@ -1,120 +1,175 @@
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "main.h"
 
 Type *ty_char = &(Type) { TY_CHAR, 1 };
 Type *ty_int  = &(Type) { TY_INT,  8 };
 
+_Thread_local long type_visits;
+
 bool is_integer(Type *ty) {
     return ty->kind == TY_INT || ty->kind == TY_CHAR;
 }
 
-Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
-    *ret = *ty;
-    return ret;
+// Derived types are hash-consed. Each type is registered under a key made
+// of its kind and components, and is created only if no type with that key
+// exists yet. The table is emptied when the arena is released, and like
+// the arena it belongs to the thread.
+static _Thread_local HashMap types;
+
+static void clear_types(void *arg) {
+    (void)arg;
+    types = (HashMap) {0};
+    return;
+}
+
+// Number of derived types created
+int type_count(void) {
+    return types.used;
+}
+
+static Type *find_type(uintptr_t *key, int len) {
+    return hashmap_get2(&types, (char *)key, sizeof(*key) * len);
+}
+
+static void add_canonical(uintptr_t *key, int len, Type *ty) {
+    if (types.buckets == NULL) {
+        arena_on_release(clear_types, NULL);
+    }
+
+    char *buf = arena_alloc(sizeof(*key) * len);
+    memcpy(buf, key, sizeof(*key) * len);
+    hashmap_put2(&types, buf, sizeof(*key) * len, ty);
+    return;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+    uintptr_t key[] = {TY_PTR, (uintptr_t)base};
+    Type *ty = find_type(key, 2);
+    if (ty != NULL) {
+        return ty;
+    }
+
+    ty = arena_new(Type);
     ty->kind = TY_PTR;
     ty->size = 8;
     ty->base = base;
+    add_canonical(key, 2, ty);
     return ty;
 }
 
-Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FUNC;
-    ty->return_ty = return_ty;
+Type *func_type(Type *return_ty, Type **params, int num_params) {
+    // The key is built on the stack unless there are many parameters, and
+    // add_canonical makes its own copy
+    uintptr_t buf[16];
+    uintptr_t *key = buf;
+    int len = num_params + 2;
+    if (len > (int)(sizeof(buf) / sizeof(*buf))) {
+        key = malloc(sizeof(*key) * len);
+        if (key == NULL) {
+            error("Out of memory");
+        }
+    }
+
+    key[0] = TY_FUNC;
+    key[1] = (uintptr_t)return_ty;
+    for (int i = 0; i < num_params; ++i) {
+        key[i + 2] = (uintptr_t)params[i];
+    }
+
+    Type *ty = find_type(key, len);
+    if (ty == NULL) {
+        ty = arena_new(Type);
+        ty->kind = TY_FUNC;
+        ty->return_ty = return_ty;
+        ty->params = arena_alloc(sizeof(*ty->params) * num_params);
+        memcpy(ty->params, params, sizeof(*ty->params) * num_params);
+        ty->num_params = num_params;
+        add_canonical(key, len, ty);
+    }
+
+    if (key != buf) {
+        free(key);
+    }
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
+    uintptr_t key[] = {TY_ARRAY, (uintptr_t)base, len};
+    Type *ty = find_type(key, 3);
+    if (ty != NULL) {
+        return ty;
+    }
+
+    ty = arena_new(Type);
     ty->kind = TY_ARRAY;
     ty->size = base->size * len;
     ty->base = base;
     ty->array_len = len;
+    add_canonical(key, 3, ty);
     return ty;
 }
 
-void add_type(Node *node) {
-    if (node == NULL) {
-        return;
-    }
-
-    if (node->ty != NULL) {
-        return;
-    }
-
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
+// Sets the type of an expression node. Nodes are typed as they are built,
+// so the operands of node already have their types. Statements have no
+// type.
+void add_type(Node node) {
+    type_visits += 1;
 
-    for (Node *n = node->body; n != NULL; n = n->next) {
-        add_type(n);
-    }
-
-    for (Node *n = node->args; n != NULL; n = n->next) {
-        add_type(n);
-    }
+    Type **ty = &nodes->ty[node];
 
-    switch (node->kind) {
+    switch (node_kind(node)) {
     case ND_ADD:
     case ND_SUB:
     case ND_MUL:
     case ND_DIV:
     case ND_NEG:
-        node->ty = node->lhs->ty;
+        *ty = node_ty(node_lhs(node));
         return;
     case ND_ASSIGN:
-        if (node->lhs->ty->kind == TY_ARRAY) {
-            error_tk(node->tk, "Not an lvalue");
+        if (node_ty(node_lhs(node))->kind == TY_ARRAY) {
+            error_tk(node_tk(node), "Not an lvalue");
         }
-        node->ty = node->lhs->ty;
+        *ty = node_ty(node_lhs(node));
         return;
     case ND_EQ:
     case ND_NE:
     case ND_LT:
     case ND_LE:
+    case ND_GT:
+    case ND_GE:
     case ND_NUM:
     case ND_FUNC_CALL:
-        node->ty = ty_int;
+        *ty = ty_int;
         return;
     case ND_VAR:
-        node->ty = node->var->ty;
+        *ty = node_var(node)->ty;
         return;
     case ND_DEREF:
-        if (node->lhs->ty->base == NULL) {
-            error_tk(node->tk, "Invalid pointer dereference");
+        if (node_ty(node_lhs(node))->base == NULL) {
+            error_tk(node_tk(node), "Invalid pointer dereference");
         }
-        node->ty = node->lhs->ty->base;
+        *ty = node_ty(node_lhs(node))->base;
         return;
     case ND_ADDR:
-        if (node->lhs->ty->kind == TY_ARRAY) {
-            node->ty = pointer_to(node->lhs->ty->base);
+        if (node_ty(node_lhs(node))->kind == TY_ARRAY) {
+            *ty = pointer_to(node_ty(node_lhs(node))->base);
         } else {
-            node->ty = pointer_to(node->lhs->ty);
+            *ty = pointer_to(node_ty(node_lhs(node)));
         }
         return;
     case ND_STMT_EXPR:
-        if (node->body) {
-            Node *stmt = node->body;
-            while (stmt->next != NULL) {
-                stmt = stmt->next;
-            }
-            if (stmt->kind == ND_EXPR_STMT) {
-                node->ty = stmt->lhs->ty;
+        if (node_count(node) > 0) {
+            Node stmt = node_children(node)[node_count(node) - 1];
+            if (node_kind(stmt) == ND_EXPR_STMT) {
+                *ty = node_ty(node_lhs(stmt));
                 return;
             }
         }
-        error_tk(node->tk, "Statement expression returning void is not supported");
+        error_tk(node_tk(node), "Statement expression returning void is not supported");
     default:
         return;
     }